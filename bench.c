@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hamming.h"
+#include "encoding_decoding.h"
+
+// Fault injection bench of the codec. A member of random bytes is encoded the
+// way an archive stores it (markers and parity records included), bits of the
+// encoded member are flipped, and it is decoded chunk by chunk as extraction
+// does. Every chunk is then compared with the source:
+//   corrected     - the decoder fixed it (or rebuilt it from parity)
+//   uncorrectable - the decoder gave up on it
+//   silent        - the decoder did not give up, but the bytes are wrong
+// Errors come in events: a bit starts one with probability -e, and an event
+// flips -L consecutive bits. The same seed flips the same bits.
+
+#define BENCH_NAME "bench"
+
+typedef struct
+{
+    size_t data_size;
+    double rate;
+    size_t burst;
+    uint64_t seed;
+    size_t sync_group;
+    size_t parity_data;
+    size_t parity_count;
+    size_t rounds;
+} bench_opts;
+
+typedef struct
+{
+    size_t flipped;
+    decode_stats stats;
+    size_t silent;
+    double enc_mbps;
+    double dec_mbps;
+} bench_result;
+
+uint64_t bench_rand(uint64_t *state)
+{
+    *state += 0x9e3779b97f4a7c15ull;
+    return hash_mix64(*state);
+}
+
+// uniform in (0, 1]
+double bench_rand_unit(uint64_t *state)
+{
+    return ((bench_rand(state) >> 11) + 1) * 0x1.0p-53;
+}
+
+// bits until the next error event
+size_t bench_error_gap(uint64_t *state, double rate)
+{
+    if (rate >= 1)
+    {
+        return 0;
+    }
+    const double gap = floor(log(bench_rand_unit(state)) / log1p(-rate));
+    return gap < (double)SIZE_MAX / 2 ? (size_t)gap : SIZE_MAX / 2;
+}
+
+size_t bench_inject(uint8_t *buf, size_t len, const bench_opts *o)
+{
+    if (o->rate <= 0)
+    {
+        return 0;
+    }
+    uint64_t state = o->seed;
+    const size_t n_bits = len * BITS_IN_BYTE;
+    size_t flipped = 0;
+    for (size_t bit = bench_error_gap(&state, o->rate); bit < n_bits; bit += o->burst + bench_error_gap(&state, o->rate))
+    {
+        for (size_t b = bit; b < bit + o->burst && b < n_bits; ++b)
+        {
+            buf[b / BITS_IN_BYTE] ^= 1 << (b % BITS_IN_BYTE);
+            flipped += 1;
+        }
+    }
+    return flipped;
+}
+
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Decodes the whole member to dst, failed[j] tells the chunks the decoder gave up on
+decode_stats bench_decode(const uint8_t *enc, size_t len, uint8_t *dst, bool *failed, config cnf)
+{
+    const size_t name_len = strlen(BENCH_NAME);
+    decode_stats stats = {0};
+    if (cnf.parity_count)
+    {
+        const size_t group = calc_parity_group_chunks(cnf);
+        for (size_t g = 0; g < calc_parity_group_count(len, cnf); ++g)
+        {
+            size_t start, record_at, end;
+            calc_parity_span(len, g, name_len, cnf, &start, &record_at, &end);
+            const decode_stats s = decode_parity_group(enc + start, len, name_len, g, dst + g * group * cnf.BYTES_per_chunk, failed + g * group, cnf);
+            stats.chunks += s.chunks;
+            stats.corrected += s.corrected;
+            stats.failed += s.failed;
+        }
+        return stats;
+    }
+    const size_t n_chunks = calc_chunk_count(len, cnf);
+    for (size_t j = 0; j < n_chunks; ++j)
+    {
+        const hamming_decode_res res = decode_chunk_to(enc + calc_chunk_enc_offset(j, name_len, cnf), len, j, dst + j * cnf.BYTES_per_chunk, cnf);
+        failed[j] = !res.ok;
+        stats.chunks += 1;
+        stats.corrected += res.ok && res.corrected;
+        stats.failed += !res.ok;
+    }
+    return stats;
+}
+
+bench_result bench_run(const uint8_t *src, size_t bytes_per_chunk, const bench_opts *o)
+{
+    config cnf = config_new(bytes_per_chunk);
+    cnf.sync_group = o->sync_group;
+    cnf.parity_data = o->parity_data;
+    cnf.parity_count = o->parity_count;
+    cnf.parity_checks_copy = o->parity_count > 0;
+    const size_t len = o->data_size;
+    const size_t n_chunks = calc_chunk_count(len, cnf);
+    bench_result r = {0};
+
+    byte_buf enc = {0};
+    const member_tag tag = {.member_id = 1, .name = BENCH_NAME};
+    double best = INFINITY;
+    for (size_t i = 0; i < o->rounds; ++i)
+    {
+        enc.len = 0;
+        const double t = bench_now();
+        encode_member_buffer(src, len, &enc, cnf, &tag, NULL, NULL);
+        best = fmin(best, bench_now() - t);
+    }
+    r.enc_mbps = len / best / 1e6;
+    assert(enc.len == calc_member_enc_size(len, strlen(BENCH_NAME), cnf));
+
+    r.flipped = bench_inject(enc.ptr, enc.len, o);
+
+    // whole chunks of room, a parity group writes all of its chunks
+    uint8_t *dst = malloc((n_chunks + calc_parity_group_chunks(cnf)) * cnf.BYTES_per_chunk);
+    bool *failed = calloc(n_chunks + calc_parity_group_chunks(cnf), sizeof(bool));
+    best = INFINITY;
+    for (size_t i = 0; i < o->rounds; ++i)
+    {
+        const double t = bench_now();
+        r.stats = bench_decode(enc.ptr, len, dst, failed, cnf);
+        best = fmin(best, bench_now() - t);
+    }
+    r.dec_mbps = len / best / 1e6;
+
+    for (size_t j = 0; j < n_chunks; ++j)
+    {
+        const size_t n = j + 1 < n_chunks ? cnf.BYTES_per_chunk : len - j * cnf.BYTES_per_chunk;
+        r.silent += !failed[j] && memcmp(dst + j * cnf.BYTES_per_chunk, src + j * cnf.BYTES_per_chunk, n) != 0;
+    }
+    free(dst);
+    free(failed);
+    byte_buf_close(&enc);
+    return r;
+}
+
+void bench_usage(void)
+{
+    fprintf(stderr,
+            "usage: hamarc_bench [-b SIZES] [-n SIZE] [-e RATE] [-L BITS] [-s SEED] [-g N] [-p N,M] [-r ROUNDS]\n"
+            "  -b  chunk sizes to compare, comma separated (64,100,256,512,4096)\n"
+            "  -n  bytes of data, K, M or G suffix (16M)\n"
+            "  -e  probability that an encoded bit starts an error event (1e-5)\n"
+            "  -L  bits flipped by an event, one after the other (1)\n"
+            "  -s  seed of the flipped positions (1)\n"
+            "  -g  chunks between resync markers, as --sync (none)\n"
+            "  -p  N data chunks and M parity blocks per stripe, as --parity (none)\n"
+            "  -r  rounds of encoding and decoding, the fastest is reported (3)\n");
+}
+
+int main(int argc, char **argv)
+{
+    bench_opts o = {.data_size = 16 * 1024 * 1024, .rate = 1e-5, .burst = 1, .seed = 1, .rounds = 3};
+    const char *sizes = "64,100,256,512,4096";
+    int c;
+    while ((c = getopt(argc, argv, "b:n:e:L:s:g:p:r:h")) != -1)
+    {
+        char *end = NULL;
+        bool ok = true;
+        switch (c)
+        {
+        case 'b':
+            sizes = optarg;
+            break;
+        case 'n':
+            ok = parse_size(optarg, &o.data_size) && o.data_size > 0;
+            break;
+        case 'e':
+            o.rate = strtod(optarg, &end);
+            ok = *end == '\0' && o.rate >= 0 && o.rate <= 1;
+            break;
+        case 'L':
+            o.burst = strtoull(optarg, &end, 10);
+            ok = *end == '\0' && o.burst > 0;
+            break;
+        case 's':
+            o.seed = strtoull(optarg, &end, 0);
+            ok = *end == '\0';
+            break;
+        case 'g':
+            o.sync_group = strtoull(optarg, &end, 10);
+            ok = *end == '\0';
+            break;
+        case 'p':
+            ok = sscanf(optarg, "%zu,%zu", &o.parity_data, &o.parity_count) == 2 &&
+                 o.parity_data > 0 && o.parity_count > 0 && o.parity_count <= PARITY_MAX_COUNT && o.parity_data + o.parity_count <= 256;
+            break;
+        case 'r':
+            o.rounds = strtoull(optarg, &end, 10);
+            ok = *end == '\0' && o.rounds > 0;
+            break;
+        default:
+            ok = false;
+        }
+        if (!ok)
+        {
+            bench_usage();
+            return 1;
+        }
+    }
+
+    uint8_t *src = malloc(o.data_size);
+    uint64_t state = o.seed ^ 0x5eed;
+    for (size_t i = 0; i < o.data_size; ++i)
+    {
+        src[i] = bench_rand(&state);
+    }
+
+    fprintf(stdout, "%zu bytes, error events %g per bit of %zu bits, seed %lu", o.data_size, o.rate, o.burst, o.seed);
+    if (o.sync_group)
+    {
+        fprintf(stdout, ", sync every %zu chunks", o.sync_group);
+    }
+    if (o.parity_count)
+    {
+        fprintf(stdout, ", parity %zu+%zu", o.parity_data, o.parity_count);
+    }
+    fprintf(stdout, "\n%6s %7s %9s %9s %9s %10s %14s %9s %10s %10s\n",
+            "chunk", "codec", "overhead", "flipped", "chunks", "corrected", "uncorrectable", "silent", "enc MB/s", "dec MB/s");
+
+    for (const char *p = sizes; *p;)
+    {
+        char *end;
+        const size_t bytes = strtoull(p, &end, 10);
+        if (end == p || bytes == 0 || (*end != ',' && *end != '\0'))
+        {
+            bench_usage();
+            free(src);
+            return 1;
+        }
+        p = *end == ',' ? end + 1 : end;
+
+        const bench_result r = bench_run(src, bytes, &o);
+        config cnf = config_new(bytes);
+        cnf.sync_group = o.sync_group;
+        cnf.parity_data = o.parity_data;
+        cnf.parity_count = o.parity_count;
+        cnf.parity_checks_copy = o.parity_count > 0;
+        const double overhead = (double)calc_member_enc_size(o.data_size, strlen(BENCH_NAME), cnf) / o.data_size - 1;
+        fprintf(stdout, "%6zu %7s %8.2f%% %9zu %9zu %10zu %14zu %9zu %10.1f %10.1f\n",
+                bytes, cnf.codec ? "fixed" : "generic", overhead * 100, r.flipped, r.stats.chunks,
+                r.stats.corrected, r.stats.failed, r.silent, r.enc_mbps, r.dec_mbps);
+    }
+    free(src);
+    return 0;
+}
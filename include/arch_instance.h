@@ -7,31 +7,418 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <fcntl.h>
 
 #include "helper.h"
 #include "encoding_decoding.h"
+#include "fs_walk.h"
+#include "free_space.h"
+#include "sync_marker.h"
+#include "direct_io.h"
+#include "arena.h"
 
 #define DEFAULT_BYTES_PER_CHUNK 100
-#define DEFAULT_FREE_FILE_COUNT 0
+
+// Layout: [header slot 0][header slot 1][intent][member data, member table, lookup block...][tail header]
+//
+// Nothing that the current header points to is overwritten. New member data
+// and the new member table (packed records followed by the name table) go to
+// free space, then the header is committed to the other slot with seq + 1.
+// On open the valid slot with the higher seq wins, so a crash at any point
+// leaves either the old or the new archive.
+//
+// The header and the member table are Hamming-encoded like member data. The
+// table is stored twice and decoded chunk by chunk from whichever copy can be
+// corrected; after each commit the header is also copied to a slot at the end
+// of the file, which is read when neither front slot decodes. The lookup
+// block answers whether a name is in the archive without the table (see
+// arch_contains), it is written along with the table and stored once.
+#define ARCH_SLOT_SIZE 512
+#define ARCH_INTENT_OFFSET (2 * ARCH_SLOT_SIZE)
+#define ARCH_DATA_OFFSET (3 * ARCH_SLOT_SIZE)
+// small chunks, so that every 8 bytes of the header survive a flipped bit
+#define ARCH_META_BYTES_PER_CHUNK 8
+
+// On disk the header is serialized field by field, little-endian, and then
+// Hamming-encoded into its slot:
+//   "HAM", u8 format version
+//   le32 feature flags, an archive using a flag the reader does not know is refused
+//   le64 seq, file_count, bytes_per_read, sync_group,
+//        dir_offset, dir_copy_offset, dir_size, names_size
+//   le64 parity_data, parity_count, only with ARCH_FEATURE_PARITY
+//   le64 lookup_offset, lookup_size, only with ARCH_FEATURE_LOOKUP
+//   le64 checksum of everything before it
+// ARCH_FEATURE_HASH_TREE has no fields: every member ends with its hash tree
+// and its record carries the root. Nor has ARCH_FEATURE_MEMBER_ATTRS, set on
+// every archive created since: the records carry mode and owner. Nor has
+// ARCH_FEATURE_PARITY_CHECKS_COPY, set on every archive created since with
+// parity: each parity record ends with a second copy of its chunk checks.
+// New layouts either get a feature flag or bump the version, so archives
+// written before them keep reading.
+#define ARCH_FORMAT_VERSION 1
+#define ARCH_FEATURE_SYNC_MARKERS (1u << 0)
+#define ARCH_FEATURE_PARITY (1u << 1)
+#define ARCH_FEATURE_LOOKUP (1u << 2)
+#define ARCH_FEATURE_HASH_TREE (1u << 3)
+#define ARCH_FEATURE_MEMBER_ATTRS (1u << 4)
+#define ARCH_FEATURE_PARITY_CHECKS_COPY (1u << 5)
+#define ARCH_KNOWN_FEATURES (ARCH_FEATURE_SYNC_MARKERS | ARCH_FEATURE_PARITY | ARCH_FEATURE_LOOKUP | ARCH_FEATURE_HASH_TREE | ARCH_FEATURE_MEMBER_ATTRS | \
+                             ARCH_FEATURE_PARITY_CHECKS_COPY)
+#define ARCH_HEADER_SIZE 80
+#define ARCH_HEADER_MAX_SIZE (ARCH_HEADER_SIZE + 32)
 
 typedef struct
 {
-    char id[3];
+    uint64_t seq;
     size_t file_count;
-    size_t free_file_count;
     size_t bytes_per_read;
+    size_t sync_group; // chunks between the resync markers of a member, 0 for none
+    size_t parity_data;
+    size_t parity_count; // parity blocks for every parity_data chunks, 0 for none
+    bool parity_checks_copy;
+    size_t dir_offset; // packed member records, followed by the name table
+    size_t dir_copy_offset;
+    size_t dir_size;
+    size_t names_size;
+    size_t lookup_offset;
+    size_t lookup_size; // decoded, 0 for no lookup block
+    bool hash_tree;
+    bool member_attrs;
 } arch_header;
 
-#define arch_file_header_NAME_LEN 100
+uint32_t arch_header_features(const arch_header *hdr)
+{
+    return (hdr->sync_group ? ARCH_FEATURE_SYNC_MARKERS : 0) | (hdr->parity_count ? ARCH_FEATURE_PARITY : 0) | (hdr->lookup_size ? ARCH_FEATURE_LOOKUP : 0) |
+           (hdr->hash_tree ? ARCH_FEATURE_HASH_TREE : 0) | (hdr->member_attrs ? ARCH_FEATURE_MEMBER_ATTRS : 0) |
+           (hdr->parity_checks_copy ? ARCH_FEATURE_PARITY_CHECKS_COPY : 0);
+}
+
+size_t arch_header_size(uint32_t features)
+{
+    return ARCH_HEADER_SIZE + (features & ARCH_FEATURE_PARITY ? 16 : 0) + (features & ARCH_FEATURE_LOOKUP ? 16 : 0);
+}
+
+void arch_header_serialize(const arch_header *hdr, byte_buf *out)
+{
+    const size_t start = out->len;
+    const uint8_t id[4] = {'H', 'A', 'M', ARCH_FORMAT_VERSION};
+    byte_buf_push(out, id, sizeof(id));
+    le32_push(out, arch_header_features(hdr));
+    const uint64_t fields[] = {hdr->seq, hdr->file_count, hdr->bytes_per_read, hdr->sync_group, hdr->dir_offset, hdr->dir_copy_offset, hdr->dir_size, hdr->names_size};
+    for (size_t i = 0; i < COUNT_OF(fields); ++i)
+    {
+        le64_push(out, fields[i]);
+    }
+    if (hdr->parity_count)
+    {
+        le64_push(out, hdr->parity_data);
+        le64_push(out, hdr->parity_count);
+    }
+    if (hdr->lookup_size)
+    {
+        le64_push(out, hdr->lookup_offset);
+        le64_push(out, hdr->lookup_size);
+    }
+    le64_push(out, content_hash_update(CONTENT_HASH_INIT, out->ptr + start, out->len - start));
+    assert(out->len - start == arch_header_size(arch_header_features(hdr)));
+}
+
+// src holds size bytes, as arch_header_size tells for the features it starts with
+bool arch_header_deserialize(const uint8_t *src, size_t size, arch_header *hdr)
+{
+    const uint8_t *p = src, *end = src + size;
+    uint64_t checksum;
+    if (memcmp(p, "HAM", 3) != 0 ||
+        !le64_read(&(const uint8_t *){end - 8}, end, &checksum) ||
+        checksum != content_hash_update(CONTENT_HASH_INIT, src, size - 8))
+    {
+        return false;
+    }
+    if (p[3] > ARCH_FORMAT_VERSION)
+    {
+        fprintf(stderr, "arch format version %u is newer than this hamarc (%u)\n", p[3], ARCH_FORMAT_VERSION);
+        return false;
+    }
+    p += 4;
+
+    uint32_t features = 0;
+    le32_read(&p, end, &features);
+    if (features & ~ARCH_KNOWN_FEATURES)
+    {
+        fprintf(stderr, "arch uses unknown features %#x\n", features & ~ARCH_KNOWN_FEATURES);
+        return false;
+    }
+    if (size != arch_header_size(features))
+    {
+        return false;
+    }
+
+    // the optional pairs follow the base fields in the order of their flags
+    uint64_t fields[12] = {0};
+    for (size_t i = 0; i < 8; ++i)
+    {
+        le64_read(&p, end, &fields[i]);
+    }
+    if (features & ARCH_FEATURE_PARITY)
+    {
+        le64_read(&p, end, &fields[8]);
+        le64_read(&p, end, &fields[9]);
+    }
+    if (features & ARCH_FEATURE_LOOKUP)
+    {
+        le64_read(&p, end, &fields[10]);
+        le64_read(&p, end, &fields[11]);
+    }
+    *hdr = (arch_header){
+        .seq = fields[0],
+        .file_count = fields[1],
+        .bytes_per_read = fields[2],
+        .sync_group = fields[3],
+        .dir_offset = fields[4],
+        .dir_copy_offset = fields[5],
+        .dir_size = fields[6],
+        .names_size = fields[7],
+        .parity_data = fields[8],
+        .parity_count = fields[9],
+        .lookup_offset = fields[10],
+        .lookup_size = fields[11],
+        .hash_tree = features & ARCH_FEATURE_HASH_TREE,
+        .member_attrs = features & ARCH_FEATURE_MEMBER_ATTRS,
+        .parity_checks_copy = features & ARCH_FEATURE_PARITY_CHECKS_COPY,
+    };
+    if ((features & ARCH_FEATURE_PARITY) && (hdr->parity_count == 0 || hdr->parity_count > PARITY_MAX_COUNT || hdr->parity_data == 0 || hdr->parity_data + hdr->parity_count > 256))
+    {
+        return false;
+    }
+    return features == arch_header_features(hdr);
+}
+
+// size of one encoded copy of the member table
+size_t arch_header_dir_enc_size(const arch_header *hdr, config cnf)
+{
+    return calc_encoded_size(hdr->dir_size + hdr->names_size, cnf);
+}
+
+size_t arch_header_lookup_enc_size(const arch_header *hdr, config cnf)
+{
+    return calc_encoded_size(hdr->lookup_size, cnf);
+}
+
+void arch_header_encode(const arch_header *hdr, byte_buf *slot)
+{
+    byte_buf raw = {0};
+    arch_header_serialize(hdr, &raw);
+    encode_buffer(raw.ptr, raw.len, slot, config_new(ARCH_META_BYTES_PER_CHUNK));
+    byte_buf_close(&raw);
+    assert(slot->len <= ARCH_SLOT_SIZE);
+}
+
+// false if the slot at offset is damaged beyond correction or holds no header
+bool arch_header_read_slot(int fd, int64_t offset, arch_header *hdr, bool *corrected)
+{
+    decode_stats stats = {0};
+    uint8_t raw[ARCH_HEADER_MAX_SIZE];
+    const config meta = config_new(ARCH_META_BYTES_PER_CHUNK);
+    // the first chunk holds the feature flags, they tell the size of the rest
+    if (offset < 0 || !decode_region(fd, offset, -1, ARCH_META_BYTES_PER_CHUNK, raw, meta, &stats))
+    {
+        return false;
+    }
+    const size_t size = arch_header_size(raw[4] | raw[5] << 8 | raw[6] << 16 | (uint32_t)raw[7] << 24);
+    stats = (decode_stats){0};
+    if (!decode_region(fd, offset, -1, size, raw, meta, &stats))
+    {
+        return false;
+    }
+    *corrected = stats.corrected > 0;
+    return arch_header_deserialize(raw, size, hdr);
+}
+
+// Written before the first byte of an operation lands in the file. It only
+// means something while the current header still has seq == base_seq: the
+// commit of the operation retires it, so it never has to be cleared.
+// On disk: le64 base_seq, le64 file_size, le64 checksum of the two.
+#define ARCH_INTENT_SIZE 24
+typedef struct
+{
+    uint64_t base_seq;
+    uint64_t file_size; // everything past it is uncommitted
+} arch_intent;
+
+void arch_intent_serialize(const arch_intent *intent, byte_buf *out)
+{
+    const size_t start = out->len;
+    le64_push(out, intent->base_seq);
+    le64_push(out, intent->file_size);
+    le64_push(out, content_hash_update(CONTENT_HASH_INIT, out->ptr + start, out->len - start));
+}
+
+bool arch_intent_deserialize(const uint8_t *src, arch_intent *intent)
+{
+    const uint8_t *p = src, *end = src + ARCH_INTENT_SIZE;
+    uint64_t checksum;
+    le64_read(&p, end, &intent->base_seq);
+    le64_read(&p, end, &intent->file_size);
+    le64_read(&p, end, &checksum);
+    return checksum == content_hash_update(CONTENT_HASH_INIT, src, ARCH_INTENT_SIZE - 8);
+}
+
+// In memory every member gets a fixed-size record. On disk a record is
+//   varint init_size
+//   varint zigzag(offset - end of the previous member)
+//   varint zigzag(mtime - mtime of the previous member)
+//   le64   hash
+//   varint name_len
+//   32 bytes of BLAKE3 root, only with ARCH_FEATURE_HASH_TREE
+//   varint mode, zigzag(uid - uid of the previous member), zigzag(gid - gid of
+//          the previous member), only with ARCH_FEATURE_MEMBER_ATTRS
+// enc_size follows from init_size, name offsets from the order of the records.
 typedef struct
 {
     size_t init_size;
     size_t enc_size;
     size_t offset;
-    char filename[arch_file_header_NAME_LEN];
+    int64_t mtime; // ns
+    uint64_t hash;  // FNV-1a of the source bytes
+    size_t name_offset; // into the name table, names are NUL-terminated there
+    size_t name_len;
+    uint8_t root[BLAKE3_OUT_LEN]; // of the hash tree, zeros when not known
+    uint32_t mode; // st_mode of the file, 0 when not known
+    uint32_t uid;
+    uint32_t gid;
 } arch_file_header;
 
+// state carried between consecutive records while packing
+typedef struct
+{
+    size_t prev_end;
+    int64_t prev_mtime;
+    uint32_t prev_uid;
+    uint32_t prev_gid;
+    bool roots;
+    bool attrs;
+} arch_file_header_packer;
+
+arch_file_header_packer arch_file_header_packer_new(config cnf)
+{
+    return (arch_file_header_packer){.prev_end = ARCH_DATA_OFFSET, .prev_mtime = 0, .roots = cnf.hash_tree, .attrs = cnf.member_attrs};
+}
+
+void arch_file_header_pack_one(arch_file_header_packer *pk, const arch_file_header *hdr, byte_buf *dst)
+{
+    varint_push(dst, hdr->init_size);
+    varint_push(dst, zigzag_encode((int64_t)hdr->offset - (int64_t)pk->prev_end));
+    varint_push(dst, zigzag_encode(hdr->mtime - pk->prev_mtime));
+    le64_push(dst, hdr->hash);
+    varint_push(dst, hdr->name_len);
+    if (pk->roots)
+    {
+        byte_buf_push(dst, hdr->root, BLAKE3_OUT_LEN);
+    }
+    // the members of a tree mostly share an owner, a delta keeps it to a byte
+    if (pk->attrs)
+    {
+        varint_push(dst, hdr->mode);
+        varint_push(dst, zigzag_encode((int64_t)hdr->uid - pk->prev_uid));
+        varint_push(dst, zigzag_encode((int64_t)hdr->gid - pk->prev_gid));
+        pk->prev_uid = hdr->uid;
+        pk->prev_gid = hdr->gid;
+    }
+    pk->prev_end = hdr->offset + hdr->enc_size;
+    pk->prev_mtime = hdr->mtime;
+}
+
+void arch_file_headers_pack(const arch_file_header *hdrs, size_t count, byte_buf *dst, config cnf)
+{
+    arch_file_header_packer pk = arch_file_header_packer_new(cnf);
+    for (size_t i = 0; i < count; ++i)
+    {
+        arch_file_header_pack_one(&pk, &hdrs[i], dst);
+    }
+}
+
+#define ARCH_FILE_HEADER_MAX_PACKED (7 * 10 + 8 + BLAKE3_OUT_LEN)
+
+// state carried between consecutive records while unpacking
+typedef struct
+{
+    config cnf;
+    size_t prev_end;
+    int64_t prev_mtime;
+    uint32_t prev_uid;
+    uint32_t prev_gid;
+    size_t name_offset;
+} arch_file_header_unpacker;
+
+arch_file_header_unpacker arch_file_header_unpacker_new(config cnf)
+{
+    return (arch_file_header_unpacker){.cnf = cnf, .prev_end = ARCH_DATA_OFFSET, .prev_mtime = 0, .name_offset = 0};
+}
+
+bool arch_file_header_unpack_one(arch_file_header_unpacker *u, const uint8_t **p, const uint8_t *end, arch_file_header *hdr)
+{
+    uint64_t init_size, offset_delta, mtime_delta, name_len;
+    if (!varint_read(p, end, &init_size) ||
+        !varint_read(p, end, &offset_delta) ||
+        !varint_read(p, end, &mtime_delta) ||
+        !le64_read(p, end, &hdr->hash) ||
+        !varint_read(p, end, &name_len) ||
+        (u->cnf.hash_tree && end - *p < BLAKE3_OUT_LEN))
+    {
+        return false;
+    }
+    memset(hdr->root, 0, BLAKE3_OUT_LEN);
+    if (u->cnf.hash_tree)
+    {
+        memcpy(hdr->root, *p, BLAKE3_OUT_LEN);
+        *p += BLAKE3_OUT_LEN;
+    }
+    hdr->mode = hdr->uid = hdr->gid = 0;
+    if (u->cnf.member_attrs)
+    {
+        uint64_t mode, uid_delta, gid_delta;
+        if (!varint_read(p, end, &mode) || !varint_read(p, end, &uid_delta) || !varint_read(p, end, &gid_delta))
+        {
+            return false;
+        }
+        hdr->mode = mode;
+        hdr->uid = u->prev_uid + zigzag_decode(uid_delta);
+        hdr->gid = u->prev_gid + zigzag_decode(gid_delta);
+        u->prev_uid = hdr->uid;
+        u->prev_gid = hdr->gid;
+    }
+    hdr->init_size = init_size;
+    hdr->enc_size = calc_member_enc_size(init_size, name_len, u->cnf);
+    hdr->offset = u->prev_end + zigzag_decode(offset_delta);
+    hdr->mtime = u->prev_mtime + zigzag_decode(mtime_delta);
+    hdr->name_offset = u->name_offset;
+    hdr->name_len = name_len;
+
+    u->prev_end = hdr->offset + hdr->enc_size;
+    u->prev_mtime = hdr->mtime;
+    u->name_offset += name_len + 1;
+    return true;
+}
+
+bool arch_file_headers_unpack(arch_file_header *hdrs, size_t count, const uint8_t *src, size_t src_size, config cnf)
+{
+    const uint8_t *p = src, *end = src + src_size;
+    arch_file_header_unpacker u = arch_file_header_unpacker_new(cnf);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!arch_file_header_unpack_one(&u, &p, end, &hdrs[i]))
+        {
+            return false;
+        }
+    }
+    return p == end;
+}
+
 typedef struct
 {
     FILE *f;
@@ -39,7 +426,31 @@ typedef struct
 
     arch_header hdr;
     config cnf;
+    // the member table is only read by arch_instance_load_files
+    bool files_loaded;
     arch_file_header *file_hdrs;
+    size_t file_hdrs_cap;
+    char *names;
+    size_t names_cap;
+
+    // set up by the first change of an operation, dropped by the commit
+    bool in_write;
+    free_space space;
+    size_t reserved_end;
+    // member data starts at multiples of it, 0 or 1 for no alignment
+    size_t align;
+    // keep the page cache out of bulk reads and writes
+    bool no_cache;
+    FILE *direct_f; // O_DIRECT reader of the archive, opened on first use
+    // --max-memory, 0 for no limit
+    size_t max_memory;
+    // members encoded since open, the low half of their resync marker ids
+    uint32_t members_encoded;
+    // temporaries of an operation, rewound to a mark when it is over
+    arena scratch;
+
+    // the header or the member table needed correction when read
+    bool meta_damaged;
 } arch_instance;
 
 typedef struct
@@ -48,58 +459,219 @@ typedef struct
     size_t len;
 } string_array;
 
+// arr and the strings live in mem
 typedef struct
 {
     char **arr;
     size_t len;
+    arena mem;
 } string_array_to_free;
 
 void string_array_to_free_close(string_array_to_free *inst)
 {
-    for (size_t i = 0; i < inst->len; ++i)
-    {
-        free(inst->arr[i]);
-    }
-    free(inst->arr);
+    arena_free(&inst->mem);
     *inst = (string_array_to_free){0};
 }
 
 void arch_instance_close(arch_instance *inst)
 {
     free(inst->file_hdrs);
+    free(inst->names);
+    free_space_close(&inst->space);
+    arena_free(&inst->scratch);
+    if (inst->direct_f)
+    {
+        fclose(inst->direct_f);
+    }
     fclose(inst->f);
     *inst = (arch_instance){0};
 }
 
+const char *arch_file_name(const arch_instance *inst, const arch_file_header *hdr)
+{
+    return inst->names + hdr->name_offset;
+}
+
+// What a loaded member table takes, roughly: the records and names, and per
+// member the extents and index slots an operation on it builds and what the
+// commit sorts and writes for the lookup block
+#define ARCH_MEMBER_MEMORY (sizeof(arch_file_header) + 2 * sizeof(extent) + 5 * sizeof(size_t))
+// of --max-memory, at least this much is left to buffers
+#define ARCH_MIN_IO_MEMORY (1024 * 1024)
+#define ARCH_MIN_MEMORY (2 * ARCH_MIN_IO_MEMORY)
+
+size_t arch_table_memory(const arch_header *hdr)
+{
+    return hdr->file_count * ARCH_MEMBER_MEMORY + 2 * hdr->names_size;
+}
+
+// The part of --max-memory the buffers of an operation may use, 0 for no limit
+size_t arch_io_budget(const arch_instance *inst)
+{
+    if (inst->max_memory == 0)
+    {
+        return 0;
+    }
+    const size_t table = inst->files_loaded ? arch_table_memory(&inst->hdr) : 0;
+    return inst->max_memory > table + ARCH_MIN_IO_MEMORY ? inst->max_memory - table : ARCH_MIN_IO_MEMORY;
+}
+
+// Operations that hold member tables whole check them against --max-memory up front
+bool __arch_table_fits(const arch_instance *inst, size_t table)
+{
+    if (inst->max_memory && table + ARCH_MIN_IO_MEMORY > inst->max_memory)
+    {
+        fprintf(stderr, "arch %s: member tables need about %lu bytes, more than --max-memory %lu allows\n", inst->name, table + ARCH_MIN_IO_MEMORY, inst->max_memory);
+        return false;
+    }
+    return true;
+}
+
+// ARCH_ALIGN_BLOCK aligns member data to the block size of the archive's filesystem
+#define ARCH_ALIGN_BLOCK SIZE_MAX
+
+void arch_instance_set_align(arch_instance *inst, size_t align)
+{
+    struct stat st;
+    if (align == ARCH_ALIGN_BLOCK)
+    {
+        align = fstat(fileno(inst->f), &st) == 0 && st.st_blksize > 0 ? (size_t)st.st_blksize : 4096;
+    }
+    inst->align = align;
+}
+
+arch_file_header *__arch_push_file_header(arch_instance *inst, arch_file_header hdr, const char *name)
+{
+    size_t len = strlen(name);
+    if (inst->hdr.names_size + len + 1 > inst->names_cap)
+    {
+        inst->names_cap = inst->names_cap * 2 > inst->hdr.names_size + len + 1 ? inst->names_cap * 2 : inst->hdr.names_size + len + 1 + 4096;
+        inst->names = realloc(inst->names, inst->names_cap);
+    }
+    memcpy(inst->names + inst->hdr.names_size, name, len + 1);
+    hdr.name_offset = inst->hdr.names_size;
+    hdr.name_len = len;
+    inst->hdr.names_size += len + 1;
+
+    if (inst->hdr.file_count == inst->file_hdrs_cap)
+    {
+        inst->file_hdrs_cap = inst->file_hdrs_cap ? inst->file_hdrs_cap * 2 : 16;
+        inst->file_hdrs = realloc(inst->file_hdrs, inst->file_hdrs_cap * sizeof(arch_file_header));
+    }
+    inst->file_hdrs[inst->hdr.file_count] = hdr;
+    return &inst->file_hdrs[inst->hdr.file_count++];
+}
+
+void __arch_datasync(arch_instance *inst)
+{
+    fflush(inst->f);
+    if (fdatasync(fileno(inst->f)))
+    {
+        fprintf(stderr, "arch %s could not be synced to disk\n", inst->name);
+    }
+}
+
+// the one atomic step of every change
+void __arch_commit_header(arch_instance *inst)
+{
+    inst->hdr.seq += 1;
+    byte_buf slot = {0};
+    arch_header_encode(&inst->hdr, &slot);
+    file_write_pos((inst->hdr.seq % 2) * ARCH_SLOT_SIZE, slot.ptr, slot.len, inst->f);
+    byte_buf_close(&slot);
+    __arch_datasync(inst);
+}
+
+// Puts the copy of the committed header right after used_end and drops the rest of the file
+void __arch_write_tail(arch_instance *inst, size_t used_end)
+{
+    byte_buf slot = {0};
+    arch_header_encode(&inst->hdr, &slot);
+    byte_buf_reserve(&slot, ARCH_SLOT_SIZE);
+    memset(slot.ptr + slot.len, 0, ARCH_SLOT_SIZE - slot.len);
+    file_write_pos(used_end, slot.ptr, ARCH_SLOT_SIZE, inst->f);
+    byte_buf_close(&slot);
+    fflush(inst->f);
+
+    struct stat st = {0};
+    fstat(fileno(inst->f), &st);
+    if ((size_t)st.st_size > used_end + ARCH_SLOT_SIZE && ftruncate(fileno(inst->f), used_end + ARCH_SLOT_SIZE))
+    {
+        fprintf(stderr, "arch %s could not be truncated after header sync\n", inst->name);
+    }
+}
+
 arch_instance arch_instance_create_empty(const char *path, config cnf)
 {
     if (cnf.BYTES_per_chunk == 0)
     {
-        cnf = config_new(DEFAULT_BYTES_PER_CHUNK, DEFAULT_FREE_FILE_COUNT);
+        cnf = config_new(DEFAULT_BYTES_PER_CHUNK);
     }
+    cnf.member_attrs = true;
+    cnf.parity_checks_copy = cnf.parity_count > 0;
     FILE *f = fopen(path, "w+");
     if (!f)
     {
         fprintf(stderr, "arch (created) at path [%s] could not be created\n", path);
         return (arch_instance){0};
     }
-    arch_header hdr = {.file_count = 0, .id = "HAM", .free_file_count = 0, .bytes_per_read = cnf.BYTES_per_chunk};
+    arch_header hdr = {.file_count = 0, .seq = 0, .bytes_per_read = cnf.BYTES_per_chunk, .sync_group = cnf.sync_group, .parity_data = cnf.parity_data, .parity_count = cnf.parity_count, .dir_offset = ARCH_DATA_OFFSET, .dir_copy_offset = ARCH_DATA_OFFSET, .dir_size = 0, .names_size = 0, .hash_tree = cnf.hash_tree, .member_attrs = cnf.member_attrs, .parity_checks_copy = cnf.parity_checks_copy};
     arch_instance inst = {
         .f = f,
         .name = get_clean_filename(path),
         .hdr = hdr,
+        .files_loaded = true,
         .file_hdrs = NULL,
         .cnf = cnf,
     };
-    if (fwrite(&hdr, sizeof(arch_header), 1, f) != 1)
+    if (ftruncate(fileno(f), ARCH_DATA_OFFSET))
     {
         fprintf(stderr, "arch (created) at path [%s] could not be written with header\n", path);
+        fclose(f);
         return (arch_instance){0};
     }
+    __arch_commit_header(&inst);
+    __arch_write_tail(&inst, ARCH_DATA_OFFSET);
 
     return inst;
 }
 
+// Drops whatever an operation that never committed left past the old end of the file
+void __arch_recover_intent(int fd, const arch_header *hdr, const char *path)
+{
+    uint8_t raw[ARCH_INTENT_SIZE];
+    arch_intent intent;
+    struct stat st;
+    if (pread(fd, raw, ARCH_INTENT_SIZE, ARCH_INTENT_OFFSET) != ARCH_INTENT_SIZE ||
+        !arch_intent_deserialize(raw, &intent) ||
+        intent.base_seq != hdr->seq ||
+        fstat(fd, &st) ||
+        (uint64_t)st.st_size <= intent.file_size)
+    {
+        return;
+    }
+    fprintf(stderr, "arch %s: discarding %lu bytes of an unfinished operation\n", path, (size_t)st.st_size - intent.file_size);
+    if (ftruncate(fd, intent.file_size))
+    {
+        fprintf(stderr, "arch %s could not be truncated\n", path);
+    }
+}
+
+// Archives written before the format got its version started with a bare
+// "HAM" followed by file_count, free_file_count and bytes_per_read as raw
+// size_t. Their records and data are laid out another way, nothing in them
+// is read, they are only told apart from damaged archives.
+#define ARCH_V0_HEADER_SIZE 32
+
+bool __arch_is_v0(int fd)
+{
+    uint8_t raw[ARCH_V0_HEADER_SIZE];
+    const uint8_t *p = raw + 24;
+    uint64_t bytes_per_read = 0;
+    return pread(fd, raw, sizeof(raw), 0) == sizeof(raw) && memcmp(raw, "HAM", 3) == 0 &&
+           le64_read(&p, raw + sizeof(raw), &bytes_per_read) && bytes_per_read > 0;
+}
+
 arch_instance arch_instance_create(const char *path, bool should_exist)
 {
     if (access(path, F_OK) == 0 || should_exist)
@@ -111,53 +683,79 @@ arch_instance arch_instance_create(const char *path, bool should_exist)
             fprintf(stderr, "arch (updated) at path %s could not be opened\n", path);
             return (arch_instance){0};
         }
-        if (fseek(f, 0, SEEK_SET))
-        {
-            assert(false && "fseek(f, 0, SEEK_SET)");
-        }
 
-        arch_header hdr;
-        if (fread(&hdr, sizeof(arch_header), 1, f) != 1)
+        struct stat st;
+        if (fstat(fileno(f), &st))
         {
             fprintf(stderr, "arch (updated) Failed reading arch header from file %s\n", path);
+            fclose(f);
             return (arch_instance){0};
         }
 
-        if (hdr.id[0] != 'H' || hdr.id[1] != 'A' || hdr.id[2] != 'M')
+        arch_header slots[2];
+        bool corrected[2] = {false, false};
+        bool valid_0 = arch_header_read_slot(fileno(f), 0, &slots[0], &corrected[0]);
+        bool valid_1 = arch_header_read_slot(fileno(f), ARCH_SLOT_SIZE, &slots[1], &corrected[1]);
+        bool meta_damaged = false;
+        if (!valid_0 && !valid_1)
         {
-            fprintf(stderr, "arch (updated) Failed confirming HAM from %s\n", path);
-            return (arch_instance){0};
+            if (!arch_header_read_slot(fileno(f), st.st_size - ARCH_SLOT_SIZE, &slots[0], &corrected[0]))
+            {
+                if (__arch_is_v0(fileno(f)))
+                {
+                    fprintf(stderr, "arch %s was written before format version 1 and can not be read, extract it with the hamarc that wrote it\n", path);
+                    fclose(f);
+                    return (arch_instance){0};
+                }
+                fprintf(stderr, "arch (updated) Failed confirming HAM from %s\n", path);
+                fclose(f);
+                return (arch_instance){0};
+            }
+            fprintf(stderr, "arch %s: both front headers are damaged, using the copy at the end\n", path);
+            valid_0 = meta_damaged = true;
         }
+        const int chosen = (valid_0 && (!valid_1 || slots[0].seq > slots[1].seq)) ? 0 : 1;
+        arch_header hdr = slots[chosen];
+        meta_damaged |= corrected[chosen];
+
         if (hdr.bytes_per_read == 0)
         {
             fprintf(stderr, "arch (updated) Invalid bytes per chunk value = %lu in arch %s\n", hdr.bytes_per_read, path);
+            fclose(f);
             return (arch_instance){0};
         }
 
+        __arch_recover_intent(fileno(f), &hdr, path);
+
         arch_instance inst = (arch_instance){
             .f = f,
             .name = get_clean_filename(path),
             .hdr = hdr,
             .file_hdrs = NULL,
-            .cnf = config_new(hdr.bytes_per_read, DEFAULT_FREE_FILE_COUNT),
+            .cnf = config_new(hdr.bytes_per_read),
+            .meta_damaged = meta_damaged,
         };
-        fprintf(stdout, "arch (updated) at path %s contains n = %lu files, available space = %lu\n", path, inst.hdr.file_count, inst.hdr.free_file_count);
-
-        if (!inst.hdr.file_count)
+        inst.cnf.sync_group = hdr.sync_group;
+        inst.cnf.parity_data = hdr.parity_data;
+        inst.cnf.parity_count = hdr.parity_count;
+        inst.cnf.parity_checks_copy = hdr.parity_checks_copy;
+        inst.cnf.hash_tree = hdr.hash_tree;
+        inst.cnf.member_attrs = hdr.member_attrs;
+
+        const size_t dir_enc_size = arch_header_dir_enc_size(&hdr, inst.cnf);
+        if (fstat(fileno(f), &st) ||
+            hdr.dir_offset < ARCH_DATA_OFFSET || hdr.dir_offset + dir_enc_size > (size_t)st.st_size ||
+            hdr.dir_copy_offset < ARCH_DATA_OFFSET || hdr.dir_copy_offset + dir_enc_size > (size_t)st.st_size)
         {
-            return inst;
+            fprintf(stderr, "arch (updated) Member table of arch %s points past its end\n", path);
+            fclose(f);
+            return (arch_instance){0};
         }
-
-        inst.file_hdrs = calloc(sizeof(arch_file_header), inst.hdr.file_count);
-
-        for (size_t i = 0; i < inst.hdr.file_count; ++i)
+        // the table is enough to go on, the next commit writes the lookup block anew
+        if (hdr.lookup_size && (hdr.lookup_offset < ARCH_DATA_OFFSET || hdr.lookup_offset + arch_header_lookup_enc_size(&hdr, inst.cnf) > (size_t)st.st_size))
         {
-            if (fread(&inst.file_hdrs[i], sizeof(arch_file_header), 1, f) != 1)
-            {
-                fprintf(stderr, "(update) could not properly read %lu-th file HEADER from arch %s\n", i, path);
-                arch_instance_close(&inst);
-                return (arch_instance){0};
-            }
+            inst.hdr.lookup_size = 0;
+            inst.meta_damaged = true;
         }
         return inst;
     }
@@ -165,24 +763,175 @@ arch_instance arch_instance_create(const char *path, bool should_exist)
     return arch_instance_create_empty(path, (config){0});
 }
 
+#define ARCH_TABLE_BUF_SIZE (64 * 1024)
+
+// Streams the member table from disk with two fixed-size buffers over its
+// first copy, single chunks of the second one are read on demand
+typedef struct
+{
+    const arch_instance *inst;
+    size_t count;
+    size_t next;
+    chunk_cursor recs;
+    chunk_cursor names;
+    arch_file_header_unpacker u;
+    byte_buf name;
+    bool broken;
+} arch_table_reader;
+
+arch_table_reader arch_table_reader_open(const arch_instance *inst)
+{
+    const int fd = fileno(inst->f);
+    const size_t table_size = inst->hdr.dir_size + inst->hdr.names_size;
+    fflush(inst->f);
+    return (arch_table_reader){
+        .inst = inst,
+        .count = inst->hdr.file_count,
+        .recs = chunk_cursor_open(fd, inst->hdr.dir_offset, inst->hdr.dir_copy_offset, table_size, 0, inst->cnf, ARCH_TABLE_BUF_SIZE),
+        .names = chunk_cursor_open(fd, inst->hdr.dir_offset, inst->hdr.dir_copy_offset, table_size, inst->hdr.dir_size, inst->cnf, ARCH_TABLE_BUF_SIZE),
+        .u = arch_file_header_unpacker_new(inst->cnf),
+    };
+}
+
+// The next member and its name, valid until the next call. False at the end
+// of the table or where it turns out broken.
+bool arch_table_reader_next(arch_table_reader *r, arch_file_header *hdr, const char **name)
+{
+    if (r->next == r->count || r->broken)
+    {
+        return false;
+    }
+    const size_t avail = chunk_cursor_fill(&r->recs, ARCH_FILE_HEADER_MAX_PACKED);
+    const uint8_t *p = r->recs.buf + r->recs.head;
+    if (!arch_file_header_unpack_one(&r->u, &p, p + avail, hdr))
+    {
+        fprintf(stderr, "could not properly read %lu-th file HEADER from arch %s\n", r->next, r->inst->name);
+        r->broken = true;
+        return false;
+    }
+    r->recs.head = p - r->recs.buf;
+
+    r->name.len = 0;
+    for (size_t left = hdr->name_len + 1; left > 0;)
+    {
+        size_t n = chunk_cursor_fill(&r->names, 1);
+        if (n == 0)
+        {
+            break;
+        }
+        n = n < left ? n : left;
+        byte_buf_push(&r->name, r->names.buf + r->names.head, n);
+        r->names.head += n;
+        left -= n;
+    }
+    if (r->name.len != hdr->name_len + 1 || strlen((const char *)r->name.ptr) != hdr->name_len)
+    {
+        fprintf(stderr, "%lu-th file HEADER from arch %s has broken name\n", r->next, r->inst->name);
+        r->broken = true;
+        return false;
+    }
+    r->next += 1;
+    *name = (const char *)r->name.ptr;
+    return true;
+}
+
+// False if the table could not be read to its end. corrected, when not NULL,
+// gets the count of chunks that needed correction.
+bool arch_table_reader_close(arch_table_reader *r, size_t *corrected)
+{
+    const bool ok = !r->broken && !r->recs.failed && !r->names.failed && r->next == r->count;
+    if (r->recs.failed || r->names.failed)
+    {
+        fprintf(stderr, "member table of arch %s has uncorrectable chunks\n", r->inst->name);
+    }
+    if (corrected)
+    {
+        *corrected = r->recs.corrected + r->names.corrected;
+    }
+    chunk_cursor_close(&r->recs);
+    chunk_cursor_close(&r->names);
+    byte_buf_close(&r->name);
+    return ok;
+}
+
+// Streams the member table into memory, the copy is read only where a chunk needs it
+bool arch_instance_load_files(arch_instance *inst)
+{
+    if (inst->files_loaded)
+    {
+        return true;
+    }
+    if (!__arch_table_fits(inst, arch_table_memory(&inst->hdr)))
+    {
+        return false;
+    }
+    const size_t count = inst->hdr.file_count, names_size = inst->hdr.names_size;
+    inst->file_hdrs_cap = count;
+    inst->file_hdrs = calloc(inst->file_hdrs_cap, sizeof(arch_file_header));
+    inst->names_cap = names_size + 1;
+    inst->names = calloc(inst->names_cap, 1);
+
+    arch_table_reader r = arch_table_reader_open(inst);
+    inst->hdr.file_count = 0;
+    inst->hdr.names_size = 0;
+    arch_file_header hdr;
+    const char *name;
+    while (arch_table_reader_next(&r, &hdr, &name))
+    {
+        __arch_push_file_header(inst, hdr, name);
+    }
+    size_t corrected = 0;
+    const bool ok = arch_table_reader_close(&r, &corrected);
+    inst->hdr.file_count = count;
+    inst->hdr.names_size = names_size;
+    if (corrected > 0)
+    {
+        fprintf(stderr, "arch %s: corrected %lu chunks of the member table\n", inst->name, corrected);
+        inst->meta_damaged = true;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "(update) could not properly read file HEADERS from arch %s\n", inst->name);
+        return false;
+    }
+    inst->files_loaded = true;
+    return true;
+}
+
+// A member to encode: read from f_stream, or straight from the iov buffers when iov is set
 typedef struct
 {
-    char *filename;
+    const char *filename;
     FILE *f_stream;
+    const struct iovec *iov;
+    size_t iovcnt;
     size_t file_size;
+    int64_t mtime;
+    uint32_t mode; // 0 when not known, as for members added from memory
+    uint32_t uid;
+    uint32_t gid;
 } file_to_append;
 
-file_to_append file_to_append_open(const char *filename)
+file_to_append file_to_append_open(const char *path, const char *name, bool no_cache)
 {
-    file_to_append str = {.filename = get_clean_filename(filename), .f_stream = fopen(filename, "r")};
+    file_to_append str = {.filename = name, .f_stream = no_cache ? fopen_direct(path) : fopen(path, "r")};
     if (!str.f_stream)
     {
-        fprintf(stderr, "could not obtain file %s\n", filename);
+        fprintf(stderr, "could not obtain file %s\n", path);
+        return (file_to_append){0};
+    }
+    struct stat st;
+    if (no_cache ? stat(path, &st) : fstat(fileno(str.f_stream), &st))
+    {
+        fprintf(stderr, "could not stat file %s\n", path);
+        fclose(str.f_stream);
         return (file_to_append){0};
     }
-    fseek(str.f_stream, 0, SEEK_END);
-    str.file_size = ftell(str.f_stream);
-    fseek(str.f_stream, 0, SEEK_SET);
+    str.file_size = st.st_size;
+    str.mtime = stat_mtime_ns(&st);
+    str.mode = st.st_mode;
+    str.uid = st.st_uid;
+    str.gid = st.st_gid;
     return str;
 }
 
@@ -195,260 +944,1313 @@ void file_to_append_close(file_to_append *ptr)
     *ptr = (file_to_append){0};
 }
 
-typedef struct
-{
-    file_to_append *arr;
-    size_t len;
-} file_to_append_array;
-
-arch_file_header *arch_get_new_headers(arch_instance *inst, file_to_append_array new_files)
+// Must run before the first change of an operation: the free space is taken
+// from what the committed header references, so members dropped or rewritten
+// by this operation are not reused before the commit.
+void __arch_begin_write(arch_instance *inst)
 {
-    config cnf = inst->cnf;
-    assert(new_files.len > 0);
-
-    if (inst->hdr.file_count == 0)
+    if (inst->in_write)
     {
-        inst->file_hdrs = realloc(inst->file_hdrs, new_files.len * sizeof(arch_file_header));
-        inst->hdr.free_file_count = cnf.FREE_FILE_COUNT;
-
-        size_t f_offset = sizeof(arch_file_header) + (new_files.len + inst->hdr.free_file_count) * sizeof(arch_file_header);
-        for (size_t i = 0; i < new_files.len; ++i)
-        {
-            arch_file_header hdr;
-            hdr.init_size = new_files.arr[i].file_size;
-            hdr.enc_size = calc_encoded_size(new_files.arr[i].file_size, cnf);
-            strncpy(hdr.filename, new_files.arr[i].filename, arch_file_header_NAME_LEN - 1);
-            hdr.offset = f_offset;
-
-            inst->file_hdrs[i] = hdr;
-            f_offset += hdr.enc_size;
-        }
-
-        inst->hdr.file_count += new_files.len;
-        return inst->file_hdrs;
+        return;
     }
-
-    if (inst->hdr.free_file_count < new_files.len)
+    assert(inst->files_loaded);
+
+    fflush(inst->f);
+    struct stat st = {0};
+    fstat(fileno(inst->f), &st);
+    byte_buf intent = {0};
+    arch_intent_serialize(&(arch_intent){.base_seq = inst->hdr.seq, .file_size = st.st_size}, &intent);
+    file_write_pos(ARCH_INTENT_OFFSET, intent.ptr, intent.len, inst->f);
+    byte_buf_close(&intent);
+
+    const size_t dir_enc_size = arch_header_dir_enc_size(&inst->hdr, inst->cnf);
+    extent_vec used = {0};
+    extent_vec_push(&used, (extent){.offset = 0, .size = ARCH_DATA_OFFSET});
+    extent_vec_push(&used, (extent){.offset = inst->hdr.dir_offset, .size = dir_enc_size});
+    extent_vec_push(&used, (extent){.offset = inst->hdr.dir_copy_offset, .size = dir_enc_size});
+    if (inst->hdr.lookup_size)
     {
-        inst->hdr.free_file_count = cnf.FREE_FILE_COUNT;
-
-        // move old files
-        size_t new_offset_for_first_file = (inst->hdr.file_count + new_files.len + inst->hdr.free_file_count) * sizeof(arch_file_header) + sizeof(arch_file_header);
-        size_t old_offset_for_first_file = inst->file_hdrs[0].offset;
-
-        size_t shift_len = new_offset_for_first_file - old_offset_for_first_file;
-
-        arch_file_header *first_file_hdr = &inst->file_hdrs[0];
-        arch_file_header *last_file_hdr = &inst->file_hdrs[inst->hdr.file_count - 1];
-        size_t file_data_end_offset = last_file_hdr->offset + last_file_hdr->enc_size;
-        size_t file_data_begin_offset = first_file_hdr->offset;
-
-        right_shift_file(file_data_end_offset, file_data_begin_offset, shift_len, inst->f);
-
-        for (size_t i = 0; i < inst->hdr.file_count; ++i)
-        {
-            inst->file_hdrs[i].offset += shift_len;
-        }
+        extent_vec_push(&used, (extent){.offset = inst->hdr.lookup_offset, .size = arch_header_lookup_enc_size(&inst->hdr, inst->cnf)});
     }
-    else
+    // the tail header stays where it is until the commit writes the next one
+    if ((size_t)st.st_size >= ARCH_DATA_OFFSET + ARCH_SLOT_SIZE)
     {
-        inst->hdr.free_file_count -= new_files.len;
+        extent_vec_push(&used, (extent){.offset = st.st_size - ARCH_SLOT_SIZE, .size = ARCH_SLOT_SIZE});
     }
-
-    inst->file_hdrs = realloc(inst->file_hdrs, sizeof(arch_file_header) * (inst->hdr.file_count + new_files.len));
-    arch_file_header *last_file = &inst->file_hdrs[inst->hdr.file_count - 1];
-    size_t f_offset = last_file->offset + last_file->enc_size;
-    for (size_t i = 0; i < new_files.len; ++i)
+    for (size_t i = 0; i < inst->hdr.file_count; ++i)
     {
-        arch_file_header hdr;
-        hdr.init_size = new_files.arr[i].file_size;
-        strncpy(hdr.filename, new_files.arr[i].filename, arch_file_header_NAME_LEN - 1);
-        hdr.enc_size = calc_encoded_size(hdr.init_size, cnf);
-        hdr.offset = f_offset;
-
-        inst->file_hdrs[inst->hdr.file_count + i] = hdr;
-        f_offset += hdr.enc_size;
+        extent_vec_push(&used, (extent){.offset = inst->file_hdrs[i].offset, .size = inst->file_hdrs[i].enc_size});
     }
+    free_space_close(&inst->space);
+    inst->space = free_space_from_used(&used);
+    extent_vec_close(&used);
+    inst->reserved_end = st.st_size;
 
-    inst->hdr.file_count += new_files.len;
-
-    return &inst->file_hdrs[inst->hdr.file_count - new_files.len];
+    inst->in_write = true;
 }
 
-void arch_instance_sync_header(arch_instance *inst)
+size_t __arch_alloc(arch_instance *inst, size_t size, size_t align)
 {
-    file_write_pos(0, &inst->hdr, sizeof(arch_header), inst->f);
-    if (inst->hdr.file_count > 0)
-    {
-        file_write_pos(sizeof(arch_header), inst->file_hdrs, sizeof(arch_file_header) * inst->hdr.file_count, inst->f);
-    }
+    __arch_begin_write(inst);
+    return free_space_alloc(&inst->space, size, align);
 }
 
-void __arch_insert_file_streams(arch_instance *inst, file_to_append_array files)
+// Preallocates the file up to end in one extent, so members written there
+// stay contiguous. Whatever the commit does not use is truncated with the tail.
+void __arch_reserve(arch_instance *inst, size_t end)
 {
-    arch_file_header *new_hdrs = arch_get_new_headers(inst, files);
-    for (size_t i = 0; i < files.len; ++i)
+    if (end <= inst->reserved_end)
     {
-        if (fseek(inst->f, new_hdrs[i].offset, SEEK_SET))
+        return;
+    }
+    // not every filesystem can, the writes allocate then
+    if (fallocate(fileno(inst->f), 0, inst->reserved_end, end - inst->reserved_end) == 0)
+    {
+        inst->reserved_end = end;
+    }
+}
+
+// Encodes the whole chunks gathered in src (everything when last) to both
+// table copies at *enc_at. The table goes out ARCH_TABLE_BUF_SIZE at a time,
+// cut at whole chunks so the pieces add up to its encoding in one go.
+void __arch_write_table_piece(arch_instance *inst, byte_buf *src, byte_buf *enc, size_t *enc_at, bool last)
+{
+    if (!last && src->len < ARCH_TABLE_BUF_SIZE)
+    {
+        return;
+    }
+    const size_t whole = last ? src->len : src->len - src->len % inst->cnf.BYTES_per_chunk;
+    enc->len = 0;
+    encode_buffer(src->ptr, whole, enc, inst->cnf);
+    if (enc->len > 0)
+    {
+        file_write_pos(inst->hdr.dir_offset + *enc_at, enc->ptr, enc->len, inst->f);
+        file_write_pos(inst->hdr.dir_copy_offset + *enc_at, enc->ptr, enc->len, inst->f);
+    }
+    *enc_at += enc->len;
+    memmove(src->ptr, src->ptr + whole, src->len - whole);
+    src->len -= whole;
+}
+
+// The lookup block: le64 name count, le64 filter block count, the filter,
+// then for every distinct name in strcmp order le64 where it starts in the
+// decoded member table. The filter is a blocked Bloom filter: a name sets
+// ARCH_LOOKUP_HASHES bits of one ARCH_LOOKUP_BLOCK_SIZE-byte block, so a
+// name that is not there is mostly told by the chunk or two of that block.
+// A block ends with le32 of the FNV-1a of its bits: a zeroed block decodes
+// without error and would otherwise turn every name of it away.
+#define ARCH_LOOKUP_HEADER_SIZE 16
+#define ARCH_LOOKUP_BLOCK_SIZE 64
+#define ARCH_LOOKUP_BLOCK_BITS ((ARCH_LOOKUP_BLOCK_SIZE - 4) * BITS_IN_BYTE)
+#define ARCH_LOOKUP_BITS_PER_NAME 10
+#define ARCH_LOOKUP_HASHES 7
+
+typedef struct
+{
+    size_t block;
+    uint16_t bits[ARCH_LOOKUP_HASHES];
+} arch_lookup_probe;
+
+arch_lookup_probe arch_lookup_probe_of(const char *name, size_t len, size_t n_blocks)
+{
+    const uint64_t h = hash_mix64(content_hash_update(CONTENT_HASH_INIT, name, len));
+    const uint64_t h2 = hash_mix64(h);
+    const uint32_t step = (uint32_t)(h2 >> 32) | 1;
+    arch_lookup_probe probe = {.block = h % n_blocks};
+    for (uint32_t i = 0; i < ARCH_LOOKUP_HASHES; ++i)
+    {
+        probe.bits[i] = ((uint32_t)h2 + i * step) % ARCH_LOOKUP_BLOCK_BITS;
+    }
+    return probe;
+}
+
+uint32_t __arch_lookup_block_check(const uint8_t *block)
+{
+    return (uint32_t)content_hash_update(CONTENT_HASH_INIT, block, ARCH_LOOKUP_BLOCK_SIZE - 4);
+}
+
+void __arch_lookup_seal_block(uint8_t *block)
+{
+    const uint32_t check = __arch_lookup_block_check(block);
+    for (size_t i = 0; i < 4; ++i)
+    {
+        block[ARCH_LOOKUP_BLOCK_SIZE - 4 + i] = check >> (8 * i);
+    }
+}
+
+bool __arch_lookup_block_ok(const uint8_t *block)
+{
+    const uint8_t *p = block + ARCH_LOOKUP_BLOCK_SIZE - 4;
+    uint32_t check;
+    return le32_read(&p, block + ARCH_LOOKUP_BLOCK_SIZE, &check) && check == __arch_lookup_block_check(block);
+}
+
+int __arch_name_ptr_cmp(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Lays out the lookup block of the table in memory, names have to be compacted
+void __arch_lookup_build(const arch_instance *inst, byte_buf *dst)
+{
+    const char **sorted = malloc(inst->hdr.file_count * sizeof(char *));
+    for (size_t i = 0; i < inst->hdr.file_count; ++i)
+    {
+        sorted[i] = arch_file_name(inst, &inst->file_hdrs[i]);
+    }
+    qsort(sorted, inst->hdr.file_count, sizeof(char *), __arch_name_ptr_cmp);
+    size_t n_names = 0;
+    for (size_t i = 0; i < inst->hdr.file_count; ++i)
+    {
+        if (n_names == 0 || strcmp(sorted[n_names - 1], sorted[i]) != 0)
+        {
+            sorted[n_names++] = sorted[i];
+        }
+    }
+
+    const size_t n_blocks = n_names ? (n_names * ARCH_LOOKUP_BITS_PER_NAME + ARCH_LOOKUP_BLOCK_BITS - 1) / ARCH_LOOKUP_BLOCK_BITS : 1;
+    le64_push(dst, n_names);
+    le64_push(dst, n_blocks);
+    byte_buf_reserve(dst, n_blocks * ARCH_LOOKUP_BLOCK_SIZE + n_names * 8);
+    uint8_t *filter = dst->ptr + dst->len;
+    memset(filter, 0, n_blocks * ARCH_LOOKUP_BLOCK_SIZE);
+    dst->len += n_blocks * ARCH_LOOKUP_BLOCK_SIZE;
+    for (size_t i = 0; i < n_names; ++i)
+    {
+        const arch_lookup_probe probe = arch_lookup_probe_of(sorted[i], strlen(sorted[i]), n_blocks);
+        uint8_t *block = filter + probe.block * ARCH_LOOKUP_BLOCK_SIZE;
+        for (size_t k = 0; k < ARCH_LOOKUP_HASHES; ++k)
+        {
+            block[probe.bits[k] / BITS_IN_BYTE] |= 1 << (probe.bits[k] % BITS_IN_BYTE);
+        }
+    }
+    for (size_t b = 0; b < n_blocks; ++b)
+    {
+        __arch_lookup_seal_block(filter + b * ARCH_LOOKUP_BLOCK_SIZE);
+    }
+    for (size_t i = 0; i < n_names; ++i)
+    {
+        le64_push(dst, inst->hdr.dir_size + (size_t)(sorted[i] - inst->names));
+    }
+    free(sorted);
+}
+
+// Encodes len bytes of src to offset, which is allocated already, in pieces of whole chunks
+void __arch_write_encoded(arch_instance *inst, size_t offset, const uint8_t *src, size_t len)
+{
+    const size_t step = ARCH_TABLE_BUF_SIZE - ARCH_TABLE_BUF_SIZE % inst->cnf.BYTES_per_chunk;
+    byte_buf enc = {0};
+    for (size_t at = 0; at < len; at += step)
+    {
+        enc.len = 0;
+        encode_buffer(src + at, len - at < step ? len - at : step, &enc, inst->cnf);
+        file_write_pos(offset, enc.ptr, enc.len, inst->f);
+        offset += enc.len;
+    }
+    byte_buf_close(&enc);
+}
+
+// Writes the member table to free space and commits the header pointing to it
+void arch_instance_sync_header(arch_instance *inst)
+{
+    __arch_begin_write(inst);
+
+    // rebuild the name table so names of removed members are not kept
+    char *names = malloc(inst->hdr.names_size + 1);
+    size_t names_size = 0;
+    for (size_t i = 0; i < inst->hdr.file_count; ++i)
+    {
+        arch_file_header *hdr = &inst->file_hdrs[i];
+        memcpy(names + names_size, inst->names + hdr->name_offset, hdr->name_len + 1);
+        hdr->name_offset = names_size;
+        names_size += hdr->name_len + 1;
+    }
+    free(inst->names);
+    inst->names = names;
+    inst->names_cap = inst->hdr.names_size + 1;
+    inst->hdr.names_size = names_size;
+
+    // the records are packed once to size the table, then again as it is written
+    byte_buf dir = {0};
+    arch_file_header_packer pk = arch_file_header_packer_new(inst->cnf);
+    inst->hdr.dir_size = 0;
+    for (size_t i = 0; i < inst->hdr.file_count; ++i)
+    {
+        dir.len = 0;
+        arch_file_header_pack_one(&pk, &inst->file_hdrs[i], &dir);
+        inst->hdr.dir_size += dir.len;
+    }
+    const size_t enc_size = arch_header_dir_enc_size(&inst->hdr, inst->cnf);
+    inst->hdr.dir_offset = inst->hdr.dir_copy_offset = ARCH_DATA_OFFSET;
+    if (enc_size > 0)
+    {
+        inst->hdr.dir_offset = __arch_alloc(inst, enc_size, 1);
+        inst->hdr.dir_copy_offset = __arch_alloc(inst, enc_size, 1);
+    }
+
+    dir.len = 0;
+    byte_buf enc = {0};
+    size_t enc_at = 0;
+    pk = arch_file_header_packer_new(inst->cnf);
+    for (size_t i = 0; i < inst->hdr.file_count; ++i)
+    {
+        arch_file_header_pack_one(&pk, &inst->file_hdrs[i], &dir);
+        __arch_write_table_piece(inst, &dir, &enc, &enc_at, false);
+    }
+    for (size_t at = 0; at < inst->hdr.names_size; at += ARCH_TABLE_BUF_SIZE)
+    {
+        const size_t n = inst->hdr.names_size - at < ARCH_TABLE_BUF_SIZE ? inst->hdr.names_size - at : ARCH_TABLE_BUF_SIZE;
+        byte_buf_push(&dir, inst->names + at, n);
+        __arch_write_table_piece(inst, &dir, &enc, &enc_at, false);
+    }
+    __arch_write_table_piece(inst, &dir, &enc, &enc_at, true);
+    assert(enc_at == enc_size);
+    (void)enc_size;
+    byte_buf_close(&dir);
+    byte_buf_close(&enc);
+
+    inst->hdr.lookup_offset = inst->hdr.lookup_size = 0;
+    if (inst->hdr.file_count > 0)
+    {
+        byte_buf lookup = {0};
+        __arch_lookup_build(inst, &lookup);
+        inst->hdr.lookup_offset = __arch_alloc(inst, calc_encoded_size(lookup.len, inst->cnf), 1);
+        inst->hdr.lookup_size = lookup.len;
+        __arch_write_encoded(inst, inst->hdr.lookup_offset, lookup.ptr, lookup.len);
+        byte_buf_close(&lookup);
+    }
+
+    // the data and the table have to be on disk before the header points to them
+    __arch_datasync(inst);
+    __arch_commit_header(inst);
+
+    free_space_close(&inst->space);
+    inst->in_write = false;
+
+    const size_t dir_enc_size = arch_header_dir_enc_size(&inst->hdr, inst->cnf);
+    size_t used_end = ARCH_DATA_OFFSET;
+    if (dir_enc_size > 0)
+    {
+        used_end = inst->hdr.dir_offset > inst->hdr.dir_copy_offset ? inst->hdr.dir_offset + dir_enc_size : inst->hdr.dir_copy_offset + dir_enc_size;
+    }
+    if (inst->hdr.lookup_size && inst->hdr.lookup_offset + arch_header_lookup_enc_size(&inst->hdr, inst->cnf) > used_end)
+    {
+        used_end = inst->hdr.lookup_offset + arch_header_lookup_enc_size(&inst->hdr, inst->cnf);
+    }
+    for (size_t i = 0; i < inst->hdr.file_count; ++i)
+    {
+        const arch_file_header *hdr = &inst->file_hdrs[i];
+        if (hdr->enc_size > 0 && hdr->offset + hdr->enc_size > used_end)
+        {
+            used_end = hdr->offset + hdr->enc_size;
+        }
+    }
+    __arch_write_tail(inst, used_end);
+    inst->meta_damaged = false;
+    if (inst->no_cache)
+    {
+        fflush(inst->f);
+        drop_written_file(fileno(inst->f));
+    }
+}
+
+// ids of later commits compare greater, --salvage keeps the newest copy of a name
+uint64_t __arch_next_member_id(arch_instance *inst)
+{
+    return (inst->hdr.seq + 1) << 32 | inst->members_encoded++;
+}
+
+// an empty member is never encoded, its root is the hash of nothing
+void __arch_empty_root(const arch_instance *inst, arch_file_header *hdr)
+{
+    memset(hdr->root, 0, BLAKE3_OUT_LEN);
+    if (inst->cnf.hash_tree)
+    {
+        blake3_hash(NULL, 0, hdr->root);
+    }
+}
+
+// Encodes hdr->init_size bytes of src to hdr->offset, which is already allocated.
+// false if it could not be written.
+bool __arch_encode_to(arch_instance *inst, const file_to_append *src, arch_file_header *hdr)
+{
+    if (fseek(inst->f, hdr->offset, SEEK_SET))
+    {
+        assert(false && "fseek(inst->f, hdr->offset, SEEK_SET)");
+    }
+    const member_tag tag = {
+        .member_id = __arch_next_member_id(inst),
+        .mtime = hdr->mtime,
+        .name = src->filename,
+    };
+    size_t written = src->iov ? do_iovec_encoding(src->iov, src->iovcnt, hdr->init_size, inst->f, inst->cnf, &tag, &hdr->hash, hdr->root)
+                              : do_file_encoding(src->f_stream, hdr->init_size, inst->f, inst->cnf, &tag, &hdr->hash, hdr->root);
+    assert(written == hdr->enc_size);
+    (void)written;
+    const bool ok = fflush(inst->f) == 0;
+    if (!ok)
+    {
+        fprintf(stderr, "arch %s could not be written\n", inst->name);
+    }
+    if (inst->no_cache)
+    {
+        drop_written_range(fileno(inst->f), hdr->offset, hdr->enc_size);
+    }
+    return ok;
+}
+
+// Encodes the stream to free space and points hdr at it, the header table is not synced
+bool __arch_encode_file(arch_instance *inst, const file_to_append *file, arch_file_header *hdr)
+{
+    // hdr may be a committed member, its old extent has to be marked used first
+    __arch_begin_write(inst);
+
+    hdr->init_size = file->file_size;
+    hdr->enc_size = calc_member_enc_size(file->file_size, strlen(file->filename), inst->cnf);
+    hdr->mtime = file->mtime;
+    hdr->mode = file->mode;
+    hdr->uid = file->uid;
+    hdr->gid = file->gid;
+    hdr->hash = CONTENT_HASH_INIT;
+    hdr->offset = ARCH_DATA_OFFSET;
+    if (hdr->init_size == 0)
+    {
+        __arch_empty_root(inst, hdr);
+        return true;
+    }
+
+    hdr->offset = __arch_alloc(inst, hdr->enc_size, inst->align);
+    // the walk hands out one file at a time, so the plan is one member ahead
+    __arch_reserve(inst, hdr->offset + hdr->enc_size);
+    return __arch_encode_to(inst, file, hdr);
+}
+
+// The member is listed only if it was written
+bool __arch_append_file(arch_instance *inst, const file_to_append *file)
+{
+    arch_file_header hdr = {0};
+    if (!__arch_encode_file(inst, file, &hdr))
+    {
+        return false;
+    }
+    __arch_push_file_header(inst, hdr, file->filename);
+    return true;
+}
+
+bool __is_same_file(const struct stat *lhs, const struct stat *rhs)
+{
+    return lhs->st_dev == rhs->st_dev && lhs->st_ino == rhs->st_ino;
+}
+
+// Files up to ARCH_SMALL_FILE_MAX bytes are gathered into batches of up to
+// ARCH_SMALL_BATCH_FILES. A batch is planned in one go and then read and
+// encoded by a pool of threads. Each thread holds one input file open at a
+// time and writes a run of neighbouring members with a single pwrite.
+// Under --max-memory the batch, the threads and their runs get smaller.
+#define ARCH_SMALL_FILE_MAX (64 * 1024)
+#define ARCH_SMALL_BATCH_FILES 4096
+// a queued file with its path and name, roughly
+#define ARCH_SMALL_JOB_MEMORY (sizeof(small_file_job) + 256)
+#define ARCH_SMALL_MAX_THREADS 16
+#define ARCH_SMALL_GROUP_MIN (64 * 1024)
+#define ARCH_SMALL_GROUP_MAX (1024 * 1024)
+
+typedef struct
+{
+    fs_entry entry;
+    arch_file_header hdr;
+    uint64_t member_id;
+    bool ok;
+} small_file_job;
+
+typedef struct
+{
+    arch_instance *inst;
+    small_file_job *jobs;
+    size_t n_jobs;
+    size_t cap;
+    size_t max_jobs;
+    size_t budget; // of the threads, 0 for no limit
+
+    // jobs [groups[g], groups[g + 1]) lie back to back in the archive
+    size_t *groups;
+    size_t n_groups;
+
+    pthread_mutex_t lock;
+    size_t next_group;
+    size_t failed; // files left out of the batches flushed so far
+} small_file_batch;
+
+// Reads the whole file into buf, false if it is not init_size bytes long
+bool __small_file_read(const small_file_job *job, uint8_t *buf, bool no_cache)
+{
+    const int fd = open(job->entry.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "could not obtain file %s\n", job->entry.path);
+        return false;
+    }
+    size_t got = 0;
+    ssize_t n = 1;
+    while (got < job->hdr.init_size && (n = read(fd, buf + got, job->hdr.init_size - got)) > 0)
+    {
+        got += n;
+    }
+    if (no_cache)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+    if (got != job->hdr.init_size)
+    {
+        fprintf(stderr, "could not read file %s\n", job->entry.path);
+        return false;
+    }
+    return true;
+}
+
+void __byte_buf_push_zeros(byte_buf *buf, size_t n)
+{
+    if (n > 0)
+    {
+        byte_buf_reserve(buf, n);
+        memset(buf->ptr + buf->len, 0, n);
+        buf->len += n;
+    }
+}
+
+void *__small_file_thread(void *arg)
+{
+    small_file_batch *batch = arg;
+    arch_instance *inst = batch->inst;
+    uint8_t *src = malloc(ARCH_SMALL_FILE_MAX);
+    byte_buf out = {0};
+    while (true)
+    {
+        pthread_mutex_lock(&batch->lock);
+        const size_t g = batch->next_group < batch->n_groups ? batch->next_group++ : batch->n_groups;
+        pthread_mutex_unlock(&batch->lock);
+        if (g == batch->n_groups)
+        {
+            break;
+        }
+
+        const size_t first = batch->groups[g], last = batch->groups[g + 1];
+        size_t base = 0;
+        for (size_t i = first; i < last && base == 0; ++i)
+        {
+            base = batch->jobs[i].hdr.init_size > 0 ? batch->jobs[i].hdr.offset : 0;
+        }
+        out.len = 0;
+        for (size_t i = first; i < last; ++i)
+        {
+            small_file_job *job = &batch->jobs[i];
+            job->ok = __small_file_read(job, src, inst->no_cache);
+            if (job->hdr.init_size == 0)
+            {
+                __arch_empty_root(inst, &job->hdr);
+                continue;
+            }
+            // alignment padding between two members
+            __byte_buf_push_zeros(&out, job->hdr.offset - base - out.len);
+            if (!job->ok)
+            {
+                // the place stays free once the batch is committed without it
+                __byte_buf_push_zeros(&out, job->hdr.enc_size);
+                continue;
+            }
+            const member_tag tag = {
+                .member_id = job->member_id,
+                .mtime = job->hdr.mtime,
+                .name = job->entry.name,
+            };
+            size_t written = encode_member_buffer(src, job->hdr.init_size, &out, inst->cnf, &tag, &job->hdr.hash, job->hdr.root);
+            assert(written == job->hdr.enc_size);
+            (void)written;
+        }
+        if (out.len > 0 && pwrite(fileno(inst->f), out.ptr, out.len, base) != (ssize_t)out.len)
+        {
+            fprintf(stderr, "arch %s could not be written\n", inst->name);
+            for (size_t i = first; i < last; ++i)
+            {
+                batch->jobs[i].ok = false;
+            }
+        }
+        if (inst->no_cache && out.len > 0)
+        {
+            drop_written_range(fileno(inst->f), base, out.len);
+        }
+    }
+    free(src);
+    byte_buf_close(&out);
+    return NULL;
+}
+
+// Plans, encodes and lists every member of the batch, the header is not synced
+void __small_file_batch_flush(small_file_batch *batch)
+{
+    if (batch->n_jobs == 0)
+    {
+        return;
+    }
+    arch_instance *inst = batch->inst;
+    size_t total = 0, end = 0;
+    for (size_t i = 0; i < batch->n_jobs; ++i)
+    {
+        small_file_job *job = &batch->jobs[i];
+        job->hdr = (arch_file_header){
+            .init_size = job->entry.st.st_size,
+            .enc_size = calc_member_enc_size(job->entry.st.st_size, strlen(job->entry.name), inst->cnf),
+            .offset = ARCH_DATA_OFFSET,
+            .mtime = stat_mtime_ns(&job->entry.st),
+            .hash = CONTENT_HASH_INIT,
+            .mode = job->entry.st.st_mode,
+            .uid = job->entry.st.st_uid,
+            .gid = job->entry.st.st_gid,
+        };
+        if (job->hdr.init_size > 0)
+        {
+            job->hdr.offset = __arch_alloc(inst, job->hdr.enc_size, inst->align);
+            job->member_id = __arch_next_member_id(inst);
+            total += job->hdr.enc_size;
+            end = job->hdr.offset + job->hdr.enc_size > end ? job->hdr.offset + job->hdr.enc_size : end;
+        }
+    }
+    __arch_reserve(inst, end);
+
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = n_threads < 1 ? 1 : (n_threads > ARCH_SMALL_MAX_THREADS ? ARCH_SMALL_MAX_THREADS : n_threads);
+    // a thread holds a file and its run encoded, the buffer of which may grow to twice the run
+    n_threads = budget_workers(batch->budget, ARCH_SMALL_FILE_MAX + 2 * ARCH_SMALL_GROUP_MIN, n_threads);
+    // a few groups per thread, so that one slow file does not hold up the rest
+    size_t group_size = total / (n_threads * 4);
+    group_size = group_size < ARCH_SMALL_GROUP_MIN ? ARCH_SMALL_GROUP_MIN : (group_size > ARCH_SMALL_GROUP_MAX ? ARCH_SMALL_GROUP_MAX : group_size);
+    const size_t per_thread = batch->budget / n_threads;
+    if (batch->budget)
+    {
+        group_size = budget_buffer(per_thread > ARCH_SMALL_FILE_MAX ? (per_thread - ARCH_SMALL_FILE_MAX) / 2 : 0, group_size, ARCH_SMALL_GROUP_MIN);
+    }
+
+    batch->groups = realloc(batch->groups, (batch->n_jobs + 1) * sizeof(size_t));
+    batch->groups[0] = 0;
+    batch->n_groups = 1;
+    const size_t max_pad = inst->align > 1 ? inst->align : 1;
+    bool has_data = false;
+    size_t group_start = 0, group_end = 0;
+    for (size_t i = 0; i < batch->n_jobs; ++i)
+    {
+        const arch_file_header *hdr = &batch->jobs[i].hdr;
+        if (hdr->init_size == 0)
+        {
+            continue;
+        }
+        const bool fits = hdr->offset >= group_end && hdr->offset - group_end < max_pad && hdr->offset + hdr->enc_size - group_start <= group_size;
+        if (has_data && !fits)
+        {
+            batch->groups[batch->n_groups++] = i;
+        }
+        if (!has_data || !fits)
+        {
+            group_start = hdr->offset;
+        }
+        has_data = true;
+        group_end = hdr->offset + hdr->enc_size;
+    }
+    batch->groups[batch->n_groups] = batch->n_jobs;
+
+    fflush(inst->f);
+    pthread_mutex_init(&batch->lock, NULL);
+    batch->next_group = 0;
+    n_threads = (size_t)n_threads > batch->n_groups ? (long)batch->n_groups : n_threads;
+    pthread_t threads[ARCH_SMALL_MAX_THREADS];
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_create(&threads[i], NULL, __small_file_thread, batch);
+    }
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&batch->lock);
+
+    for (size_t i = 0; i < batch->n_jobs; ++i)
+    {
+        if (batch->jobs[i].ok)
+        {
+            __arch_push_file_header(inst, batch->jobs[i].hdr, batch->jobs[i].entry.name);
+        }
+        batch->failed += !batch->jobs[i].ok;
+        fs_entry_close(&batch->jobs[i].entry);
+    }
+    batch->n_jobs = 0;
+}
+
+void __small_file_batch_push(small_file_batch *batch, fs_entry entry)
+{
+    if (batch->n_jobs == batch->cap)
+    {
+        batch->cap = batch->cap ? batch->cap * 2 : 64;
+        batch->jobs = realloc(batch->jobs, batch->cap * sizeof(small_file_job));
+    }
+    batch->jobs[batch->n_jobs++] = (small_file_job){.entry = entry};
+    if (batch->n_jobs == batch->max_jobs)
+    {
+        __small_file_batch_flush(batch);
+    }
+}
+
+// Directories are archived recursively, the walk runs alongside the encoding.
+// Members are listed in the order the walk finds them. What could be read is
+// committed, false if some file was left out.
+bool arch_insert_files(arch_instance *inst, string_array filenames)
+{
+    assert(filenames.len > 0);
+    if (!arch_instance_load_files(inst))
+    {
+        return false;
+    }
+
+    struct stat arch_st = {0};
+    fstat(fileno(inst->f), &arch_st);
+
+    // a quarter of the budget for the files found ahead, a quarter for the batch, the rest for its threads
+    const size_t budget = arch_io_budget(inst);
+    small_file_batch batch = {
+        .inst = inst,
+        .max_jobs = budget_workers(budget / 4, ARCH_SMALL_JOB_MEMORY, ARCH_SMALL_BATCH_FILES),
+        .budget = budget - budget / 2,
+    };
+    fs_walker *walker = fs_walk_start(filenames.arr, filenames.len, FS_WALK_THREADS, budget ? budget_workers(budget / 4, FS_ENTRY_MEMORY, SIZE_MAX) : 0);
+    fs_entry entry;
+    size_t failed = 0;
+    while (fs_walk_next(walker, &entry))
+    {
+        if (__is_same_file(&entry.st, &arch_st))
+        {
+            fs_entry_close(&entry);
+            continue;
+        }
+        if (entry.st.st_size <= ARCH_SMALL_FILE_MAX)
+        {
+            __small_file_batch_push(&batch, entry);
+            continue;
+        }
+        __small_file_batch_flush(&batch);
+        file_to_append file = file_to_append_open(entry.path, entry.name, inst->no_cache);
+        failed += !file.f_stream || !__arch_append_file(inst, &file);
+        file_to_append_close(&file);
+        fs_entry_close(&entry);
+    }
+    const bool walked = fs_walk_finish(walker);
+    __small_file_batch_flush(&batch);
+    free(batch.jobs);
+    free(batch.groups);
+
+    arch_instance_sync_header(inst);
+    return walked && failed == 0 && batch.failed == 0;
+}
+
+// With a hash tree the decoded bytes are checked against the root as they
+// go out. False if a chunk stayed damaged or the bytes do not match.
+bool __arch_decode_member(arch_instance *inst, const arch_file_header *hdr, const char *name, FILE *out)
+{
+    if (hdr->init_size == 0)
+    {
+        return true;
+    }
+    FILE *src = inst->f;
+    if (inst->no_cache)
+    {
+        fflush(inst->f);
+        if (!inst->direct_f)
+        {
+            inst->direct_f = fdopen_direct(fileno(inst->f));
+        }
+        src = inst->direct_f ? inst->direct_f : inst->f;
+    }
+    if (fseek(src, hdr->offset, SEEK_SET))
+    {
+        assert(false && "fseek(src, hdr->offset, SEEK_SET)");
+    }
+    const bool check = inst->cnf.hash_tree && merkle_root_known(hdr->root);
+    merkle_builder tree = merkle_builder_new(hdr->init_size);
+    decode_stats stats = do_file_decoding((encoded_file){
+                                              .file = src,
+                                              .src_file_len = hdr->init_size,
+                                              .enc_file_len = hdr->enc_size,
+                                              .name_len = hdr->name_len,
+                                              .tree = check ? &tree : NULL,
+                                          },
+                                          out, inst->cnf);
+    if (stats.corrected || stats.failed)
+    {
+        fprintf(stderr, "[%s]: %lu chunks corrected, %lu damaged; run --repair to fix the archive\n", name, stats.corrected, stats.failed);
+    }
+    if (!check)
+    {
+        return stats.failed == 0;
+    }
+    uint8_t root[BLAKE3_OUT_LEN];
+    byte_buf nodes = {0};
+    merkle_builder_finish(&tree, &nodes, root);
+    byte_buf_close(&nodes);
+    if (memcmp(root, hdr->root, BLAKE3_OUT_LEN) != 0)
+    {
+        fprintf(stderr, "[%s]: the content does not match its hash\n", name);
+        return false;
+    }
+    return stats.failed == 0;
+}
+
+// Gives an extracted file the mode and mtime of its member through the
+// descriptor it was written with, the owner too when run as root (as tar
+// does). Members of unknown mode keep the defaults.
+void __arch_restore_attrs(int fd, const arch_file_header *hdr, const char *path)
+{
+    if (hdr->mode && geteuid() == 0 && fchown(fd, hdr->uid, hdr->gid))
+    {
+        fprintf(stderr, "Could not restore the owner of %s\n", path);
+    }
+    // after fchown, which drops the set-id bits
+    if (hdr->mode && fchmod(fd, hdr->mode & 07777))
+    {
+        fprintf(stderr, "Could not restore the mode of %s\n", path);
+    }
+    if (hdr->mtime == 0)
+    {
+        return;
+    }
+    int64_t sec = hdr->mtime / 1000000000ll, nsec = hdr->mtime % 1000000000ll;
+    if (nsec < 0)
+    {
+        sec -= 1;
+        nsec += 1000000000ll;
+    }
+    const struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = sec, .tv_nsec = nsec}};
+    if (futimens(fd, times))
+    {
+        fprintf(stderr, "Could not restore the mtime of %s\n", path);
+    }
+}
+
+// Decodes the member to a new file under dir, its path goes to fin_name (PATH_MAX bytes).
+// false also when some chunk was uncorrectable, what was decoded is left in the file.
+bool __arch_extract_to(arch_instance *inst, const arch_file_header *hdr, const char *name, const char *dir, char *fin_name)
+{
+    if (!is_safe_relative_path(name))
+    {
+        fprintf(stderr, "Refusing to extract file with unsafe name: %s\n", name);
+        return false;
+    }
+
+    memset(fin_name, 0, PATH_MAX);
+    join_dir_and_file(fin_name, PATH_MAX - 32, dir, name);
+
+    mkdir_parents(fin_name);
+    make_unique_filename(fin_name);
+
+    FILE *f = fopen(fin_name, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Could not create file to extract: %s\n", fin_name);
+        return false;
+    }
+    const bool ok = __arch_decode_member(inst, hdr, name, f);
+    fflush(f);
+    __arch_restore_attrs(fileno(f), hdr, fin_name);
+    if (inst->no_cache)
+    {
+        drop_written_file(fileno(f));
+    }
+    fclose(f);
+    return ok;
+}
+
+// Same, the path written to is returned to free, or NULL unless it was decoded whole
+char *__arch_extract_single(arch_instance *inst, const arch_file_header *hdr, const char *name, const char *dir)
+{
+    char fin_name[PATH_MAX];
+    return __arch_extract_to(inst, hdr, name, dir, fin_name) ? strdup(fin_name) : NULL;
+}
+
+arch_file_header *arch_find_file(arch_instance *inst, const char *filename)
+{
+    for (size_t i = 0; i < inst->hdr.file_count; ++i)
+    {
+        if (strcmp(arch_file_name(inst, &inst->file_hdrs[i]), filename) == 0)
+        {
+            return &inst->file_hdrs[i];
+        }
+    }
+    return NULL;
+}
+
+// Decodes n bytes from position at of the size bytes encoded at offset,
+// reading only the chunks they are in. false if some chunk is uncorrectable.
+bool __arch_read_decoded(const arch_instance *inst, size_t offset, int64_t backup_offset, size_t size, size_t at, uint8_t *dst, size_t n)
+{
+    if (at > size || n > size - at)
+    {
+        return false;
+    }
+    chunk_cursor c = chunk_cursor_open(fileno(inst->f), offset, backup_offset, size, at, inst->cnf, inst->cnf.enc_BYTES_per_chunk);
+    size_t done = 0;
+    while (done < n)
+    {
+        size_t got = chunk_cursor_fill(&c, 1);
+        if (got == 0)
+        {
+            break;
+        }
+        got = got < n - done ? got : n - done;
+        memcpy(dst + done, c.buf + c.head, got);
+        c.head += got;
+        done += got;
+    }
+    const bool ok = done == n && !c.failed;
+    chunk_cursor_close(&c);
+    return ok;
+}
+
+// strcmp of the stored name, n bytes of it read, with name of length len
+int __arch_stored_name_cmp(const uint8_t *stored, size_t n, const char *name, size_t len)
+{
+    for (size_t i = 0; i < n && i <= len; ++i)
+    {
+        const uint8_t c = (uint8_t)name[i];
+        if (stored[i] != c)
+        {
+            return stored[i] < c ? -1 : 1;
+        }
+        if (c == '\0')
         {
-            assert(false && "fseek(inst.f, hdrs[i].offset, SEEK_SET)");
+            return 0;
         }
-        do_file_encoding(files.arr[i].f_stream, new_hdrs[i].init_size, inst->f, inst->cnf);
     }
-
-    arch_instance_sync_header(inst);
+    return -1;
 }
 
-void arch_insert_files(arch_instance *inst, string_array filenames)
+// 1 or 0 as the lookup block tells, -1 if there is none or it can not be read
+int __arch_lookup_find(arch_instance *inst, const char *name)
 {
-    assert(filenames.len > 0);
-    file_to_append_array files = {.arr = calloc(filenames.len, sizeof(file_to_append)), .len = filenames.len};
-    while (true)
+    const arch_header *hdr = &inst->hdr;
+    if (hdr->lookup_size < ARCH_LOOKUP_HEADER_SIZE)
+    {
+        return -1;
+    }
+    fflush(inst->f);
+    uint8_t buf[ARCH_LOOKUP_BLOCK_SIZE];
+    uint64_t n_names, n_blocks;
+    const uint8_t *p = buf;
+    if (!__arch_read_decoded(inst, hdr->lookup_offset, -1, hdr->lookup_size, 0, buf, ARCH_LOOKUP_HEADER_SIZE) ||
+        !le64_read(&p, buf + ARCH_LOOKUP_HEADER_SIZE, &n_names) || !le64_read(&p, buf + ARCH_LOOKUP_HEADER_SIZE, &n_blocks) ||
+        n_blocks == 0 || n_blocks > hdr->lookup_size / ARCH_LOOKUP_BLOCK_SIZE ||
+        ARCH_LOOKUP_HEADER_SIZE + n_blocks * ARCH_LOOKUP_BLOCK_SIZE + n_names * 8 != hdr->lookup_size)
+    {
+        return -1;
+    }
+
+    const size_t len = strlen(name);
+    const arch_lookup_probe probe = arch_lookup_probe_of(name, len, n_blocks);
+    if (!__arch_read_decoded(inst, hdr->lookup_offset, -1, hdr->lookup_size, ARCH_LOOKUP_HEADER_SIZE + probe.block * ARCH_LOOKUP_BLOCK_SIZE, buf, ARCH_LOOKUP_BLOCK_SIZE) ||
+        !__arch_lookup_block_ok(buf))
+    {
+        return -1;
+    }
+    for (size_t k = 0; k < ARCH_LOOKUP_HASHES; ++k)
     {
-        bool is_error = false;
-        for (size_t i = 0; i < filenames.len; ++i)
+        if (!(buf[probe.bits[k] / BITS_IN_BYTE] >> (probe.bits[k] % BITS_IN_BYTE) & 1))
         {
-            files.arr[i] = file_to_append_open(filenames.arr[i]);
-            if (!files.arr[i].f_stream)
-            {
-                is_error = true;
-                break;
-            }
+            return 0;
         }
-        if (is_error)
+    }
+
+    // the filter lets it through, the sorted names tell for sure
+    const size_t sorted_at = ARCH_LOOKUP_HEADER_SIZE + n_blocks * ARCH_LOOKUP_BLOCK_SIZE;
+    const size_t table_size = hdr->dir_size + hdr->names_size;
+    uint8_t *stored = malloc(len + 1);
+    size_t lo = 0, hi = n_names;
+    int found = 0;
+    while (lo < hi)
+    {
+        const size_t mid = lo + (hi - lo) / 2;
+        uint8_t raw[8];
+        uint64_t pos;
+        p = raw;
+        if (!__arch_read_decoded(inst, hdr->lookup_offset, -1, hdr->lookup_size, sorted_at + mid * 8, raw, 8) ||
+            !le64_read(&p, raw + 8, &pos) || pos < hdr->dir_size || pos >= table_size)
         {
+            found = -1;
             break;
         }
-
-        __arch_insert_file_streams(inst, files);
-        break;
+        const size_t n = table_size - pos < len + 1 ? table_size - pos : len + 1;
+        if (!__arch_read_decoded(inst, hdr->dir_offset, hdr->dir_copy_offset, table_size, pos, stored, n))
+        {
+            found = -1;
+            break;
+        }
+        const int cmp = __arch_stored_name_cmp(stored, n, name, len);
+        if (cmp == 0)
+        {
+            found = 1;
+            break;
+        }
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
     }
+    free(stored);
+    return found;
+}
 
-    for (size_t i = 0; i < filenames.len; ++i)
+// Whether some member is called name. The lookup block is asked when there is
+// one: a name that is not there costs a block of its filter, one that is a
+// binary search over the sorted names. Older archives, or a damaged block,
+// stream the member table instead.
+bool arch_contains(arch_instance *inst, const char *name)
+{
+    if (inst->files_loaded)
+    {
+        return arch_find_file(inst, name) != NULL;
+    }
+    const int found = __arch_lookup_find(inst, name);
+    if (found >= 0)
+    {
+        return found;
+    }
+    arch_table_reader r = arch_table_reader_open(inst);
+    arch_file_header hdr;
+    const char *member;
+    bool hit = false;
+    while (!hit && arch_table_reader_next(&r, &hdr, &member))
     {
-        file_to_append_close(&files.arr[i]);
+        hit = strcmp(member, name) == 0;
     }
-    free(files.arr);
-    files = (file_to_append_array){0};
+    // stopping early is not a failure, damage is reported as it is read
+    arch_table_reader_close(&r, NULL);
+    return hit;
 }
 
-char *__arch_extract_single(arch_instance *inst, const arch_file_header *hdr, const char *dir)
+// False if some chunk of the lookup block needs correction or it does not
+// hold together: its sizes, the block checks and where the names are.
+bool __arch_lookup_intact(const arch_instance *inst)
 {
-    char fin_name[150] = {0};
-    join_dir_and_file(fin_name, 150, dir, hdr->filename);
-
-    make_unique_filename(fin_name);
-
-    FILE *f = fopen(fin_name, "w");
-    if (!f)
+    const arch_header *hdr = &inst->hdr;
+    if (hdr->lookup_size == 0)
     {
-        fprintf(stderr, "Could not create file to extract: %s\n", fin_name);
-        return NULL;
+        return true;
     }
-    if (fseek(inst->f, hdr->offset, SEEK_SET))
+    fflush(inst->f);
+    uint8_t *raw = malloc(hdr->lookup_size);
+    decode_stats stats = {0};
+    bool ok = decode_region(fileno(inst->f), hdr->lookup_offset, -1, hdr->lookup_size, raw, inst->cnf, &stats) && stats.corrected == 0;
+
+    const uint8_t *p = raw, *end = raw + hdr->lookup_size;
+    uint64_t n_names = 0, n_blocks = 0;
+    ok = ok && le64_read(&p, end, &n_names) && le64_read(&p, end, &n_blocks) &&
+         n_blocks > 0 && n_blocks <= hdr->lookup_size / ARCH_LOOKUP_BLOCK_SIZE &&
+         ARCH_LOOKUP_HEADER_SIZE + n_blocks * ARCH_LOOKUP_BLOCK_SIZE + n_names * 8 == hdr->lookup_size;
+    for (size_t b = 0; ok && b < n_blocks; ++b, p += ARCH_LOOKUP_BLOCK_SIZE)
     {
-        assert(false && "fseek(inst->f, hdr->offset, SEEK_SET)");
+        ok = __arch_lookup_block_ok(p);
     }
-    do_file_decoding((encoded_file){
-                         .file = inst->f,
-                         .src_file_len = hdr->init_size,
-                         .enc_file_len = hdr->enc_size,
-                     },
-                     f, inst->cnf);
-    fclose(f);
-    return strdup(fin_name);
+    for (size_t i = 0; ok && i < n_names; ++i)
+    {
+        uint64_t pos;
+        ok = le64_read(&p, end, &pos) && pos >= hdr->dir_size && pos < hdr->dir_size + hdr->names_size;
+    }
+    free(raw);
+    return ok;
 }
 
-string_array_to_free arch_extract_files(arch_instance *inst, const char *dir, string_array filenames)
+// Extracts the member if it is one of filenames (all of them when there are none),
+// false if it was and could not be extracted whole
+bool __arch_extract_if_requested(arch_instance *inst, const arch_file_header *hdr, const char *name, const char *dir,
+                                 string_array filenames, bool *found, string_array_to_free *result)
 {
+    char fin_name[PATH_MAX];
     if (filenames.len == 0)
     {
-        string_array_to_free result_fnames = {.arr = calloc(inst->hdr.file_count, sizeof(char *)), .len = inst->hdr.file_count};
-        for (size_t i = 0; i < inst->hdr.file_count; ++i)
+        return __arch_extract_to(inst, hdr, name, dir, fin_name);
+    }
+    // the first member of a name is the one extracted, as with arch_find_file
+    bool ok = true;
+    for (size_t name_i = 0; name_i < filenames.len; ++name_i)
+    {
+        if (!found[name_i] && strcmp(name, filenames.arr[name_i]) == 0)
         {
-            result_fnames.arr[i] = __arch_extract_single(inst, &inst->file_hdrs[i], dir);
+            found[name_i] = true;
+            const bool extracted = __arch_extract_to(inst, hdr, name, dir, fin_name);
+            result->arr[name_i] = extracted ? arena_strdup(&result->mem, fin_name) : NULL;
+            ok &= extracted;
         }
-        return result_fnames;
     }
+    return ok;
+}
 
-    string_array_to_free result_fnames = {.arr = calloc(filenames.len, sizeof(char *)), .len = filenames.len};
-    for (size_t name_i = 0; name_i < filenames.len; ++name_i)
+// Unless it is loaded already the member table is streamed, every member is
+// extracted as its record goes by. Returns the paths written for the
+// requested names, by their index; with no names every member is extracted
+// and nothing is returned. all_ok (if not NULL) tells whether every member
+// asked for was found and extracted whole.
+string_array_to_free arch_extract_files(arch_instance *inst, const char *dir, string_array filenames, bool *all_ok)
+{
+    string_array_to_free result_fnames = {.len = filenames.len};
+    result_fnames.arr = filenames.len ? arena_calloc(&result_fnames.mem, filenames.len, sizeof(char *)) : NULL;
+    const arena_mark mark = arena_save(&inst->scratch);
+    bool *found = arena_calloc(&inst->scratch, filenames.len, sizeof(bool));
+    bool ok = true, extracted = true;
+    if (inst->files_loaded)
     {
-        const arch_file_header *hdr = NULL;
         for (size_t i = 0; i < inst->hdr.file_count; ++i)
         {
-            if (strcmp(inst->file_hdrs[i].filename, filenames.arr[name_i]) == 0)
+            extracted &= __arch_extract_if_requested(inst, &inst->file_hdrs[i], arch_file_name(inst, &inst->file_hdrs[i]), dir, filenames, found, &result_fnames);
+        }
+    }
+    else
+    {
+        arch_table_reader r = arch_table_reader_open(inst);
+        arch_file_header hdr;
+        const char *name;
+        while (arch_table_reader_next(&r, &hdr, &name))
+        {
+            extracted &= __arch_extract_if_requested(inst, &hdr, name, dir, filenames, found, &result_fnames);
+        }
+        ok = arch_table_reader_close(&r, NULL);
+    }
+    if (ok)
+    {
+        for (size_t name_i = 0; name_i < filenames.len; ++name_i)
+        {
+            if (!found[name_i])
             {
-                hdr = &inst->file_hdrs[i];
-                break;
+                fprintf(stderr, "No file [%s] in archive [%s]\n", filenames.arr[name_i], inst->name);
+                extracted = false;
             }
         }
+    }
+    arena_restore(&inst->scratch, mark);
+    if (all_ok)
+    {
+        *all_ok = ok && extracted;
+    }
+    return result_fnames;
+}
 
-        if (!hdr)
+// Drops members with removed[i] set (i < n_removed). Their data becomes free
+// space after the next commit, nothing is moved.
+void __arch_remove_marked(arch_instance *inst, const bool *removed, size_t n_removed)
+{
+    __arch_begin_write(inst);
+    size_t kept = 0;
+    for (size_t i = 0; i < inst->hdr.file_count; ++i)
+    {
+        if (i < n_removed && removed[i])
         {
-            fprintf(stderr, "No file [%s] in archive [%s]\n", filenames.arr[name_i], inst->name);
             continue;
         }
-        __arch_extract_single(inst, hdr, dir);
+        inst->file_hdrs[kept++] = inst->file_hdrs[i];
     }
-
-    return result_fnames;
+    inst->hdr.file_count = kept;
 }
 
 void arch_delete_files(arch_instance *inst, string_array filenames, const char *dir)
 {
-    string_array_to_free arr = arch_extract_files(inst, dir, filenames);
+    if (!arch_instance_load_files(inst))
+    {
+        return;
+    }
+    string_array_to_free arr = arch_extract_files(inst, dir, filenames, NULL);
     string_array_to_free_close(&arr);
 
     if (filenames.len == 0)
     {
+        __arch_begin_write(inst);
         inst->hdr.file_count = 0;
         arch_instance_sync_header(inst);
         return;
     }
 
+    const arena_mark mark = arena_save(&inst->scratch);
+    bool *removed = arena_calloc(&inst->scratch, inst->hdr.file_count, sizeof(bool));
     for (size_t i = 0; i < filenames.len; ++i)
     {
         const char *fname = filenames.arr[i];
 
-        arch_file_header *hdr = NULL;
-        size_t hdr_index;
-        for (size_t hdr_i = 0; hdr_i < inst->hdr.file_count; ++hdr_i)
+        arch_file_header *hdr = arch_find_file(inst, fname);
+        if (!hdr)
+        {
+            fprintf(stderr, "Could not locate file [%s] to delete\n", fname);
+            continue;
+        }
+        removed[hdr - inst->file_hdrs] = true;
+    }
+    __arch_remove_marked(inst, removed, inst->hdr.file_count);
+    arena_restore(&inst->scratch, mark);
+    arch_instance_sync_header(inst);
+}
+
+// open addressing table from member name to member index
+typedef struct
+{
+    size_t *slots; // index + 1, 0 is empty
+    size_t mask;
+} arch_name_index;
+
+arch_name_index arch_name_index_build(const arch_instance *inst)
+{
+    size_t cap = 16;
+    while (cap < inst->hdr.file_count * 2)
+    {
+        cap *= 2;
+    }
+    arch_name_index idx = {.slots = calloc(cap, sizeof(size_t)), .mask = cap - 1};
+    for (size_t i = 0; i < inst->hdr.file_count; ++i)
+    {
+        const arch_file_header *hdr = &inst->file_hdrs[i];
+        size_t slot = content_hash_update(CONTENT_HASH_INIT, arch_file_name(inst, hdr), hdr->name_len) & idx.mask;
+        for (; idx.slots[slot] != 0; slot = (slot + 1) & idx.mask)
         {
-            if (strcmp(inst->file_hdrs[hdr_i].filename, fname) == 0)
+            if (strcmp(arch_file_name(inst, &inst->file_hdrs[idx.slots[slot] - 1]), arch_file_name(inst, hdr)) == 0)
             {
-                hdr = &inst->file_hdrs[hdr_i];
-                hdr_index = hdr_i;
                 break;
             }
         }
-        if (!hdr)
+        if (idx.slots[slot] == 0)
         {
-            fprintf(stderr, "Could not locate file [%s] to delete\n", fname);
+            idx.slots[slot] = i + 1;
+        }
+    }
+    return idx;
+}
+
+// index of the member or -1
+int64_t arch_name_index_find(const arch_name_index *idx, const arch_instance *inst, const char *name)
+{
+    size_t slot = content_hash_update(CONTENT_HASH_INIT, name, strlen(name)) & idx->mask;
+    for (; idx->slots[slot] != 0; slot = (slot + 1) & idx->mask)
+    {
+        if (strcmp(arch_file_name(inst, &inst->file_hdrs[idx->slots[slot] - 1]), name) == 0)
+        {
+            return idx->slots[slot] - 1;
+        }
+    }
+    return -1;
+}
+
+void arch_name_index_close(arch_name_index *idx)
+{
+    free(idx->slots);
+    *idx = (arch_name_index){0};
+}
+
+bool __arch_file_is_unchanged(const arch_file_header *hdr, const struct stat *st, const char *path, bool use_checksum)
+{
+    if ((size_t)st->st_size != hdr->init_size)
+    {
+        return false;
+    }
+    if (!use_checksum)
+    {
+        return stat_mtime_ns(st) == hdr->mtime;
+    }
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return false;
+    }
+    // a file that could not be read whole is taken as changed, encoding it again tells
+    uint64_t h;
+    const bool read = content_hash_stream(f, hdr->init_size, &h);
+    fclose(f);
+    return read && h == hdr->hash;
+}
+
+// Re-encodes only the members whose size, mtime (or content hash with use_checksum)
+// differ from the input files. A changed member is written to free space and
+// its old data is released by the commit. False if some file was left out.
+bool arch_update_files(arch_instance *inst, string_array filenames, bool use_checksum)
+{
+    if (!arch_instance_load_files(inst))
+    {
+        return false;
+    }
+    size_t n_skipped = 0, n_replaced = 0, n_appended = 0, n_failed = 0;
+
+    arch_name_index idx = arch_name_index_build(inst);
+
+    struct stat arch_st = {0};
+    fstat(fileno(inst->f), &arch_st);
+
+    const size_t budget = arch_io_budget(inst);
+    fs_walker *walker = fs_walk_start(filenames.arr, filenames.len, FS_WALK_THREADS, budget ? budget_workers(budget / 4, FS_ENTRY_MEMORY, SIZE_MAX) : 0);
+    fs_entry entry;
+    while (fs_walk_next(walker, &entry))
+    {
+        if (__is_same_file(&entry.st, &arch_st))
+        {
+            fs_entry_close(&entry);
             continue;
         }
 
-        if (hdr_index == inst->hdr.file_count - 1)
+        int64_t hdr_i = arch_name_index_find(&idx, inst, entry.name);
+        arch_file_header *hdr = hdr_i < 0 ? NULL : &inst->file_hdrs[hdr_i];
+
+        // a chmod or chown alone is taken into the record, the data stays
+        if (hdr && __arch_file_is_unchanged(hdr, &entry.st, entry.path, use_checksum))
         {
-            // skip for now
+            hdr->mtime = stat_mtime_ns(&entry.st);
+            hdr->mode = entry.st.st_mode;
+            hdr->uid = entry.st.st_uid;
+            hdr->gid = entry.st.st_gid;
+            n_skipped += 1;
+            fs_entry_close(&entry);
+            continue;
         }
-        else
+
+        file_to_append file = file_to_append_open(entry.path, entry.name, inst->no_cache);
+        if (!file.f_stream)
         {
-            int64_t end_offset = inst->file_hdrs[inst->hdr.file_count - 1].offset + inst->file_hdrs[inst->hdr.file_count - 1].enc_size;
-            int64_t start_offset = hdr->offset + hdr->enc_size;
-            int64_t shift_len = hdr->enc_size;
-            left_shift_file(end_offset, start_offset, shift_len, inst->f);
+            n_failed += 1;
+            fs_entry_close(&entry);
+            continue;
         }
 
-        // fix offsets
-        for (size_t i = hdr_index + 1; i < inst->hdr.file_count; ++i)
+        // a member that could not be written again keeps its old data
+        arch_file_header fresh = hdr ? *hdr : (arch_file_header){0};
+        if (hdr && __arch_encode_file(inst, &file, &fresh))
+        {
+            *hdr = fresh;
+            n_replaced += 1;
+        }
+        else if (!hdr && __arch_append_file(inst, &file))
         {
-            inst->file_hdrs[i].offset -= hdr->enc_size;
-            inst->file_hdrs[i - 1] = inst->file_hdrs[i];
+            n_appended += 1;
         }
-        inst->hdr.file_count -= 1;
+        else
+        {
+            n_failed += 1;
+        }
+        file_to_append_close(&file);
+        fs_entry_close(&entry);
     }
+    const bool walked = fs_walk_finish(walker);
+
     arch_instance_sync_header(inst);
+
+    fprintf(stdout, "arch %s updated: %lu unchanged, %lu replaced, %lu appended\n", inst->name, n_skipped, n_replaced, n_appended);
+    if (n_failed)
+    {
+        fprintf(stderr, "arch %s: %lu files could not be read or written and were left as they are\n", inst->name, n_failed);
+    }
+    arch_name_index_close(&idx);
+    return walked && n_failed == 0;
 }
 
 typedef struct
@@ -470,66 +2272,336 @@ void arch_array_close(arch_array *p)
     *p = (arch_array){0};
 }
 
-void arch_concat_archs(const char *dst_name, arch_array archs)
+#define CONCAT_MAX_THREADS 16
+#define CONCAT_COPY_BUF_SIZE (1024 * 1024)
+
+// One member of a source archive and the place planned for it in the destination
+typedef struct
 {
-    arch_instance dst_inst = {0};
+    arch_instance *src;
+    const arch_file_header *src_hdr;
+    size_t dst_i;
+    uint64_t member_id; // for restamping the resync markers of a copied member
+} concat_job;
 
-    for (size_t i = 0; i < archs.len; ++i)
+typedef struct
+{
+    arch_instance *dst;
+    concat_job *jobs;
+    size_t n_jobs;
+
+    pthread_mutex_t lock;
+    size_t next_job;
+    size_t failed;
+} concat_plan;
+
+bool __copy_range(int src_fd, int64_t src_off, int dst_fd, int64_t dst_off, size_t len, uint8_t **buf)
+{
+    while (len > 0)
     {
-        if (strcmp(archs.arr[i].name, dst_name) == 0)
+        ssize_t n = copy_file_range(src_fd, &src_off, dst_fd, &dst_off, len, 0);
+        if (n <= 0)
         {
-            dst_inst = archs.arr[i];
-            for (size_t j = i + 1; j < archs.len; ++j)
-            {
-                archs.arr[j - 1] = archs.arr[j];
-            }
-            archs.len -= 1;
             break;
         }
+        len -= n;
+    }
+    // copy_file_range is not there on every filesystem pair
+    if (len > 0 && !*buf)
+    {
+        *buf = malloc(CONCAT_COPY_BUF_SIZE);
+    }
+    while (len > 0)
+    {
+        size_t n = len < CONCAT_COPY_BUF_SIZE ? len : CONCAT_COPY_BUF_SIZE;
+        if (pread(src_fd, *buf, n, src_off) != (ssize_t)n || pwrite(dst_fd, *buf, n, dst_off) != (ssize_t)n)
+        {
+            return false;
+        }
+        src_off += n;
+        dst_off += n;
+        len -= n;
+    }
+    return true;
+}
+
+// the copied markers still carry the ids of the source archive
+bool __concat_restamp_markers(const concat_plan *plan, const concat_job *job, int dst_fd)
+{
+    const arch_instance *dst = plan->dst;
+    const arch_file_header *hdr = &dst->file_hdrs[job->dst_i];
+    const char *name = arch_file_name(dst, hdr);
+    const size_t n_markers = calc_sync_marker_count(hdr->init_size, dst->cnf);
+    byte_buf buf = {0};
+    bool ok = true;
+    for (size_t k = 0; ok && k < n_markers; ++k)
+    {
+        const size_t chunk = k * dst->cnf.sync_group;
+        const sync_marker m = {
+            .member_id = job->member_id,
+            .chunk = chunk,
+            .init_size = hdr->init_size,
+            .mtime = hdr->mtime,
+            .bytes_per_chunk = dst->cnf.BYTES_per_chunk,
+            .group = dst->cnf.sync_group,
+            .name_len = hdr->name_len,
+        };
+        buf.len = 0;
+        sync_marker_push(&buf, &m, name);
+        const size_t at = calc_chunk_enc_offset(chunk, hdr->name_len, dst->cnf) - buf.len;
+        ok = pwrite(dst_fd, buf.ptr, buf.len, hdr->offset + at) == (ssize_t)buf.len;
+    }
+    byte_buf_close(&buf);
+    return ok;
+}
+
+void *__concat_copy_thread(void *arg)
+{
+    concat_plan *plan = arg;
+    const int dst_fd = fileno(plan->dst->f);
+    uint8_t *buf = NULL;
+    while (true)
+    {
+        pthread_mutex_lock(&plan->lock);
+        const concat_job *job = plan->next_job < plan->n_jobs ? &plan->jobs[plan->next_job++] : NULL;
+        pthread_mutex_unlock(&plan->lock);
+        if (!job)
+        {
+            break;
+        }
+
+        const arch_file_header *dst_hdr = &plan->dst->file_hdrs[job->dst_i];
+        bool ok = __copy_range(fileno(job->src->f), job->src_hdr->offset, dst_fd, dst_hdr->offset, dst_hdr->enc_size, &buf) &&
+                  (plan->dst->cnf.sync_group == 0 || __concat_restamp_markers(plan, job, dst_fd));
+        if (plan->dst->no_cache)
+        {
+            posix_fadvise(fileno(job->src->f), job->src_hdr->offset, job->src_hdr->enc_size, POSIX_FADV_DONTNEED);
+            drop_written_range(dst_fd, dst_hdr->offset, dst_hdr->enc_size);
+        }
+        if (!ok)
+        {
+            fprintf(stderr, "Could not copy [%s] from arch %s\n", arch_file_name(job->src, job->src_hdr), job->src->name);
+            pthread_mutex_lock(&plan->lock);
+            plan->failed += 1;
+            pthread_mutex_unlock(&plan->lock);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+bool __arch_same_layout(const arch_instance *lhs, const arch_instance *rhs)
+{
+    return lhs->cnf.BYTES_per_chunk == rhs->cnf.BYTES_per_chunk && lhs->cnf.sync_group == rhs->cnf.sync_group &&
+           lhs->cnf.parity_data == rhs->cnf.parity_data && lhs->cnf.parity_count == rhs->cnf.parity_count &&
+           lhs->cnf.parity_checks_copy == rhs->cnf.parity_checks_copy && lhs->cnf.hash_tree == rhs->cnf.hash_tree;
+}
+
+// Plans the whole member table first, then copies the encoded bytes of every
+// member once, in parallel. Members of archives with another chunk layout
+// are decoded and encoded again instead. All the tables are held at once, so
+// under max_memory they are checked up front and the copy threads share the rest.
+// Nothing is committed unless every member was merged, nothing is even
+// written unless every source table could be read.
+bool arch_concat_archs(const char *dst_name, arch_array archs, size_t align, bool no_cache, size_t max_memory)
+{
+    // the destination is told among the sources by its file, whatever path names it,
+    // so that a source is never created anew (and truncated) as the destination
+    arch_instance created = {0};
+    arch_instance *dst = NULL;
+    struct stat dst_st, src_st;
+    const bool dst_exists = stat(dst_name, &dst_st) == 0;
+    for (size_t i = 0; dst_exists && i < archs.len; ++i)
+    {
+        if (fstat(fileno(archs.arr[i].f), &src_st) == 0 && __is_same_file(&src_st, &dst_st))
+        {
+            dst = &archs.arr[i];
+            break;
+        }
+    }
+    // every source table is loaded, and copied into the destination one along with a job per member
+    size_t tables = dst ? arch_table_memory(&dst->hdr) : 0;
+    for (size_t i = 0; i < archs.len; ++i)
+    {
+        if (&archs.arr[i] != dst)
+        {
+            tables += 2 * arch_table_memory(&archs.arr[i].hdr) + 2 * archs.arr[i].hdr.file_count * sizeof(concat_job);
+        }
+    }
+    if (!__arch_table_fits(&(arch_instance){.name = get_clean_filename(dst_name), .max_memory = max_memory}, tables))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < archs.len; ++i)
+    {
+        if (&archs.arr[i] != dst && !arch_instance_load_files(&archs.arr[i]))
+        {
+            fprintf(stderr, "arch %s: the member table of %s could not be read, nothing merged\n", dst_name, archs.arr[i].name);
+            return false;
+        }
     }
 
-    if (!dst_inst.f)
+    if (!dst)
     {
-        dst_inst = arch_instance_create_empty(dst_name, (config){0});
-        if (!dst_inst.f)
+        created = arch_instance_create_empty(dst_name, archs.len > 0 ? archs.arr[0].cnf : (config){0});
+        if (!created.f)
         {
             fprintf(stderr, "Could not create dst arch with path [%s]\n", dst_name);
-            return;
+            return false;
+        }
+        dst = &created;
+    }
+    arch_instance_set_align(dst, align);
+    dst->no_cache = no_cache;
+    dst->max_memory = max_memory;
+    if (!arch_instance_load_files(dst))
+    {
+        if (created.f)
+        {
+            arch_instance_close(&created);
         }
+        return false;
     }
 
+    concat_plan plan = {.dst = dst};
+    concat_job *reencode = NULL;
+    size_t n_reencode = 0, n_jobs_cap = 0;
     for (size_t arch_i = 0; arch_i < archs.len; ++arch_i)
     {
-        arch_instance *cur_arch = &archs.arr[arch_i];
-        const char *temp_dir = "./_temp";
-        mkdir_if_no(temp_dir);
-
-        string_array_to_free fnames = arch_extract_files(cur_arch, temp_dir, (string_array){0});
+        arch_instance *src = &archs.arr[arch_i];
+        if (src == dst)
+        {
+            continue;
+        }
+        const bool copy = __arch_same_layout(src, dst);
+        n_jobs_cap += src->hdr.file_count;
+        plan.jobs = realloc(plan.jobs, n_jobs_cap * sizeof(concat_job));
+        reencode = realloc(reencode, n_jobs_cap * sizeof(concat_job));
 
-        fprintf(stdout, "Extracted files from arch %s:\n", cur_arch->name);
-        for (size_t i = 0; i < fnames.len; ++i)
+        for (size_t i = 0; i < src->hdr.file_count; ++i)
         {
-            if (fnames.arr[i])
+            const arch_file_header *src_hdr = &src->file_hdrs[i];
+            arch_file_header hdr = {
+                .init_size = src_hdr->init_size,
+                .enc_size = calc_member_enc_size(src_hdr->init_size, src_hdr->name_len, dst->cnf),
+                .offset = ARCH_DATA_OFFSET,
+                .mtime = src_hdr->mtime,
+                .hash = src_hdr->hash,
+                .mode = src_hdr->mode,
+                .uid = src_hdr->uid,
+                .gid = src_hdr->gid,
+            };
+            // a tree copied along keeps its root, one encoded again gets a new one
+            if (hdr.init_size == 0)
+            {
+                __arch_empty_root(dst, &hdr);
+            }
+            else if (copy)
+            {
+                memcpy(hdr.root, src_hdr->root, BLAKE3_OUT_LEN);
+            }
+            if (hdr.init_size > 0)
+            {
+                hdr.offset = __arch_alloc(dst, hdr.enc_size, dst->align);
+            }
+            __arch_push_file_header(dst, hdr, arch_file_name(src, src_hdr));
+            if (hdr.init_size == 0)
             {
-                fprintf(stdout, "Extracted file [%s]\n", fnames.arr[i]);
+                continue;
+            }
+            concat_job job = {.src = src, .src_hdr = src_hdr, .dst_i = dst->hdr.file_count - 1};
+            if (copy)
+            {
+                job.member_id = __arch_next_member_id(dst);
+                plan.jobs[plan.n_jobs++] = job;
+            }
+            else
+            {
+                reencode[n_reencode++] = job;
             }
         }
+    }
 
-        arch_insert_files(&dst_inst, (string_array){.arr = fnames.arr, .len = fnames.len});
-        string_array_to_free_close(&fnames);
+    fflush(dst->f);
+    __arch_reserve(dst, dst->space.tail);
+    pthread_mutex_init(&plan.lock, NULL);
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = n_threads < 1 ? 1 : (n_threads > CONCAT_MAX_THREADS ? CONCAT_MAX_THREADS : n_threads);
+    n_threads = budget_workers(max_memory ? max_memory - tables : 0, CONCAT_COPY_BUF_SIZE, n_threads);
+    n_threads = (size_t)n_threads > plan.n_jobs ? (long)plan.n_jobs : n_threads;
+    pthread_t threads[CONCAT_MAX_THREADS];
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_create(&threads[i], NULL, __concat_copy_thread, &plan);
+    }
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&plan.lock);
 
-        rmrf(temp_dir);
+    for (size_t i = 0; i < n_reencode; ++i)
+    {
+        const concat_job *job = &reencode[i];
+        FILE *tmp = tmpfile();
+        if (!tmp)
+        {
+            fprintf(stderr, "Could not create a temporary file for [%s]\n", arch_file_name(job->src, job->src_hdr));
+            plan.failed += 1;
+            continue;
+        }
+        // a member that does not decode whole is not encoded again from what was left of it
+        if (!__arch_decode_member(job->src, job->src_hdr, arch_file_name(job->src, job->src_hdr), tmp))
+        {
+            fprintf(stderr, "Could not decode [%s] from arch %s\n", arch_file_name(job->src, job->src_hdr), job->src->name);
+            plan.failed += 1;
+            fclose(tmp);
+            continue;
+        }
+        rewind(tmp);
+        arch_file_header *hdr = &dst->file_hdrs[job->dst_i];
+        plan.failed += !__arch_encode_to(dst, &(file_to_append){.filename = arch_file_name(dst, hdr), .f_stream = tmp}, hdr);
+        fclose(tmp);
     }
 
-    arch_instance_close(&dst_inst);
+    if (plan.failed == 0)
+    {
+        arch_instance_sync_header(dst);
+        fprintf(stdout, "arch %s: %lu members copied, %lu encoded again\n", dst->name, plan.n_jobs, n_reencode);
+    }
+    else
+    {
+        fprintf(stderr, "arch %s: %lu members could not be merged, nothing committed\n", dst->name, plan.failed);
+    }
+    free(plan.jobs);
+    free(reencode);
+    if (created.f)
+    {
+        arch_instance_close(&created);
+    }
+    return plan.failed == 0;
 }
 
-void arch_list_files(const arch_instance *inst)
+// Streams names straight from the member table unless it is loaded already
+void arch_list_files(arch_instance *inst)
 {
-    for (size_t i = 0; i < inst->hdr.file_count; ++i)
+    if (inst->files_loaded)
+    {
+        for (size_t i = 0; i < inst->hdr.file_count; ++i)
+        {
+            fprintf(stdout, "%s\n\r", arch_file_name(inst, &inst->file_hdrs[i]));
+        }
+        return;
+    }
+
+    arch_table_reader r = arch_table_reader_open(inst);
+    arch_file_header hdr;
+    const char *name;
+    while (arch_table_reader_next(&r, &hdr, &name))
     {
-        fprintf(stdout, "%s\n\r", inst->file_hdrs[i].filename);
+        fprintf(stdout, "%s\n\r", name);
     }
+    arch_table_reader_close(&r, NULL);
 }
 
-#endif
\ No newline at end of file
+#endif
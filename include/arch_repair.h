@@ -0,0 +1,356 @@
+#ifndef ARCH_REPAIR_H
+#define ARCH_REPAIR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "arch_instance.h"
+#include "member_reader.h"
+
+#define REPAIR_CHUNKS_PER_TASK 4096
+#define REPAIR_MAX_THREADS 64
+
+// Chunks are handed out to the threads in runs of at most
+// REPAIR_CHUNKS_PER_TASK, so one huge member is spread over all of them.
+// A run never crosses a resync marker, its chunks are contiguous.
+typedef struct
+{
+    const arch_instance *inst;
+    int fd;
+
+    pthread_mutex_t lock;
+    size_t next_file;
+    size_t next_chunk;
+
+    size_t chunks;
+    size_t corrected;
+    size_t failed;
+} arch_repair_job;
+
+bool __arch_repair_next_task(arch_repair_job *job, size_t *file_i, size_t *first_chunk, size_t *n_chunks)
+{
+    const arch_instance *inst = job->inst;
+    bool found = false;
+
+    pthread_mutex_lock(&job->lock);
+    for (; job->next_file < inst->hdr.file_count; ++job->next_file, job->next_chunk = 0)
+    {
+        size_t total = calc_chunk_count(inst->file_hdrs[job->next_file].init_size, inst->cnf);
+        if (job->next_chunk < total)
+        {
+            *file_i = job->next_file;
+            *first_chunk = job->next_chunk;
+            size_t n = total - job->next_chunk < REPAIR_CHUNKS_PER_TASK ? total - job->next_chunk : REPAIR_CHUNKS_PER_TASK;
+            const size_t group = inst->cnf.sync_group;
+            if (group && group - job->next_chunk % group < n)
+            {
+                n = group - job->next_chunk % group;
+            }
+            if (inst->cnf.parity_count)
+            {
+                n = calc_parity_group_size(inst->file_hdrs[job->next_file].init_size, job->next_chunk / calc_parity_group_chunks(inst->cnf), inst->cnf);
+            }
+            *n_chunks = n;
+            job->next_chunk += *n_chunks;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    return found;
+}
+
+// Writes enc over the len bytes at offset, stored as raw, if they differ; false if that fails
+bool __arch_repair_write_diff(const arch_repair_job *job, int64_t offset, const uint8_t *raw, const uint8_t *enc, size_t len, size_t *corrected)
+{
+    if (memcmp(raw, enc, len) == 0)
+    {
+        return true;
+    }
+    if (pwrite(job->fd, enc, len, offset) != (ssize_t)len)
+    {
+        return false;
+    }
+    *corrected += 1;
+    return true;
+}
+
+// With parity a task is one group. Its chunks are decoded, rebuilt where
+// they have to be, and encoded again: every chunk that comes out different
+// from the stored one is written back, and so is the record when the whole
+// group is intact.
+void __arch_repair_group(arch_repair_job *job, const arch_file_header *hdr, size_t first_chunk, byte_buf *raw, size_t *chunks, size_t *corrected, size_t *failed)
+{
+    const arch_instance *inst = job->inst;
+    const config cnf = inst->cnf;
+    const size_t g = first_chunk / calc_parity_group_chunks(cnf);
+    const size_t size = calc_parity_group_size(hdr->init_size, g, cnf);
+    size_t start, record_at, end;
+    calc_parity_span(hdr->init_size, g, hdr->name_len, cnf, &start, &record_at, &end);
+    raw->len = 0;
+    byte_buf_reserve(raw, end - start);
+    if (pread(job->fd, raw->ptr, end - start, hdr->offset + start) != (ssize_t)(end - start))
+    {
+        fprintf(stderr, "Could not read chunks %lu..%lu of [%s]\n", first_chunk, first_chunk + size, arch_file_name(inst, hdr));
+        *failed += size;
+        return;
+    }
+
+    uint8_t *dec = malloc(size * cnf.BYTES_per_chunk);
+    bool *lost = malloc(size * sizeof(bool));
+    const decode_stats stats = decode_parity_group(raw->ptr, hdr->init_size, hdr->name_len, g, dec, lost, cnf);
+    *chunks += stats.chunks;
+
+    uint8_t *enc = malloc(cnf.enc_BYTES_per_chunk);
+    parity_encoder pe = parity_encoder_new(hdr->init_size, cnf);
+    const byte_buf *record = NULL;
+    for (size_t t = 0; t < size; ++t)
+    {
+        const size_t j = first_chunk + t, n = calc_chunk_bytes(hdr->init_size, j, cnf);
+        record = parity_encoder_add(&pe, j, dec + t * cnf.BYTES_per_chunk, n);
+        if (lost[t])
+        {
+            fprintf(stderr, "Uncorrectable chunk %lu of [%s]\n", j, arch_file_name(inst, hdr));
+            *failed += 1;
+            continue;
+        }
+        const size_t at = calc_chunk_enc_offset(j, hdr->name_len, cnf) - start;
+        const size_t enc_n = encode_chunk_to(dec + t * cnf.BYTES_per_chunk, n, enc, cnf);
+        if (!__arch_repair_write_diff(job, hdr->offset + start + at, raw->ptr + at, enc, enc_n, corrected))
+        {
+            fprintf(stderr, "Could not write back chunk %lu of [%s]\n", j, arch_file_name(inst, hdr));
+            *failed += 1;
+        }
+    }
+    for (size_t at = 0; stats.failed == 0 && record && at < record->len; at += cnf.enc_BYTES_per_chunk)
+    {
+        const size_t len = record->len - at < cnf.enc_BYTES_per_chunk ? record->len - at : cnf.enc_BYTES_per_chunk;
+        if (!__arch_repair_write_diff(job, hdr->offset + record_at + at, raw->ptr + record_at - start + at, record->ptr + at, len, corrected))
+        {
+            fprintf(stderr, "Could not write back the parity of chunks %lu..%lu of [%s]\n", first_chunk, first_chunk + size, arch_file_name(inst, hdr));
+            *failed += 1;
+            break;
+        }
+    }
+    parity_encoder_close(&pe);
+    free(enc);
+    free(lost);
+    free(dec);
+}
+
+// Corrects n_chunks chunks from first_chunk of a stream of init_size bytes,
+// the chunks lying back to back from offset. what names the stream in messages.
+void __arch_repair_run(arch_repair_job *job, int64_t offset, size_t init_size, size_t first_chunk, size_t n_chunks, uint8_t *buf,
+                       const char *what, const char *name, size_t *chunks, size_t *corrected, size_t *failed)
+{
+    const config cnf = job->inst->cnf;
+    // every chunk but the last one of a stream is a whole chunk
+    const size_t last_bytes = (calc_chunk_enc_bits(init_size, first_chunk + n_chunks - 1, cnf) + BITS_IN_BYTE - 1) / BITS_IN_BYTE;
+    const size_t len = (n_chunks - 1) * cnf.enc_BYTES_per_chunk + last_bytes;
+
+    if (pread(job->fd, buf, len, offset) != (ssize_t)len)
+    {
+        fprintf(stderr, "Could not read chunks %lu..%lu of %s[%s]\n", first_chunk, first_chunk + n_chunks, what, name);
+        *failed += n_chunks;
+        return;
+    }
+
+    for (size_t k = 0; k < n_chunks; ++k)
+    {
+        bit_vec chunk = {.ptr = (char *)buf + k * cnf.enc_BYTES_per_chunk, .bit_count = calc_chunk_enc_bits(init_size, first_chunk + k, cnf)};
+        chunk.r_size = (chunk.bit_count + BITS_IN_BYTE - 1) / BITS_IN_BYTE;
+        *chunks += 1;
+
+        size_t syndrome = chunk_syndrome((const uint8_t *)chunk.ptr, chunk.bit_count, cnf);
+        if (syndrome == 0)
+        {
+            continue;
+        }
+        if (syndrome > chunk.bit_count)
+        {
+            fprintf(stderr, "Uncorrectable chunk %lu of %s[%s]\n", first_chunk + k, what, name);
+            *failed += 1;
+            continue;
+        }
+
+        bit_vec_set_bit_at(&chunk, syndrome - 1, !bit_vec_get_bit_at(&chunk, syndrome - 1));
+        if (pwrite(job->fd, chunk.ptr, chunk.r_size, offset + k * cnf.enc_BYTES_per_chunk) != (ssize_t)chunk.r_size)
+        {
+            fprintf(stderr, "Could not write back chunk %lu of %s[%s]\n", first_chunk + k, what, name);
+            *failed += 1;
+            continue;
+        }
+        *corrected += 1;
+    }
+}
+
+// Checks the leaves a corrected run of chunks touches against the hash tree:
+// a chunk with more flipped bits than Hamming can tell decodes to the wrong
+// bytes and is only caught there. Returns the leaves that do not match.
+size_t __arch_repair_check_leaves(const arch_repair_job *job, const arch_file_header *hdr, size_t first_chunk, size_t n_chunks)
+{
+    const arch_instance *inst = job->inst;
+    const config cnf = inst->cnf;
+    const size_t end = (first_chunk + n_chunks) * cnf.BYTES_per_chunk < hdr->init_size ? (first_chunk + n_chunks) * cnf.BYTES_per_chunk : hdr->init_size;
+    member_reader *r = member_reader_open(job->fd, hdr->offset, hdr->init_size, hdr->name_len, cnf, false);
+    member_tree tree = member_tree_open(job->fd, hdr->offset, hdr->init_size, hdr->name_len, cnf, hdr->root);
+    uint8_t *leaf = malloc(MERKLE_LEAF_SIZE);
+    size_t bad = 0;
+    for (size_t i = first_chunk * cnf.BYTES_per_chunk / MERKLE_LEAF_SIZE; i * MERKLE_LEAF_SIZE < end; ++i)
+    {
+        const size_t bytes = merkle_leaf_bytes(hdr->init_size, i);
+        if (__member_reader_copy(r, i * MERKLE_LEAF_SIZE, leaf, bytes) != (ssize_t)bytes || !member_tree_check_leaf(&tree, i, leaf))
+        {
+            fprintf(stderr, "Bytes %lu..%lu of [%s] do not match %s after correction\n", i * MERKLE_LEAF_SIZE, i * MERKLE_LEAF_SIZE + bytes,
+                    arch_file_name(inst, hdr), tree.broken ? "their damaged hash tree" : "their hash");
+            bad += 1;
+        }
+    }
+    free(leaf);
+    member_reader_close(r);
+    return bad;
+}
+
+// Walks down to every leaf once, so every node of a corrected tree is
+// checked against its parent and the top one against the root
+size_t __arch_repair_check_tree(const arch_repair_job *job, const arch_file_header *hdr)
+{
+    member_tree tree = member_tree_open(job->fd, hdr->offset, hdr->init_size, hdr->name_len, job->inst->cnf, hdr->root);
+    uint8_t expect[BLAKE3_OUT_LEN];
+    for (size_t i = 0; i < tree.n_leaves; ++i)
+    {
+        if (!member_tree_expect(&tree, i, expect))
+        {
+            fprintf(stderr, "The hash tree of [%s] does not match its root after correction\n", arch_file_name(job->inst, hdr));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// what a thread holds: a run of chunks, with parity a whole group decoded and its record,
+// with hash trees a leaf and the batch it is decoded from
+size_t __arch_repair_thread_memory(config cnf)
+{
+    size_t m = REPAIR_CHUNKS_PER_TASK * cnf.enc_BYTES_per_chunk;
+    if (cnf.parity_count)
+    {
+        const size_t group = calc_parity_group_chunks(cnf), record = calc_parity_record_size(group, cnf);
+        m += group * (cnf.enc_BYTES_per_chunk + cnf.BYTES_per_chunk + 2 * sizeof(bool)) + calc_encoded_size(record, cnf) + record;
+    }
+    if (cnf.hash_tree)
+    {
+        m += MERKLE_LEAF_SIZE + MEMBER_READER_BATCH_SIZE + sizeof(member_tree);
+    }
+    return m;
+}
+
+void *__arch_repair_thread(void *arg)
+{
+    arch_repair_job *job = arg;
+    const arch_instance *inst = job->inst;
+    const config cnf = inst->cnf;
+    uint8_t *buf = malloc(REPAIR_CHUNKS_PER_TASK * cnf.enc_BYTES_per_chunk);
+    byte_buf raw = {0};
+    size_t chunks = 0, corrected = 0, failed = 0;
+
+    size_t file_i, first_chunk, n_chunks;
+    while (__arch_repair_next_task(job, &file_i, &first_chunk, &n_chunks))
+    {
+        const arch_file_header *hdr = &inst->file_hdrs[file_i];
+        const size_t corrected_before = corrected;
+        if (cnf.parity_count)
+        {
+            __arch_repair_group(job, hdr, first_chunk, &raw, &chunks, &corrected, &failed);
+        }
+        else
+        {
+            __arch_repair_run(job, hdr->offset + calc_chunk_enc_offset(first_chunk, hdr->name_len, cnf), hdr->init_size, first_chunk, n_chunks, buf,
+                              "", arch_file_name(inst, hdr), &chunks, &corrected, &failed);
+        }
+
+        // the tree goes with the first task of its member, before any leaf is checked against it
+        const size_t tree_corrected_before = corrected;
+        const size_t tree_size = cnf.hash_tree ? merkle_tree_size(hdr->init_size) : 0;
+        for (size_t k = 0; first_chunk == 0 && k < calc_chunk_count(tree_size, cnf); k += REPAIR_CHUNKS_PER_TASK)
+        {
+            const size_t n = calc_chunk_count(tree_size, cnf) - k < REPAIR_CHUNKS_PER_TASK ? calc_chunk_count(tree_size, cnf) - k : REPAIR_CHUNKS_PER_TASK;
+            __arch_repair_run(job, hdr->offset + calc_member_tree_offset(hdr->init_size, hdr->name_len, cnf) + k * cnf.enc_BYTES_per_chunk, tree_size, k, n, buf,
+                              "the hash tree of ", arch_file_name(inst, hdr), &chunks, &corrected, &failed);
+        }
+        if (corrected > tree_corrected_before && merkle_root_known(hdr->root))
+        {
+            failed += __arch_repair_check_tree(job, hdr);
+        }
+        if (cnf.hash_tree && corrected > corrected_before && merkle_root_known(hdr->root))
+        {
+            failed += __arch_repair_check_leaves(job, hdr, first_chunk, n_chunks);
+        }
+    }
+    free(buf);
+    byte_buf_close(&raw);
+
+    pthread_mutex_lock(&job->lock);
+    job->chunks += chunks;
+    job->corrected += corrected;
+    job->failed += failed;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+// Scans every chunk in parallel and writes back only the ones it corrected.
+// A damaged header or member table is rewritten with a regular commit.
+// A corrected chunk differs from the stored one in a single bit, so a torn
+// write back leaves at worst the same single-bit error behind. A chunk
+// rebuilt from parity is written whole; torn, it is rebuilt again next time.
+bool arch_repair(arch_instance *inst)
+{
+    if (!arch_instance_load_files(inst))
+    {
+        return false;
+    }
+    fflush(inst->f);
+
+    arch_repair_job job = {.inst = inst, .fd = fileno(inst->f)};
+    pthread_mutex_init(&job.lock, NULL);
+
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = n_threads < 1 ? 1 : (n_threads > REPAIR_MAX_THREADS ? REPAIR_MAX_THREADS : n_threads);
+    n_threads = budget_workers(arch_io_budget(inst), __arch_repair_thread_memory(inst->cnf), n_threads);
+    pthread_t threads[REPAIR_MAX_THREADS];
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_create(&threads[i], NULL, __arch_repair_thread, &job);
+    }
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    if (job.corrected > 0 && fdatasync(job.fd))
+    {
+        fprintf(stderr, "arch %s could not be synced to disk\n", inst->name);
+    }
+    if (inst->no_cache)
+    {
+        drop_written_file(job.fd);
+    }
+
+    // both table copies and the header are written anew from what was decoded,
+    // the lookup block is built from the table
+    inst->meta_damaged |= !__arch_lookup_intact(inst);
+    if (inst->meta_damaged)
+    {
+        arch_instance_sync_header(inst);
+        fprintf(stdout, "arch %s: header and member table rewritten\n", inst->name);
+    }
+
+    fprintf(stdout, "arch %s: %lu chunks checked, %lu corrected, %lu uncorrectable\n", inst->name, job.chunks, job.corrected, job.failed);
+    return job.failed == 0;
+}
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef ARCH_SALVAGE_H
+#define ARCH_SALVAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "arch_instance.h"
+#include "sync_marker.h"
+
+#define SALVAGE_BLOCK_SIZE (4 * 1024 * 1024)
+#define SALVAGE_MIN_BLOCK_SIZE (64 * 1024)
+// a marker found near the end of a block is parsed from the overlap
+#define SALVAGE_OVERLAP (SYNC_MARKER_SIZE + PATH_MAX)
+
+typedef struct
+{
+    sync_marker m;
+    size_t offset;
+    char *name; // only for chunk 0
+} salvage_marker;
+
+typedef struct
+{
+    const salvage_marker *first; // the marker of chunk 0
+    bool intact;                 // every marker of the member is where it should be
+} salvage_member;
+
+typedef struct
+{
+    salvage_marker *arr;
+    size_t len;
+    size_t cap;
+    size_t memory;     // what the markers will take up to the commit, roughly
+    bool over_budget;  // the scan stopped at --max-memory
+} salvage_marker_vec;
+
+void salvage_marker_vec_push(salvage_marker_vec *v, salvage_marker m)
+{
+    if (v->len == v->cap)
+    {
+        v->cap = v->cap ? v->cap * 2 : 64;
+        v->arr = realloc(v->arr, v->cap * sizeof(salvage_marker));
+    }
+    v->arr[v->len++] = m;
+    v->memory += sizeof(salvage_marker) + sizeof(salvage_member);
+    if (m.name)
+    {
+        // the name and the record of the member in the new table
+        v->memory += 3 * (m.m.name_len + 1) + ARCH_MEMBER_MEMORY;
+    }
+}
+
+void salvage_marker_vec_close(salvage_marker_vec *v)
+{
+    for (size_t i = 0; i < v->len; ++i)
+    {
+        free(v->arr[i].name);
+    }
+    free(v->arr);
+    *v = (salvage_marker_vec){0};
+}
+
+int __salvage_marker_cmp(const void *lhs, const void *rhs)
+{
+    const salvage_marker *l = lhs, *r = rhs;
+    if (l->m.member_id != r->m.member_id)
+    {
+        return l->m.member_id < r->m.member_id ? -1 : 1;
+    }
+    if (l->m.chunk != r->m.chunk)
+    {
+        return l->m.chunk < r->m.chunk ? -1 : 1;
+    }
+    return l->offset < r->offset ? -1 : l->offset > r->offset;
+}
+
+// One linear pass over the file, memmem finds the magic of every marker.
+// Blocks are read block_size at a time; the scan gives up once the markers
+// found would take the budget, when there is one.
+salvage_marker_vec __arch_salvage_scan(int fd, size_t file_size, size_t block_size, size_t budget)
+{
+    salvage_marker_vec found = {0};
+    uint8_t magic[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        magic[i] = (uint8_t)(SYNC_MARKER_MAGIC >> (8 * i));
+    }
+
+    uint8_t *buf = malloc(block_size + SALVAGE_OVERLAP);
+    for (size_t pos = ARCH_DATA_OFFSET; pos < file_size && !found.over_budget; pos += block_size)
+    {
+        size_t want = file_size - pos < block_size + SALVAGE_OVERLAP ? file_size - pos : block_size + SALVAGE_OVERLAP;
+        ssize_t got = pread(fd, buf, want, pos);
+        if (got <= 0)
+        {
+            fprintf(stderr, "(salvage) could not read at offset %lu\n", pos);
+            break;
+        }
+        const uint8_t *end = buf + got;
+        // markers starting in the overlap belong to the next block
+        const uint8_t *search_end = (size_t)got > block_size ? buf + block_size + sizeof(magic) - 1 : end;
+
+        const uint8_t *p = buf;
+        while ((p = memmem(p, search_end - p, magic, sizeof(magic))) != NULL)
+        {
+            salvage_marker sm = {.offset = pos + (p - buf)};
+            const char *name;
+            if (sync_marker_read(p, end, &sm.m, &name))
+            {
+                if (sm.m.chunk == 0)
+                {
+                    sm.name = strndup(name, sm.m.name_len);
+                }
+                salvage_marker_vec_push(&found, sm);
+            }
+            p += 1;
+        }
+        found.over_budget = budget && found.memory + block_size + SALVAGE_OVERLAP > budget;
+    }
+    free(buf);
+    return found;
+}
+
+int __salvage_member_cmp(const void *lhs, const void *rhs)
+{
+    const salvage_member *l = lhs, *r = rhs;
+    int c = strcmp(l->first->name, r->first->name);
+    if (c != 0)
+    {
+        return c;
+    }
+    // newest first
+    return l->first->m.member_id > r->first->m.member_id ? -1 : l->first->m.member_id < r->first->m.member_id;
+}
+
+int __salvage_member_offset_cmp(const void *lhs, const void *rhs)
+{
+    const salvage_member *l = lhs, *r = rhs;
+    return l->first->offset < r->first->offset ? -1 : l->first->offset > r->first->offset;
+}
+
+// Rebuilds the member table of an archive created with --sync from its
+// resync markers alone. The file is only appended to: the new table and
+// header go past its end, so a member missed by the scan is not overwritten.
+// Content hashes are not in the markers and are left empty, --update -k
+// re-encodes such members once. The parity layout is taken from whichever
+// header slot can still be read. Under max_memory (0 for no limit) the scan
+// reads smaller blocks, and gives up when the markers found would not fit.
+bool arch_salvage(const char *path, size_t max_memory)
+{
+    FILE *f = fopen(path, "r+");
+    struct stat st;
+    if (!f || fstat(fileno(f), &st))
+    {
+        fprintf(stderr, "arch (salvage) at path %s could not be opened\n", path);
+        if (f)
+        {
+            fclose(f);
+        }
+        return false;
+    }
+
+    salvage_marker_vec markers = __arch_salvage_scan(fileno(f), st.st_size, budget_buffer(max_memory / 4, SALVAGE_BLOCK_SIZE, SALVAGE_MIN_BLOCK_SIZE), max_memory);
+    if (markers.over_budget)
+    {
+        fprintf(stderr, "arch (salvage) %s: the markers found take more than --max-memory %lu allows\n", path, max_memory);
+        salvage_marker_vec_close(&markers);
+        fclose(f);
+        return false;
+    }
+    qsort(markers.arr, markers.len, sizeof(salvage_marker), __salvage_marker_cmp);
+
+    // the markers do not tell the parity and hash tree layout, any header slot that still reads does
+    arch_header layout = {0};
+    const int64_t slot_offsets[] = {0, ARCH_SLOT_SIZE, st.st_size - ARCH_SLOT_SIZE};
+    bool layout_found = false;
+    for (size_t i = 0; i < COUNT_OF(slot_offsets) && !layout_found; ++i)
+    {
+        bool corrected;
+        layout_found = arch_header_read_slot(fileno(f), slot_offsets[i], &layout, &corrected);
+    }
+    if (!layout_found)
+    {
+        layout = (arch_header){0};
+    }
+
+    salvage_member *members = calloc(markers.len + 1, sizeof(salvage_member));
+    size_t n_members = 0;
+    config cnf = {0};
+    uint64_t max_seq = 0;
+    for (size_t i = 0; i < markers.len;)
+    {
+        size_t j = i;
+        while (j < markers.len && markers.arr[j].m.member_id == markers.arr[i].m.member_id)
+        {
+            ++j;
+        }
+        const salvage_marker *first = &markers.arr[i];
+        if (first->m.chunk != 0)
+        {
+            fprintf(stderr, "(salvage) member %lx lost its first marker, skipped\n", first->m.member_id);
+            i = j;
+            continue;
+        }
+        if (cnf.BYTES_per_chunk == 0)
+        {
+            cnf = config_new(first->m.bytes_per_chunk);
+            cnf.sync_group = first->m.group;
+            cnf.parity_data = layout.parity_data;
+            cnf.parity_count = layout.parity_count;
+            cnf.parity_checks_copy = layout.parity_checks_copy;
+            cnf.hash_tree = layout.hash_tree;
+            cnf.member_attrs = true;
+        }
+        if (first->m.bytes_per_chunk != cnf.BYTES_per_chunk || first->m.group != cnf.sync_group)
+        {
+            fprintf(stderr, "(salvage) member [%s] uses another chunk layout, skipped\n", first->name);
+            i = j;
+            continue;
+        }
+
+        const size_t n_markers = calc_sync_marker_count(first->m.init_size, cnf);
+        size_t n_intact = 0;
+        for (size_t k = i; k < j; ++k)
+        {
+            const salvage_marker *sm = &markers.arr[k];
+            size_t expected = first->offset + calc_chunk_enc_offset(sm->m.chunk, first->m.name_len, cnf) - SYNC_MARKER_SIZE - (sm->m.chunk == 0 ? first->m.name_len : 0);
+            n_intact += sm->m.chunk % cnf.sync_group == 0 && sm->offset == expected && sm->m.init_size == first->m.init_size;
+        }
+        members[n_members++] = (salvage_member){.first = first, .intact = n_intact == n_markers};
+        if (first->m.member_id >> 32 > max_seq)
+        {
+            max_seq = first->m.member_id >> 32;
+        }
+        i = j;
+    }
+
+    // a name may have older copies left in free space, the newest intact one wins
+    qsort(members, n_members, sizeof(salvage_member), __salvage_member_cmp);
+    size_t n_kept = 0;
+    for (size_t i = 0; i < n_members;)
+    {
+        size_t j = i, pick = i;
+        while (j < n_members && strcmp(members[j].first->name, members[i].first->name) == 0)
+        {
+            if (!members[pick].intact && members[j].intact)
+            {
+                pick = j;
+            }
+            ++j;
+        }
+        if (!members[pick].intact)
+        {
+            fprintf(stderr, "(salvage) [%s] has damaged markers, its data may be damaged too\n", members[pick].first->name);
+        }
+        members[n_kept++] = members[pick];
+        i = j;
+    }
+    qsort(members, n_kept, sizeof(salvage_member), __salvage_member_offset_cmp);
+
+    if (cnf.BYTES_per_chunk == 0)
+    {
+        fprintf(stderr, "arch (salvage) %s: no resync markers found\n", path);
+        salvage_marker_vec_close(&markers);
+        free(members);
+        fclose(f);
+        return false;
+    }
+
+    // the commit has to win over any header slot still readable
+    arch_header slot;
+    bool corrected;
+    for (int i = 0; i < 2; ++i)
+    {
+        if (arch_header_read_slot(fileno(f), i * ARCH_SLOT_SIZE, &slot, &corrected) && slot.seq > max_seq)
+        {
+            max_seq = slot.seq;
+        }
+    }
+
+    arch_instance inst = {
+        .f = f,
+        .name = get_clean_filename(path),
+        .hdr = {.seq = max_seq, .bytes_per_read = cnf.BYTES_per_chunk, .sync_group = cnf.sync_group, .parity_data = cnf.parity_data, .parity_count = cnf.parity_count, .parity_checks_copy = cnf.parity_checks_copy, .dir_offset = ARCH_DATA_OFFSET, .dir_copy_offset = ARCH_DATA_OFFSET, .hash_tree = cnf.hash_tree, .member_attrs = cnf.member_attrs},
+        .cnf = cnf,
+        .files_loaded = true,
+    };
+    for (size_t i = 0; i < n_kept; ++i)
+    {
+        const salvage_marker *first = members[i].first;
+        arch_file_header hdr = {
+            .init_size = first->m.init_size,
+            .enc_size = calc_member_enc_size(first->m.init_size, first->m.name_len, cnf),
+            .offset = first->offset,
+            .mtime = first->m.mtime,
+            .hash = 0, // as the root and the mode, not known without the table
+        };
+        __arch_push_file_header(&inst, hdr, first->name);
+    }
+
+    __arch_begin_write(&inst);
+    free_space_close(&inst.space);
+    inst.space = (free_space){.tail = st.st_size};
+    arch_instance_sync_header(&inst);
+
+    fprintf(stdout, "arch %s: %lu markers found, %lu members salvaged\n", inst.name, markers.len, n_kept);
+    salvage_marker_vec_close(&markers);
+    free(members);
+    arch_instance_close(&inst);
+    return true;
+}
+
+#endif
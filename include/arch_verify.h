@@ -0,0 +1,196 @@
+#ifndef ARCH_VERIFY_H
+#define ARCH_VERIFY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "arch_instance.h"
+#include "member_reader.h"
+
+#define VERIFY_LEAVES_PER_TASK 16
+#define VERIFY_MAX_THREADS 64
+
+// Leaves are handed out to the threads in runs of at most
+// VERIFY_LEAVES_PER_TASK, so one huge member is spread over all of them.
+// Nothing is written: a member is decoded as extraction would decode it
+// and every leaf is checked against the stored tree.
+typedef struct
+{
+    const arch_instance *inst;
+    int fd;
+    const bool *selected; // members to verify, those of unknown root are skipped
+
+    pthread_mutex_t lock;
+    size_t next_file;
+    size_t next_leaf;
+
+    size_t *mismatched; // per member, leaves that did not match
+} arch_verify_job;
+
+bool __arch_verify_next_task(arch_verify_job *job, size_t *file_i, size_t *first_leaf, size_t *n_leaves)
+{
+    const arch_instance *inst = job->inst;
+    bool found = false;
+
+    pthread_mutex_lock(&job->lock);
+    for (; job->next_file < inst->hdr.file_count; ++job->next_file, job->next_leaf = 0)
+    {
+        const arch_file_header *hdr = &inst->file_hdrs[job->next_file];
+        const size_t total = merkle_leaf_count(hdr->init_size);
+        if (job->selected[job->next_file] && merkle_root_known(hdr->root) && job->next_leaf < total)
+        {
+            *file_i = job->next_file;
+            *first_leaf = job->next_leaf;
+            *n_leaves = total - job->next_leaf < VERIFY_LEAVES_PER_TASK ? total - job->next_leaf : VERIFY_LEAVES_PER_TASK;
+            job->next_leaf += *n_leaves;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    return found;
+}
+
+void *__arch_verify_thread(void *arg)
+{
+    arch_verify_job *job = arg;
+    const arch_instance *inst = job->inst;
+    uint8_t *leaf = malloc(MERKLE_LEAF_SIZE);
+    // consecutive tasks are mostly of one member, its reader and path stay
+    member_reader *r = NULL;
+    member_tree tree;
+    size_t cur_file = SIZE_MAX;
+
+    size_t file_i, first_leaf, n_leaves;
+    while (__arch_verify_next_task(job, &file_i, &first_leaf, &n_leaves))
+    {
+        const arch_file_header *hdr = &inst->file_hdrs[file_i];
+        if (file_i != cur_file)
+        {
+            member_reader_close(r);
+            r = member_reader_open(job->fd, hdr->offset, hdr->init_size, hdr->name_len, inst->cnf, false);
+            r->no_cache = inst->no_cache;
+            tree = member_tree_open(job->fd, hdr->offset, hdr->init_size, hdr->name_len, inst->cnf, hdr->root);
+            cur_file = file_i;
+        }
+
+        size_t bad = 0;
+        for (size_t i = first_leaf; i < first_leaf + n_leaves; ++i)
+        {
+            const size_t bytes = merkle_leaf_bytes(hdr->init_size, i);
+            bad += __member_reader_copy(r, i * MERKLE_LEAF_SIZE, leaf, bytes) != (ssize_t)bytes || !member_tree_check_leaf(&tree, i, leaf);
+        }
+        if (bad)
+        {
+            pthread_mutex_lock(&job->lock);
+            job->mismatched[file_i] += bad;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    member_reader_close(r);
+    free(leaf);
+    return NULL;
+}
+
+void __arch_verify_print_root(FILE *out, const uint8_t root[BLAKE3_OUT_LEN], const char *name)
+{
+    for (size_t i = 0; i < BLAKE3_OUT_LEN; ++i)
+    {
+        fprintf(out, "%02x", root[i]);
+    }
+    fprintf(out, "  %s\n", name);
+}
+
+// Checks the named members (every one when there are no names) against their
+// hash trees in parallel. A member that matches is printed to out (unless it
+// is NULL) as b3sum prints it, so the listing can be checked against the
+// files with b3sum -c.
+bool arch_verify(arch_instance *inst, string_array filenames, FILE *out)
+{
+    if (!arch_instance_load_files(inst))
+    {
+        return false;
+    }
+    if (!inst->cnf.hash_tree)
+    {
+        fprintf(stderr, "arch %s was not created with --tree, there is nothing to verify against\n", inst->name);
+        return false;
+    }
+    fflush(inst->f);
+
+    const size_t file_count = inst->hdr.file_count;
+    const arena_mark mark = arena_save(&inst->scratch);
+    bool *selected = arena_calloc(&inst->scratch, file_count + 1, sizeof(bool));
+    size_t *mismatched = arena_calloc(&inst->scratch, file_count + 1, sizeof(size_t));
+    bool ok = true;
+    for (size_t i = 0; i < filenames.len; ++i)
+    {
+        const arch_file_header *hdr = arch_find_file(inst, filenames.arr[i]);
+        if (!hdr)
+        {
+            fprintf(stderr, "Could not locate file [%s] to verify\n", filenames.arr[i]);
+            ok = false;
+            continue;
+        }
+        selected[hdr - inst->file_hdrs] = true;
+    }
+    for (size_t i = 0; filenames.len == 0 && i < file_count; ++i)
+    {
+        selected[i] = true;
+    }
+
+    arch_verify_job job = {.inst = inst, .fd = fileno(inst->f), .selected = selected, .mismatched = mismatched};
+    pthread_mutex_init(&job.lock, NULL);
+
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = n_threads < 1 ? 1 : (n_threads > VERIFY_MAX_THREADS ? VERIFY_MAX_THREADS : n_threads);
+    n_threads = budget_workers(arch_io_budget(inst), MERKLE_LEAF_SIZE + MEMBER_READER_BATCH_SIZE + sizeof(member_tree), n_threads);
+    pthread_t threads[VERIFY_MAX_THREADS];
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_create(&threads[i], NULL, __arch_verify_thread, &job);
+    }
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    size_t verified = 0, failed = 0;
+    for (size_t i = 0; i < file_count; ++i)
+    {
+        const arch_file_header *hdr = &inst->file_hdrs[i];
+        if (!selected[i])
+        {
+            continue;
+        }
+        if (!merkle_root_known(hdr->root))
+        {
+            fprintf(stderr, "[%s]: its hash is unknown (salvaged member), not verified\n", arch_file_name(inst, hdr));
+            continue;
+        }
+        if (mismatched[i])
+        {
+            fprintf(stderr, "[%s]: %lu of %lu leaves do not match their hash\n", arch_file_name(inst, hdr), mismatched[i], merkle_leaf_count(hdr->init_size));
+            failed += 1;
+            continue;
+        }
+        if (out)
+        {
+            __arch_verify_print_root(out, hdr->root, arch_file_name(inst, hdr));
+        }
+        verified += 1;
+    }
+    arena_restore(&inst->scratch, mark);
+
+    if (failed)
+    {
+        fprintf(stderr, "arch %s: %lu members verified, %lu damaged; run --repair, then --verify again\n", inst->name, verified, failed);
+    }
+    return ok && failed == 0;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+// Bump allocator for the temporaries of one operation: an allocation moves a
+// pointer along the current block, nothing is freed on its own. arena_save
+// and arena_restore bracket an operation and drop whatever it allocated, one
+// released block is kept for the next operation so a long-lived owner stops
+// calling malloc once it is warm. Not thread safe.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN (_Alignof(max_align_t))
+
+typedef struct arena_block
+{
+    struct arena_block *prev;
+    size_t cap;
+    size_t used;
+} arena_block;
+
+#define ARENA_HEADER ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+typedef struct
+{
+    arena_block *head; // allocations come from it, older blocks hang off prev
+    arena_block *spare;
+} arena;
+
+typedef struct
+{
+    arena_block *block;
+    size_t used;
+} arena_mark;
+
+uint8_t *__arena_data(arena_block *b)
+{
+    return (uint8_t *)b + ARENA_HEADER;
+}
+
+void __arena_grow(arena *a, size_t n)
+{
+    arena_block *b;
+    if (a->spare && a->spare->cap >= n)
+    {
+        b = a->spare;
+        a->spare = NULL;
+    }
+    else
+    {
+        const size_t cap = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+        b = malloc(ARENA_HEADER + cap);
+        assert(b);
+        b->cap = cap;
+    }
+    b->used = 0;
+    b->prev = a->head;
+    a->head = b;
+}
+
+void __arena_release(arena *a, arena_block *b)
+{
+    if (!a->spare && b->cap == ARENA_BLOCK_SIZE)
+    {
+        a->spare = b;
+        return;
+    }
+    free(b);
+}
+
+void *arena_alloc(arena *a, size_t n)
+{
+    n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (!a->head || a->head->cap - a->head->used < n)
+    {
+        __arena_grow(a, n);
+    }
+    void *ptr = __arena_data(a->head) + a->head->used;
+    a->head->used += n;
+    return ptr;
+}
+
+void *arena_calloc(arena *a, size_t count, size_t size)
+{
+    assert(size == 0 || count <= SIZE_MAX / size);
+    void *ptr = arena_alloc(a, count * size);
+    memset(ptr, 0, count * size);
+    return ptr;
+}
+
+char *arena_strdup(arena *a, const char *str)
+{
+    const size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(a, len), str, len);
+}
+
+// Grows ptr (old_size bytes, from a) to size: in place when it is the last
+// allocation and the block has room, otherwise by a copy
+void *arena_realloc(arena *a, void *ptr, size_t old_size, size_t size)
+{
+    if (ptr && a->head)
+    {
+        const size_t old_n = (old_size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+        const size_t n = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+        uint8_t *end = __arena_data(a->head) + a->head->used;
+        if ((uint8_t *)ptr + old_n == end && a->head->used - old_n + n <= a->head->cap)
+        {
+            a->head->used = a->head->used - old_n + n;
+            return ptr;
+        }
+    }
+    void *dst = arena_alloc(a, size);
+    if (ptr)
+    {
+        memcpy(dst, ptr, old_size < size ? old_size : size);
+    }
+    return dst;
+}
+
+arena_mark arena_save(const arena *a)
+{
+    return (arena_mark){.block = a->head, .used = a->head ? a->head->used : 0};
+}
+
+// Drops everything allocated since mark was saved
+void arena_restore(arena *a, arena_mark mark)
+{
+    while (a->head != mark.block)
+    {
+        arena_block *b = a->head;
+        a->head = b->prev;
+        __arena_release(a, b);
+    }
+    if (a->head)
+    {
+        a->head->used = mark.used;
+    }
+}
+
+void arena_free(arena *a)
+{
+    arena_restore(a, (arena_mark){0});
+    free(a->spare);
+    *a = (arena){0};
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef DIRECT_IO_H
+#define DIRECT_IO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Reads bypass the page cache with O_DIRECT. Where the filesystem refuses
+// it, reads go through the cache and drop what they read behind them.
+#define DIRECT_IO_ALIGN 4096
+#define DIRECT_IO_BUF_SIZE (1024 * 1024)
+
+typedef struct
+{
+    int fd;
+    bool direct;
+    uint8_t *buf; // DIRECT_IO_ALIGN-aligned, holds the file from buf_pos on
+    off_t buf_pos;
+    size_t buf_len;
+    off_t pos;
+} direct_reader;
+
+bool __direct_reader_fill(direct_reader *r)
+{
+    const off_t start = r->pos / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+    ssize_t n = pread(r->fd, r->buf, DIRECT_IO_BUF_SIZE, start);
+    if (n < 0 && errno == EINVAL && r->direct)
+    {
+        fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+        r->direct = false;
+        n = pread(r->fd, r->buf, DIRECT_IO_BUF_SIZE, start);
+    }
+    if (n < 0)
+    {
+        return false;
+    }
+    if (!r->direct)
+    {
+        posix_fadvise(r->fd, start, n, POSIX_FADV_DONTNEED);
+    }
+    r->buf_pos = start;
+    r->buf_len = n;
+    return true;
+}
+
+ssize_t __direct_reader_read(void *cookie, char *out, size_t size)
+{
+    direct_reader *r = cookie;
+    size_t done = 0;
+    while (done < size)
+    {
+        if (r->pos < r->buf_pos || r->pos >= r->buf_pos + (off_t)r->buf_len)
+        {
+            if (!__direct_reader_fill(r))
+            {
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            if (r->pos >= r->buf_pos + (off_t)r->buf_len)
+            {
+                break;
+            }
+        }
+        size_t at = r->pos - r->buf_pos;
+        size_t n = r->buf_len - at < size - done ? r->buf_len - at : size - done;
+        memcpy(out + done, r->buf + at, n);
+        done += n;
+        r->pos += n;
+    }
+    return done;
+}
+
+int __direct_reader_seek(void *cookie, off64_t *offset, int whence)
+{
+    direct_reader *r = cookie;
+    struct stat st;
+    off_t base = whence == SEEK_SET ? 0 : (whence == SEEK_CUR ? r->pos : (fstat(r->fd, &st) ? -1 : st.st_size));
+    if (base < 0 || base + *offset < 0)
+    {
+        return -1;
+    }
+    r->pos = base + *offset;
+    *offset = r->pos;
+    return 0;
+}
+
+int __direct_reader_close(void *cookie)
+{
+    direct_reader *r = cookie;
+    posix_fadvise(r->fd, 0, 0, POSIX_FADV_DONTNEED);
+    int ret = close(r->fd);
+    free(r->buf);
+    free(r);
+    return ret;
+}
+
+// A read-only stream over path that leaves the page cache alone
+FILE *fopen_direct(const char *path)
+{
+    direct_reader *r = calloc(1, sizeof(direct_reader));
+    r->direct = true;
+    r->fd = open(path, O_RDONLY | O_DIRECT);
+    if (r->fd < 0)
+    {
+        r->direct = false;
+        r->fd = open(path, O_RDONLY);
+    }
+    if (r->fd < 0 || posix_memalign((void **)&r->buf, DIRECT_IO_ALIGN, DIRECT_IO_BUF_SIZE))
+    {
+        if (r->fd >= 0)
+        {
+            close(r->fd);
+        }
+        free(r);
+        return NULL;
+    }
+    return fopencookie(r, "r", (cookie_io_functions_t){
+                                   .read = __direct_reader_read,
+                                   .seek = __direct_reader_seek,
+                                   .close = __direct_reader_close,
+                               });
+}
+
+// opens the file behind fd once more, O_DIRECT is a flag of the open file
+FILE *fdopen_direct(int fd)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return fopen_direct(path);
+}
+
+// Starts writeback of a written range and drops whatever of it is clean by now
+void drop_written_range(int fd, off_t offset, off_t len)
+{
+    sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+// Waits for the whole file to be written back and drops it from the cache
+void drop_written_file(int fd)
+{
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+#endif
@@ -3,8 +3,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "hamming.h"
+#include "hamming_codec.h"
+#include "gf256.h"
+#include "helper.h"
+#include "sync_marker.h"
+#include "merkle.h"
 
 typedef struct
 {
@@ -12,11 +20,16 @@ typedef struct
     size_t BITS_per_chunk;
     size_t enc_BYTES_per_chunk;
     size_t enc_BITS_per_chunk;
-
-    size_t FREE_FILE_COUNT;
+    size_t sync_group; // chunks of a member between resync markers, 0 for none
+    size_t parity_data;  // chunks of a stripe
+    size_t parity_count; // parity blocks of a stripe, 0 for none
+    bool parity_checks_copy; // parity records end with a second copy of the chunk checks
+    bool hash_tree;      // members end with their hash tree
+    bool member_attrs;   // member records carry mode, uid and gid
+    const hamming_codec *codec; // for whole chunks, NULL if the size has none
 } config;
 
-config config_new(size_t bytes_per_read, size_t FREE_FILE_COUNT)
+config config_new(size_t bytes_per_read)
 {
     size_t enc_bits_per_chunk = hamming_calc_encoded_size(bytes_per_read * BITS_IN_BYTE);
     size_t enc_bytes_per_chunk = (size_t)ceil((double)enc_bits_per_chunk / 8.);
@@ -25,133 +38,936 @@ config config_new(size_t bytes_per_read, size_t FREE_FILE_COUNT)
         .BITS_per_chunk = bytes_per_read * BITS_IN_BYTE,
         .enc_BYTES_per_chunk = enc_bytes_per_chunk,
         .enc_BITS_per_chunk = enc_bits_per_chunk,
-        .FREE_FILE_COUNT = FREE_FILE_COUNT,
+        .codec = hamming_codec_find(bytes_per_read),
     };
 }
 
-size_t do_file_encoding(FILE *input_file, size_t input_file_len, FILE *output_file, config cnf)
+// Encodes the n <= BYTES_per_chunk bytes of a chunk to dst, which has room for
+// enc_BYTES_per_chunk bytes. Returns the encoded size.
+size_t encode_chunk_to(const uint8_t *src, size_t n, uint8_t *dst, config cnf)
+{
+    if (cnf.codec && n == cnf.BYTES_per_chunk)
+    {
+        cnf.codec->encode(src, dst);
+        return cnf.enc_BYTES_per_chunk;
+    }
+    bit_vec encoded = hamming_algo((bit_vec){.ptr = (char *)src, .r_size = n, .bit_count = n * BITS_IN_BYTE});
+    const size_t len = encoded.r_size;
+    memcpy(dst, encoded.ptr, len);
+    bit_vec_delete(&encoded);
+    return len;
+}
+
+// 0 for a clean code word of bit_count bits at enc, see hamming_syndrome
+size_t chunk_syndrome(const uint8_t *enc, size_t bit_count, config cnf)
+{
+    if (cnf.codec && bit_count == cnf.codec->enc_bits)
+    {
+        return cnf.codec->syndrome(enc);
+    }
+    return hamming_syndrome((bit_vec){.ptr = (char *)enc, .r_size = (bit_count + BITS_IN_BYTE - 1) / BITS_IN_BYTE, .bit_count = bit_count});
+}
+
+// what the resync markers of a member say about it
+typedef struct
+{
+    uint64_t member_id;
+    int64_t mtime;
+    const char *name;
+} member_tag;
+
+// the resync marker in front of chunk, if the chunk has one
+bool __push_sync_marker(byte_buf *buf, config cnf, const member_tag *tag, size_t init_size, size_t chunk)
 {
+    if (cnf.sync_group == 0 || chunk % cnf.sync_group != 0)
+    {
+        return false;
+    }
+    sync_marker m = {
+        .member_id = tag->member_id,
+        .chunk = chunk,
+        .init_size = init_size,
+        .mtime = tag->mtime,
+        .bytes_per_chunk = cnf.BYTES_per_chunk,
+        .group = cnf.sync_group,
+        .name_len = strlen(tag->name),
+    };
+    sync_marker_push(buf, &m, tag->name);
+    return true;
+}
+
+size_t __write_sync_marker(FILE *output_file, config cnf, const member_tag *tag, size_t init_size, size_t chunk)
+{
+    byte_buf buf = {0};
+    if (!__push_sync_marker(&buf, cnf, tag, init_size, chunk))
+    {
+        return 0;
+    }
+    if (buf.len != fwrite(buf.ptr, 1, buf.len, output_file))
+    {
+        assert(false && "Expected to write a sync marker");
+    }
+    size_t written = buf.len;
+    byte_buf_close(&buf);
+    return written;
+}
+
+typedef struct
+{
+    FILE *file;
+    size_t src_file_len;
+    size_t enc_file_len;
+    size_t name_len; // carried by the first resync marker
+    merkle_builder *tree; // is fed the decoded bytes when not NULL
+} encoded_file;
+
+typedef struct
+{
+    size_t chunks;
+    size_t corrected;
+    size_t failed;
+} decode_stats;
+
+size_t calc_chunk_count(size_t init_size, config cnf)
+{
+    return (init_size + cnf.BYTES_per_chunk - 1) / cnf.BYTES_per_chunk;
+}
+
+// encoded size in bits of the j-th chunk of a member with init_size source bytes
+size_t calc_chunk_enc_bits(size_t init_size, size_t j, config cnf)
+{
+    size_t left = init_size - j * cnf.BYTES_per_chunk;
+    return left >= cnf.BYTES_per_chunk ? cnf.enc_BITS_per_chunk : hamming_calc_encoded_size(left * BITS_IN_BYTE);
+}
+
+size_t calc_encoded_size(size_t init_size, config cnf);
+
+// source bytes of the j-th chunk
+size_t calc_chunk_bytes(size_t init_size, size_t j, config cnf)
+{
+    const size_t left = init_size - j * cnf.BYTES_per_chunk;
+    return left < cnf.BYTES_per_chunk ? left : cnf.BYTES_per_chunk;
+}
+
+size_t calc_sync_marker_count(size_t init_size, config cnf)
+{
+    return cnf.sync_group ? (calc_chunk_count(init_size, cnf) + cnf.sync_group - 1) / cnf.sync_group : 0;
+}
+
+// Parity, when the archive is created with it: the chunks of a member are
+// split into groups of parity_data * depth chunks, depth being
+// PARITY_INTERLEAVE_BYTES worth of chunks. Chunk t of a group belongs to
+// stripe t % stripes, so neighbouring chunks land in different stripes and a
+// run of up to parity_count * depth lost chunks costs no stripe more than
+// parity_count of them. A group is followed by its record, Hamming-encoded
+// like the chunks:
+//   le32 check of the decoded bytes of every chunk of the group, le32 check of those
+//   for every stripe, parity_count Reed-Solomon blocks of BYTES_per_chunk bytes, le32 check of those
+//   with parity_checks_copy, the chunk checks and their check once more
+// The checks tell a chunk that decodes but is wrong, as a zeroed sector does.
+// Each part of the record is checked on its own, so losing the parity blocks
+// still leaves the chunk checks to detect damage with. The first copy of the
+// checks borders the data it covers, one burst can take out both; the second
+// lies past the parity blocks, out of reach of any burst parity can rebuild.
+// With no copy of the checks left a chunk counts as good only when its whole
+// stripe agrees with the parity blocks.
+// A short last group has ceil(chunks / parity_data) stripes.
+#define PARITY_INTERLEAVE_BYTES (32 * 1024)
+#define PARITY_CHECK_SIZE 4
+#define PARITY_MAX_COUNT 16
+#define PARITY_DEFAULT_DATA 16
+#define PARITY_DEFAULT_COUNT 2
+
+size_t calc_parity_group_chunks(config cnf)
+{
+    const size_t depth = (PARITY_INTERLEAVE_BYTES + cnf.BYTES_per_chunk - 1) / cnf.BYTES_per_chunk;
+    return cnf.parity_count ? depth * cnf.parity_data : 0;
+}
+
+size_t calc_parity_group_count(size_t init_size, config cnf)
+{
+    const size_t group = calc_parity_group_chunks(cnf);
+    return group ? (calc_chunk_count(init_size, cnf) + group - 1) / group : 0;
+}
+
+// chunks of group g
+size_t calc_parity_group_size(size_t init_size, size_t g, config cnf)
+{
+    const size_t group = calc_parity_group_chunks(cnf);
+    const size_t left = calc_chunk_count(init_size, cnf) - g * group;
+    return left < group ? left : group;
+}
+
+size_t calc_parity_stripes(size_t group_size, config cnf)
+{
+    const size_t stripes = (group_size + cnf.parity_data - 1) / cnf.parity_data;
+    const size_t depth = calc_parity_group_chunks(cnf) / cnf.parity_data;
+    return stripes < depth ? stripes : depth;
+}
+
+// where the parts of the record of a group of group_size chunks start, the
+// check of a part being its last PARITY_CHECK_SIZE bytes
+size_t calc_parity_blocks_at(size_t group_size)
+{
+    return (group_size + 1) * PARITY_CHECK_SIZE;
+}
+
+size_t calc_parity_checks_copy_at(size_t group_size, config cnf)
+{
+    return calc_parity_blocks_at(group_size) + calc_parity_stripes(group_size, cnf) * cnf.parity_count * cnf.BYTES_per_chunk + PARITY_CHECK_SIZE;
+}
+
+// decoded size of the record of a group of group_size chunks
+size_t calc_parity_record_size(size_t group_size, config cnf)
+{
+    return calc_parity_checks_copy_at(group_size, cnf) + (cnf.parity_checks_copy ? calc_parity_blocks_at(group_size) : 0);
+}
+
+size_t calc_parity_enc_size(size_t init_size, config cnf)
+{
+    const size_t n_groups = calc_parity_group_count(init_size, cnf);
+    if (n_groups == 0)
+    {
+        return 0;
+    }
+    const size_t full = calc_encoded_size(calc_parity_record_size(calc_parity_group_chunks(cnf), cnf), cnf);
+    return (n_groups - 1) * full + calc_encoded_size(calc_parity_record_size(calc_parity_group_size(init_size, n_groups - 1, cnf), cnf), cnf);
+}
+
+// where the hash tree of a member starts: its data takes that much, resync markers and parity records included
+size_t calc_member_tree_offset(size_t init_size, size_t name_len, config cnf)
+{
+    const size_t markers = calc_sync_marker_count(init_size, cnf);
+    return calc_encoded_size(init_size, cnf) + markers * SYNC_MARKER_SIZE + (markers ? name_len : 0) + calc_parity_enc_size(init_size, cnf);
+}
+
+// encoded size of a member, its hash tree included
+size_t calc_member_enc_size(size_t init_size, size_t name_len, config cnf)
+{
+    return calc_member_tree_offset(init_size, name_len, cnf) + (cnf.hash_tree ? calc_encoded_size(merkle_tree_size(init_size), cnf) : 0);
+}
+
+// where the j-th chunk starts in the encoded member
+size_t calc_chunk_enc_offset(size_t j, size_t name_len, config cnf)
+{
+    size_t offset = j * cnf.enc_BYTES_per_chunk;
+    if (cnf.sync_group)
+    {
+        offset += (j / cnf.sync_group + 1) * SYNC_MARKER_SIZE + name_len;
+    }
+    if (cnf.parity_count)
+    {
+        const size_t group = calc_parity_group_chunks(cnf);
+        offset += (j / group) * calc_encoded_size(calc_parity_record_size(group, cnf), cnf);
+    }
+    return offset;
+}
+
+// The encoded bytes of parity group g: from its first chunk to the end of its record
+void calc_parity_span(size_t init_size, size_t g, size_t name_len, config cnf, size_t *start, size_t *record, size_t *end)
+{
+    const size_t first = g * calc_parity_group_chunks(cnf);
+    const size_t size = calc_parity_group_size(init_size, g, cnf);
+    const size_t last = first + size - 1;
+    *start = calc_chunk_enc_offset(first, name_len, cnf);
+    *record = calc_chunk_enc_offset(last, name_len, cnf) + (calc_chunk_enc_bits(init_size, last, cnf) + BITS_IN_BYTE - 1) / BITS_IN_BYTE;
+    *end = *record + calc_encoded_size(calc_parity_record_size(size, cnf), cnf);
+}
+
+// what the record keeps of a chunk to tell whether it decoded right
+uint32_t parity_chunk_check(const uint8_t *p, size_t n)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+    for (size_t i = 0; i < n; i += 8)
+    {
+        h = (h ^ __bits_load_bytes(p + i, n - i < 8 ? n - i : 8)) * 0xff51afd7ed558ccdull;
+        h ^= h >> 29;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+// encodes len bytes of src chunk by chunk onto the end of dst
+void encode_buffer(const uint8_t *src, size_t len, byte_buf *dst, config cnf)
+{
+    for (size_t pos = 0; pos < len; pos += cnf.BYTES_per_chunk)
+    {
+        size_t n = len - pos < cnf.BYTES_per_chunk ? len - pos : cnf.BYTES_per_chunk;
+        byte_buf_reserve(dst, cnf.enc_BYTES_per_chunk);
+        dst->len += encode_chunk_to(src + pos, n, dst->ptr + dst->len, cnf);
+    }
+}
+
+// Builds the records of a member as its chunks go by
+typedef struct
+{
+    config cnf;
+    size_t init_size;
+    size_t group; // chunks of a whole group, 0 without parity
+    uint8_t *record;
+    byte_buf enc;
+} parity_encoder;
+
+parity_encoder parity_encoder_new(size_t init_size, config cnf)
+{
+    parity_encoder pe = {.cnf = cnf, .init_size = init_size, .group = calc_parity_group_chunks(cnf)};
+    if (pe.group && init_size > 0)
+    {
+        pe.record = malloc(calc_parity_record_size(calc_parity_group_size(init_size, 0, cnf), cnf));
+    }
+    return pe;
+}
+
+// Adds chunk j, the n bytes at src. Returns the encoded record when j is
+// the last chunk of its group, NULL otherwise.
+const byte_buf *parity_encoder_add(parity_encoder *pe, size_t j, const uint8_t *src, size_t n)
+{
+    if (!pe->group)
+    {
+        return NULL;
+    }
+    const config cnf = pe->cnf;
+    const size_t t = j % pe->group;
+    const size_t size = calc_parity_group_size(pe->init_size, j / pe->group, cnf);
+    const size_t stripes = calc_parity_stripes(size, cnf);
+    if (t == 0)
+    {
+        memset(pe->record, 0, calc_parity_record_size(size, cnf));
+    }
+    __bits_store_bytes(pe->record + t * PARITY_CHECK_SIZE, parity_chunk_check(src, n), PARITY_CHECK_SIZE);
+    uint8_t *parity = pe->record + calc_parity_blocks_at(size) + (t % stripes) * cnf.parity_count * cnf.BYTES_per_chunk;
+    for (size_t i = 0; i < cnf.parity_count; ++i)
+    {
+        gf256_mul_add(parity + i * cnf.BYTES_per_chunk, src, gf256_cauchy(i, t / stripes, cnf.parity_count), n);
+    }
+    if (t + 1 < size)
+    {
+        return NULL;
+    }
+    const size_t record_size = calc_parity_record_size(size, cnf), checks = size * PARITY_CHECK_SIZE;
+    const size_t blocks_at = calc_parity_blocks_at(size), copy_at = calc_parity_checks_copy_at(size, cnf);
+    __bits_store_bytes(pe->record + checks, parity_chunk_check(pe->record, checks), PARITY_CHECK_SIZE);
+    __bits_store_bytes(pe->record + copy_at - PARITY_CHECK_SIZE, parity_chunk_check(pe->record + blocks_at, copy_at - blocks_at - PARITY_CHECK_SIZE), PARITY_CHECK_SIZE);
+    if (cnf.parity_checks_copy)
+    {
+        memcpy(pe->record + copy_at, pe->record, blocks_at);
+    }
+    pe->enc.len = 0;
+    encode_buffer(pe->record, record_size, &pe->enc, cnf);
+    return &pe->enc;
+}
+
+void parity_encoder_close(parity_encoder *pe)
+{
+    free(pe->record);
+    byte_buf_close(&pe->enc);
+    *pe = (parity_encoder){0};
+}
+
+size_t __write_parity_record(FILE *output_file, const byte_buf *record)
+{
+    if (!record)
+    {
+        return 0;
+    }
+    if (record->len != fwrite(record->ptr, 1, record->len, output_file))
+    {
+        assert(false && "Expected to write a parity record");
+    }
+    return record->len;
+}
+
+// Appends the encoded hash tree of the member mb has seen to dst when the
+// layout has one, root gets the BLAKE3 of the member when not NULL
+void __encode_member_tree(merkle_builder *mb, byte_buf *dst, config cnf, uint8_t *root)
+{
+    if (!cnf.hash_tree)
+    {
+        return;
+    }
+    byte_buf nodes = {0};
+    uint8_t hash[BLAKE3_OUT_LEN];
+    merkle_builder_finish(mb, &nodes, hash);
+    encode_buffer(nodes.ptr, nodes.len, dst, cnf);
+    byte_buf_close(&nodes);
+    if (root)
+    {
+        memcpy(root, hash, BLAKE3_OUT_LEN);
+    }
+}
+
+size_t __write_member_tree(FILE *output_file, merkle_builder *mb, config cnf, uint8_t *root)
+{
+    byte_buf enc = {0};
+    __encode_member_tree(mb, &enc, cnf, root);
+    if (enc.len != fwrite(enc.ptr, 1, enc.len, output_file))
+    {
+        assert(false && "Expected to write a hash tree");
+    }
+    const size_t written = enc.len;
+    byte_buf_close(&enc);
+    return written;
+}
+
+// tag is only used when cnf.sync_group is set, root only with cnf.hash_tree
+size_t do_file_encoding(FILE *input_file, size_t input_file_len, FILE *output_file, config cnf, const member_tag *tag, uint64_t *content_hash, uint8_t *root)
+{
+    uint64_t h = CONTENT_HASH_INIT;
     assert(input_file_len > 0);
     size_t total_bytes_written = 0;
-    size_t cur_pos = ftell(input_file);
-    bit_vec vec = bit_vec_new(cnf.BITS_per_chunk);
-    while (cur_pos + cnf.BYTES_per_chunk < input_file_len)
+    uint8_t *chunk = malloc(cnf.BYTES_per_chunk);
+    uint8_t *encoded = malloc(cnf.enc_BYTES_per_chunk);
+    parity_encoder pe = parity_encoder_new(input_file_len, cnf);
+    merkle_builder mb = merkle_builder_new(input_file_len);
+    const size_t n_chunks = calc_chunk_count(input_file_len, cnf);
+    for (size_t j = 0; j < n_chunks; ++j)
     {
-        if (cnf.BYTES_per_chunk != fread(vec.ptr, 1, cnf.BYTES_per_chunk, input_file))
+        const size_t n = j + 1 < n_chunks ? cnf.BYTES_per_chunk : input_file_len - j * cnf.BYTES_per_chunk;
+        total_bytes_written += __write_sync_marker(output_file, cnf, tag, input_file_len, j);
+        if (n != fread(chunk, 1, n, input_file))
+        {
+            assert(false && "Expected to read a whole chunk");
+        }
+        h = content_hash_update(h, chunk, n);
+        if (cnf.hash_tree)
         {
-            assert(false && "Expected to read cnf.BYTES_per_chunk");
+            merkle_builder_update(&mb, chunk, n);
         }
-        bit_vec encoded = hamming_algo(vec);
-        assert(encoded.bit_count == cnf.enc_BITS_per_chunk);
-        assert(encoded.r_size == cnf.enc_BYTES_per_chunk);
-        total_bytes_written += cnf.enc_BYTES_per_chunk;
-        if (cnf.enc_BYTES_per_chunk != fwrite(encoded.ptr, 1, cnf.enc_BYTES_per_chunk, output_file))
+        const size_t enc_n = encode_chunk_to(chunk, n, encoded, cnf);
+        if (enc_n != fwrite(encoded, 1, enc_n, output_file))
         {
-            assert(false && "Expected to write cnf.enc_BYTES_per_chunk");
+            assert(false && "Expected to write an encoded chunk");
         }
-        bit_vec_delete(&encoded);
-        cur_pos = ftell(input_file);
+        total_bytes_written += enc_n + __write_parity_record(output_file, parity_encoder_add(&pe, j, chunk, n));
     }
+    total_bytes_written += __write_member_tree(output_file, &mb, cnf, root);
+    free(chunk);
+    free(encoded);
+    parity_encoder_close(&pe);
+    if (content_hash)
+    {
+        *content_hash = h;
+    }
+    return total_bytes_written;
+}
 
-    size_t bytes_left_to_read = input_file_len - cur_pos;
-    bit_vec last_vec = bit_vec_new(bytes_left_to_read * BITS_IN_BYTE);
-    if (bytes_left_to_read != fread(last_vec.ptr, 1, bytes_left_to_read, input_file))
+// Encodes input_len bytes held in the iov buffers, in place: only a chunk
+// that straddles two buffers is gathered first. Writes what do_file_encoding would.
+size_t do_iovec_encoding(const struct iovec *iov, size_t iovcnt, size_t input_len, FILE *output_file, config cnf, const member_tag *tag, uint64_t *content_hash, uint8_t *root)
+{
+    uint64_t h = CONTENT_HASH_INIT;
+    assert(input_len > 0);
+    size_t total_bytes_written = 0;
+    uint8_t *gather = malloc(cnf.BYTES_per_chunk);
+    uint8_t *encoded = malloc(cnf.enc_BYTES_per_chunk);
+    parity_encoder pe = parity_encoder_new(input_len, cnf);
+    merkle_builder mb = merkle_builder_new(input_len);
+    size_t iov_i = 0, iov_at = 0;
+    const size_t n_chunks = calc_chunk_count(input_len, cnf);
+    for (size_t j = 0; j < n_chunks; ++j)
     {
-        assert(false && "Expected to read cnf.BYTES_per_chunk");
+        const size_t n = j + 1 < n_chunks ? cnf.BYTES_per_chunk : input_len - j * cnf.BYTES_per_chunk;
+        total_bytes_written += __write_sync_marker(output_file, cnf, tag, input_len, j);
+
+        const uint8_t *src = gather;
+        for (size_t got = 0; got < n;)
+        {
+            assert(iov_i < iovcnt && "do_iovec_encoding : expected iov to hold input_len bytes");
+            const size_t left = iov[iov_i].iov_len - iov_at;
+            if (left == 0)
+            {
+                ++iov_i;
+                iov_at = 0;
+                continue;
+            }
+            const uint8_t *at = (const uint8_t *)iov[iov_i].iov_base + iov_at;
+            if (got == 0 && left >= n)
+            {
+                src = at;
+                iov_at += n;
+                break;
+            }
+            const size_t take = left < n - got ? left : n - got;
+            memcpy(gather + got, at, take);
+            got += take;
+            iov_at += take;
+        }
+
+        h = content_hash_update(h, src, n);
+        if (cnf.hash_tree)
+        {
+            merkle_builder_update(&mb, src, n);
+        }
+        const size_t enc_n = encode_chunk_to(src, n, encoded, cnf);
+        if (enc_n != fwrite(encoded, 1, enc_n, output_file))
+        {
+            assert(false && "Expected to write an encoded chunk");
+        }
+        total_bytes_written += enc_n + __write_parity_record(output_file, parity_encoder_add(&pe, j, src, n));
     }
-    bit_vec encoded = hamming_algo(last_vec);
-    total_bytes_written += encoded.r_size;
-    if (encoded.r_size != fwrite(encoded.ptr, 1, encoded.r_size, output_file))
+    total_bytes_written += __write_member_tree(output_file, &mb, cnf, root);
+    free(gather);
+    free(encoded);
+    parity_encoder_close(&pe);
+    if (content_hash)
     {
-        assert(false && "Expected to write cnf.enc_BYTES_per_chunk");
+        *content_hash = h;
     }
-    bit_vec_delete(&encoded);
-    bit_vec_delete(&last_vec);
-    bit_vec_delete(&vec);
     return total_bytes_written;
 }
 
-typedef struct
+// Appends the encoded member of the len bytes at src to dst, as do_file_encoding writes it
+size_t encode_member_buffer(const uint8_t *src, size_t len, byte_buf *dst, config cnf, const member_tag *tag, uint64_t *content_hash, uint8_t *root)
 {
-    FILE *file;
-    size_t src_file_len;
-    size_t enc_file_len;
-} encoded_file;
+    assert(len > 0);
+    const size_t start = dst->len;
+    parity_encoder pe = parity_encoder_new(len, cnf);
+    const size_t n_chunks = calc_chunk_count(len, cnf);
+    for (size_t j = 0; j < n_chunks; ++j)
+    {
+        const size_t n = j + 1 < n_chunks ? cnf.BYTES_per_chunk : len - j * cnf.BYTES_per_chunk;
+        __push_sync_marker(dst, cnf, tag, len, j);
+        byte_buf_reserve(dst, cnf.enc_BYTES_per_chunk);
+        dst->len += encode_chunk_to(src + j * cnf.BYTES_per_chunk, n, dst->ptr + dst->len, cnf);
+        const byte_buf *record = parity_encoder_add(&pe, j, src + j * cnf.BYTES_per_chunk, n);
+        if (record)
+        {
+            byte_buf_push(dst, record->ptr, record->len);
+        }
+    }
+    parity_encoder_close(&pe);
+    merkle_builder mb = merkle_builder_new(len);
+    if (cnf.hash_tree)
+    {
+        merkle_builder_update(&mb, src, len);
+    }
+    __encode_member_tree(&mb, dst, cnf, root);
+    if (content_hash)
+    {
+        *content_hash = content_hash_update(CONTENT_HASH_INIT, src, len);
+    }
+    return dst->len - start;
+}
+
+hamming_decode_res decode_chunk_to(const uint8_t *enc, size_t init_size, size_t j, uint8_t *dst, config cnf);
 
-void do_file_decoding(encoded_file enc_file, FILE *output_file, config cnf)
+// Rebuilds the lost chunks of stripe s of a group from the parity blocks of
+// the record, true if they all came back with the right check
+bool __parity_rebuild_stripe(uint8_t *dst, bool *lost, const uint8_t *record, size_t init_size, size_t first, size_t size, size_t s, config cnf)
 {
-    size_t cur_pos = 0;
-    bit_vec vec = bit_vec_new(cnf.enc_BITS_per_chunk);
-    assert(vec.r_size == cnf.enc_BYTES_per_chunk);
-    while (cur_pos + cnf.enc_BYTES_per_chunk < enc_file.enc_file_len)
+    const size_t stripes = calc_parity_stripes(size, cnf), M = cnf.parity_count, B = cnf.BYTES_per_chunk;
+    size_t rows[PARITY_MAX_COUNT];
+    size_t e = 0;
+    for (size_t t = s; t < size; t += stripes)
     {
-        if (cnf.enc_BYTES_per_chunk != fread(vec.ptr, 1, cnf.enc_BYTES_per_chunk, enc_file.file))
+        if (lost[t] && e < M)
         {
-            assert(false && "do_file_decoding : expected to read cnf.enc_BYTES_per_chunk");
+            rows[e] = t / stripes;
         }
-        hamming_decode_res res = hamming_decode(vec);
-        if (!res.ok)
+        e += lost[t];
+    }
+    if (e == 0 || e > M)
+    {
+        return e == 0;
+    }
+
+    // parity row i minus what the intact chunks put in, left with the lost ones
+    uint8_t *rest = malloc(e * B);
+    memcpy(rest, record + calc_parity_blocks_at(size) + s * M * B, e * B);
+    for (size_t t = s; t < size; t += stripes)
+    {
+        for (size_t i = 0; !lost[t] && i < e; ++i)
         {
-            fprintf(stderr, "Error while decoding\n");
-            continue;
+            gf256_mul_add(rest + i * B, dst + t * B, gf256_cauchy(i, t / stripes, M), calc_chunk_bytes(init_size, first + t, cnf));
         }
-        assert(res.vec.bit_count == cnf.BITS_per_chunk);
-
-        if (cnf.BYTES_per_chunk != fwrite(res.vec.ptr, 1, cnf.BYTES_per_chunk, output_file))
+    }
+    uint8_t a[PARITY_MAX_COUNT * PARITY_MAX_COUNT], inv[PARITY_MAX_COUNT * PARITY_MAX_COUNT];
+    for (size_t i = 0; i < e; ++i)
+    {
+        for (size_t q = 0; q < e; ++q)
         {
-            assert(false && "do_file_decoding : expected to write cnf.BYTES_per_chunk");
+            a[i * e + q] = gf256_cauchy(i, rows[q], M);
         }
-        bit_vec_delete(&res.vec);
-        cur_pos += cnf.enc_BYTES_per_chunk;
     }
-    size_t n_bytes_src = enc_file.src_file_len % cnf.BYTES_per_chunk;
-    if (n_bytes_src == 0)
+    bool ok = gf256_invert(a, inv, e);
+    uint8_t *chunk = malloc(B);
+    for (size_t q = 0; ok && q < e; ++q)
     {
-        if (cnf.enc_BYTES_per_chunk != fread(vec.ptr, 1, cnf.enc_BYTES_per_chunk, enc_file.file))
+        const size_t t = s + rows[q] * stripes, n = calc_chunk_bytes(init_size, first + t, cnf);
+        memset(chunk, 0, B);
+        for (size_t i = 0; i < e; ++i)
         {
-            assert(false && "do_file_decoding : expected to read cnf.enc_BYTES_per_chunk");
+            gf256_mul_add(chunk, rest + i * B, inv[q * e + i], B);
         }
-        hamming_decode_res res = hamming_decode(vec);
-        if (!res.ok)
+        if (parity_chunk_check(chunk, n) != __bits_load_bytes(record + t * PARITY_CHECK_SIZE, PARITY_CHECK_SIZE))
+        {
+            ok = false;
+            break;
+        }
+        memcpy(dst + t * B, chunk, n);
+        lost[t] = false;
+    }
+    free(chunk);
+    free(rest);
+    return ok;
+}
+
+// Without the chunk checks: whether stripe s of a group has no chunk Hamming
+// gave up on and every parity block of it matches the decoded chunks
+bool __parity_confirm_stripe(const uint8_t *dst, const bool *bad, const uint8_t *record, size_t init_size, size_t first, size_t size, size_t s, config cnf)
+{
+    const size_t stripes = calc_parity_stripes(size, cnf), M = cnf.parity_count, B = cnf.BYTES_per_chunk;
+    for (size_t t = s; t < size; t += stripes)
+    {
+        if (bad[t])
         {
-            fprintf(stderr, "Error while decoding\n");
-            return;
+            return false;
         }
-        assert(res.vec.bit_count == cnf.BITS_per_chunk);
-        if (cnf.BYTES_per_chunk != fwrite(res.vec.ptr, 1, cnf.BYTES_per_chunk, output_file))
+    }
+    uint8_t *row = malloc(B);
+    bool ok = true;
+    for (size_t i = 0; ok && i < M; ++i)
+    {
+        memset(row, 0, B);
+        for (size_t t = s; t < size; t += stripes)
+        {
+            gf256_mul_add(row, dst + t * B, gf256_cauchy(i, t / stripes, M), calc_chunk_bytes(init_size, first + t, cnf));
+        }
+        ok = memcmp(row, record + calc_parity_blocks_at(size) + (s * M + i) * B, B) == 0;
+    }
+    free(row);
+    return ok;
+}
+
+// Decodes parity group g of a member from raw, its span as calc_parity_span
+// gives it. Chunks Hamming cannot correct, or that decode with the wrong
+// check, are rebuilt from the record when their stripe lost at most
+// parity_count of them. Rebuilt chunks count as corrected. With no copy of
+// the checks intact, every chunk of a stripe the parity blocks do not
+// confirm counts as damaged. lost, when not NULL, tells the chunks that
+// stayed damaged; they are kept as decoded.
+decode_stats decode_parity_group(const uint8_t *raw, size_t init_size, size_t name_len, size_t g, uint8_t *dst, bool *lost, config cnf)
+{
+    const size_t first = g * calc_parity_group_chunks(cnf);
+    const size_t size = calc_parity_group_size(init_size, g, cnf);
+    size_t start, record_at, end;
+    calc_parity_span(init_size, g, name_len, cnf, &start, &record_at, &end);
+
+    decode_stats stats = {.chunks = size};
+    bool *bad = lost ? lost : malloc(size * sizeof(bool));
+    bool *corrected = calloc(size, sizeof(bool));
+    for (size_t t = 0; t < size; ++t)
+    {
+        hamming_decode_res res = decode_chunk_to(raw + calc_chunk_enc_offset(first + t, name_len, cnf) - start, init_size, first + t, dst + t * cnf.BYTES_per_chunk, cnf);
+        bad[t] = !res.ok;
+        corrected[t] = res.ok && res.corrected;
+    }
+
+    // each part of the record is good when its chunks decoded and its check matches
+    const size_t record_size = calc_parity_record_size(size, cnf), checks = size * PARITY_CHECK_SIZE;
+    const size_t blocks_at = calc_parity_blocks_at(size), copy_at = calc_parity_checks_copy_at(size, cnf);
+    uint8_t *record = malloc(record_size + cnf.BYTES_per_chunk);
+    bool checks_ok = true, parity_ok = true, copy_ok = cnf.parity_checks_copy;
+    for (size_t k = 0; k < calc_chunk_count(record_size, cnf); ++k)
+    {
+        hamming_decode_res res = decode_chunk_to(raw + record_at - start + k * cnf.enc_BYTES_per_chunk, record_size, k, record + k * cnf.BYTES_per_chunk, cnf);
+        const size_t from = k * cnf.BYTES_per_chunk, to = from + cnf.BYTES_per_chunk;
+        checks_ok &= res.ok || from >= blocks_at;
+        parity_ok &= res.ok || to <= blocks_at || from >= copy_at;
+        copy_ok &= res.ok || to <= copy_at;
+        stats.corrected += res.ok && res.corrected;
+    }
+    checks_ok &= parity_chunk_check(record, checks) == __bits_load_bytes(record + checks, PARITY_CHECK_SIZE);
+    parity_ok &= parity_chunk_check(record + blocks_at, copy_at - blocks_at - PARITY_CHECK_SIZE) ==
+                 __bits_load_bytes(record + copy_at - PARITY_CHECK_SIZE, PARITY_CHECK_SIZE);
+    copy_ok &= parity_chunk_check(record + copy_at, checks) == __bits_load_bytes(record + copy_at + checks, PARITY_CHECK_SIZE);
+    if (!checks_ok && copy_ok)
+    {
+        memcpy(record, record + copy_at, blocks_at);
+        checks_ok = true;
+    }
+    if (!checks_ok)
+    {
+        // nothing tells a chunk that decodes but is wrong, only a stripe that agrees with its parity is trusted
+        for (size_t s = 0; s < calc_parity_stripes(size, cnf); ++s)
         {
-            assert(false && "do_file_decoding : expected to write cnf.BYTES_per_chunk");
+            const bool confirmed = parity_ok && __parity_confirm_stripe(dst, bad, record, init_size, first, size, s, cnf);
+            for (size_t t = s; !confirmed && t < size; t += calc_parity_stripes(size, cnf))
+            {
+                bad[t] = true;
+            }
         }
-        bit_vec_delete(&res.vec);
-        cur_pos += cnf.enc_BYTES_per_chunk;
     }
     else
     {
-        size_t n_bytes_enc = enc_file.enc_file_len - cur_pos;
-        size_t n_bits_enc = hamming_calc_encoded_size(n_bytes_src * BITS_IN_BYTE);
-        bit_vec last_vec = bit_vec_new(n_bits_enc);
-        assert(last_vec.r_size == n_bytes_enc);
-        if (n_bytes_enc != fread(last_vec.ptr, 1, n_bytes_enc, enc_file.file))
+        for (size_t t = 0; t < size; ++t)
         {
-            assert(false && "do_file_decoding : expected to read n_bytes_in_last_chunk");
+            const uint32_t check = parity_chunk_check(dst + t * cnf.BYTES_per_chunk, calc_chunk_bytes(init_size, first + t, cnf));
+            if (!bad[t] && check != __bits_load_bytes(record + t * PARITY_CHECK_SIZE, PARITY_CHECK_SIZE))
+            {
+                bad[t] = true;
+            }
+            corrected[t] |= bad[t];
+        }
+        for (size_t s = 0; parity_ok && s < calc_parity_stripes(size, cnf); ++s)
+        {
+            __parity_rebuild_stripe(dst, bad, record, init_size, first, size, s, cnf);
         }
-        hamming_decode_res res = hamming_decode(last_vec);
+    }
+    for (size_t t = 0; t < size; ++t)
+    {
+        stats.failed += bad[t];
+        stats.corrected += corrected[t] && !bad[t];
+    }
+    free(record);
+    free(corrected);
+    if (!lost)
+    {
+        free(bad);
+    }
+    return stats;
+}
+
+// do_file_decoding of a member with parity, a group at a time
+decode_stats __do_parity_decoding(encoded_file enc_file, FILE *output_file, config cnf)
+{
+    decode_stats stats = {0};
+    const size_t group = calc_parity_group_chunks(cnf);
+    uint8_t *dec = malloc(group * cnf.BYTES_per_chunk);
+    byte_buf raw = {0};
+    size_t pos = 0;
+    for (size_t g = 0; g < calc_parity_group_count(enc_file.src_file_len, cnf); ++g)
+    {
+        size_t start, record_at, end;
+        calc_parity_span(enc_file.src_file_len, g, enc_file.name_len, cnf, &start, &record_at, &end);
+        raw.len = 0;
+        byte_buf_reserve(&raw, end - start);
+        if (fseek(enc_file.file, start - pos, SEEK_CUR) || end - start != fread(raw.ptr, 1, end - start, enc_file.file))
+        {
+            assert(false && "do_file_decoding : expected to read a parity group");
+        }
+        pos = end;
+
+        const decode_stats group_stats = decode_parity_group(raw.ptr, enc_file.src_file_len, enc_file.name_len, g, dec, NULL, cnf);
+        if (group_stats.failed)
+        {
+            fprintf(stderr, "do_file_decoding: %lu chunks of group %lu could not be corrected or rebuilt\n", group_stats.failed, g);
+        }
+        stats.chunks += group_stats.chunks;
+        stats.corrected += group_stats.corrected;
+        stats.failed += group_stats.failed;
+
+        const size_t n = g * group + group_stats.chunks < calc_chunk_count(enc_file.src_file_len, cnf) ? group_stats.chunks * cnf.BYTES_per_chunk
+                                                                                                       : enc_file.src_file_len - g * group * cnf.BYTES_per_chunk;
+        if (n != fwrite(dec, 1, n, output_file))
+        {
+            assert(false && "do_file_decoding : expected to write decoded chunks");
+        }
+        if (enc_file.tree)
+        {
+            merkle_builder_update(enc_file.tree, dec, n);
+        }
+    }
+    free(dec);
+    byte_buf_close(&raw);
+    return stats;
+}
+
+// Chunks that cannot be corrected are written as read, so the output keeps its size
+decode_stats do_file_decoding(encoded_file enc_file, FILE *output_file, config cnf)
+{
+    if (cnf.parity_count)
+    {
+        return __do_parity_decoding(enc_file, output_file, cnf);
+    }
+    decode_stats stats = {0};
+    const size_t n_chunks = calc_chunk_count(enc_file.src_file_len, cnf);
+    uint8_t *enc = malloc(cnf.enc_BYTES_per_chunk);
+    uint8_t *dec = malloc(cnf.BYTES_per_chunk);
+    for (size_t j = 0; j < n_chunks; ++j)
+    {
+        const size_t enc_n = (calc_chunk_enc_bits(enc_file.src_file_len, j, cnf) + BITS_IN_BYTE - 1) / BITS_IN_BYTE;
+        const size_t n = j + 1 < n_chunks ? cnf.BYTES_per_chunk : enc_file.src_file_len - j * cnf.BYTES_per_chunk;
+        if (cnf.sync_group && j % cnf.sync_group == 0 &&
+            fseek(enc_file.file, SYNC_MARKER_SIZE + (j == 0 ? enc_file.name_len : 0), SEEK_CUR))
+        {
+            assert(false && "do_file_decoding : expected to skip a sync marker");
+        }
+        if (enc_n != fread(enc, 1, enc_n, enc_file.file))
+        {
+            assert(false && "do_file_decoding : expected to read a whole chunk");
+        }
+
+        hamming_decode_res res = decode_chunk_to(enc, enc_file.src_file_len, j, dec, cnf);
+        stats.chunks += 1;
         if (!res.ok)
         {
-            fprintf(stderr, "do_file_decoding: failed decoding last chunk\n");
+            fprintf(stderr, "do_file_decoding: chunk %lu could not be corrected\n", j);
+            stats.failed += 1;
+        }
+        else if (res.corrected)
+        {
+            stats.corrected += 1;
+        }
+
+        if (n != fwrite(dec, 1, n, output_file))
+        {
+            assert(false && "do_file_decoding : expected to write decoded chunk");
+        }
+        if (enc_file.tree)
+        {
+            merkle_builder_update(enc_file.tree, dec, n);
+        }
+    }
+    free(enc);
+    free(dec);
+    return stats;
+}
+
+// decodes enc, the j-th chunk of a stream of init_size source bytes, to dst
+hamming_decode_res decode_chunk_to(const uint8_t *enc, size_t init_size, size_t j, uint8_t *dst, config cnf)
+{
+    bit_vec chunk = {.ptr = (char *)enc, .bit_count = calc_chunk_enc_bits(init_size, j, cnf)};
+    if (cnf.codec && chunk.bit_count == cnf.codec->enc_bits)
+    {
+        return hamming_codec_decode(cnf.codec, enc, dst);
+    }
+    chunk.r_size = (chunk.bit_count + BITS_IN_BYTE - 1) / BITS_IN_BYTE;
+    hamming_decode_res res = hamming_decode(chunk);
+    memcpy(dst, res.vec.ptr, res.vec.r_size);
+    bit_vec_delete(&res.vec);
+    return res;
+}
+
+// Decodes init_size bytes stored encoded at offset. Chunks the primary copy
+// cannot correct are taken from the backup copy when there is one (backup_offset >= 0).
+bool decode_region(int fd, int64_t offset, int64_t backup_offset, size_t init_size, uint8_t *dst, config cnf, decode_stats *stats)
+{
+    const size_t enc_size = calc_encoded_size(init_size, cnf);
+    uint8_t *enc = malloc(enc_size + 1);
+    uint8_t *backup = NULL;
+    bool ok = pread(fd, enc, enc_size, offset) == (ssize_t)enc_size;
+
+    const size_t n_chunks = calc_chunk_count(init_size, cnf);
+    for (size_t j = 0; ok && j < n_chunks; ++j)
+    {
+        const size_t enc_at = j * cnf.enc_BYTES_per_chunk, at = j * cnf.BYTES_per_chunk;
+        hamming_decode_res res = decode_chunk_to(enc + enc_at, init_size, j, dst + at, cnf);
+        stats->chunks += 1;
+        if (res.ok)
+        {
+            stats->corrected += res.corrected;
+            continue;
         }
-        else
+        if (!backup && backup_offset >= 0)
         {
-            assert(res.vec.r_size * 8 == res.vec.bit_count && "do_file_decoding : expected to have even decoding of last chunk");
-            if (res.vec.r_size != fwrite(res.vec.ptr, 1, res.vec.r_size, output_file))
+            backup = malloc(enc_size + 1);
+            if (pread(fd, backup, enc_size, backup_offset) != (ssize_t)enc_size)
             {
-                assert(false && "do_file_decoding : expected to write decoded n_bytes_in_last_chunk");
+                backup_offset = -1;
             }
         }
-        bit_vec_delete(&last_vec);
-        bit_vec_delete(&res.vec);
+        res = backup_offset >= 0 ? decode_chunk_to(backup + enc_at, init_size, j, dst + at, cnf) : (hamming_decode_res){0};
+        // the chunk is counted as corrected when the backup copy had it right
+        stats->corrected += res.ok;
+        stats->failed += !res.ok;
+        ok = res.ok;
+    }
+    free(enc);
+    free(backup);
+    return ok;
+}
+
+// Forward reader of the decoded bytes of an encoded stream, starting at any
+// decoded position. Chunks the primary copy cannot correct are read from the
+// backup copy when there is one (backup_offset >= 0).
+#define CHUNK_CURSOR_MAX_FILL 128
+typedef struct
+{
+    int fd;
+    config cnf;
+    int64_t backup_offset;
+    size_t init_size;
+    size_t next_chunk;
+    file_cursor raw;
+
+    uint8_t *buf;
+    size_t head;
+    size_t len;
+    size_t corrected; // chunks, as decode_region counts them
+    bool failed;
+} chunk_cursor;
+
+void __chunk_cursor_decode_next(chunk_cursor *c)
+{
+    const config cnf = c->cnf;
+    const size_t j = c->next_chunk++;
+    const size_t bytes = (calc_chunk_enc_bits(c->init_size, j, cnf) + BITS_IN_BYTE - 1) / BITS_IN_BYTE;
+    const size_t src_bytes = j + 1 < calc_chunk_count(c->init_size, cnf) ? cnf.BYTES_per_chunk : c->init_size - j * cnf.BYTES_per_chunk;
+
+    uint8_t *dst = c->buf + c->len;
+    hamming_decode_res res = {0};
+    if (file_cursor_fill(&c->raw, bytes) >= bytes)
+    {
+        res = decode_chunk_to(c->raw.buf + c->raw.head, c->init_size, j, dst, cnf);
+        c->raw.head += bytes;
+        c->corrected += res.ok && res.corrected;
+    }
+    if (!res.ok && c->backup_offset >= 0)
+    {
+        uint8_t enc[cnf.enc_BYTES_per_chunk];
+        if (pread(c->fd, enc, bytes, c->backup_offset + j * cnf.enc_BYTES_per_chunk) == (ssize_t)bytes)
+        {
+            res = decode_chunk_to(enc, c->init_size, j, dst, cnf);
+            c->corrected += res.ok;
+        }
+    }
+    c->failed |= !res.ok;
+    c->len += src_bytes;
+}
+
+chunk_cursor chunk_cursor_open(int fd, int64_t offset, int64_t backup_offset, size_t init_size, size_t start, config cnf, size_t raw_buf_size)
+{
+    const size_t first = start / cnf.BYTES_per_chunk;
+    chunk_cursor c = {
+        .fd = fd,
+        .cnf = cnf,
+        .backup_offset = backup_offset,
+        .init_size = init_size,
+        .next_chunk = first,
+        .raw = file_cursor_open(fd, offset + first * cnf.enc_BYTES_per_chunk, offset + calc_encoded_size(init_size, cnf), raw_buf_size),
+        .buf = malloc(CHUNK_CURSOR_MAX_FILL + cnf.BYTES_per_chunk),
+    };
+    if (start < init_size)
+    {
+        __chunk_cursor_decode_next(&c);
+        c.head = start % cnf.BYTES_per_chunk;
     }
-    bit_vec_delete(&vec);
+    return c;
+}
+
+// makes at least n <= CHUNK_CURSOR_MAX_FILL bytes (or everything left) available at buf + head
+size_t chunk_cursor_fill(chunk_cursor *c, size_t n)
+{
+    assert(n <= CHUNK_CURSOR_MAX_FILL);
+    if (c->len - c->head >= n)
+    {
+        return c->len - c->head;
+    }
+    memmove(c->buf, c->buf + c->head, c->len - c->head);
+    c->len -= c->head;
+    c->head = 0;
+    while (c->len < n && c->next_chunk < calc_chunk_count(c->init_size, c->cnf))
+    {
+        __chunk_cursor_decode_next(c);
+    }
+    return c->len;
+}
+
+void chunk_cursor_close(chunk_cursor *c)
+{
+    file_cursor_close(&c->raw);
+    free(c->buf);
+    *c = (chunk_cursor){0};
 }
 
 size_t calc_encoded_size(size_t init_size, config cnf)
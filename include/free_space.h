@@ -0,0 +1,126 @@
+#ifndef FREE_SPACE_H
+#define FREE_SPACE_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct
+{
+    size_t offset;
+    size_t size;
+} extent;
+
+typedef struct
+{
+    extent *arr;
+    size_t len;
+    size_t cap;
+} extent_vec;
+
+void extent_vec_push(extent_vec *v, extent e)
+{
+    if (v->len == v->cap)
+    {
+        v->cap = v->cap ? v->cap * 2 : 64;
+        v->arr = realloc(v->arr, v->cap * sizeof(extent));
+    }
+    v->arr[v->len++] = e;
+}
+
+void extent_vec_close(extent_vec *v)
+{
+    free(v->arr);
+    *v = (extent_vec){0};
+}
+
+int __extent_cmp(const void *lhs, const void *rhs)
+{
+    const extent *l = lhs, *r = rhs;
+    return l->offset < r->offset ? -1 : l->offset > r->offset;
+}
+
+// Gaps between the used extents of a file, everything from tail on is free too
+typedef struct
+{
+    extent_vec gaps;
+    size_t tail;
+} free_space;
+
+// sorts used in place
+free_space free_space_from_used(extent_vec *used)
+{
+    qsort(used->arr, used->len, sizeof(extent), __extent_cmp);
+
+    free_space space = {0};
+    for (size_t i = 0; i < used->len; ++i)
+    {
+        const extent *e = &used->arr[i];
+        if (e->size == 0)
+        {
+            continue;
+        }
+        if (e->offset > space.tail)
+        {
+            extent_vec_push(&space.gaps, (extent){.offset = space.tail, .size = e->offset - space.tail});
+        }
+        if (e->offset + e->size > space.tail)
+        {
+            space.tail = e->offset + e->size;
+        }
+    }
+    return space;
+}
+
+size_t __round_up(size_t v, size_t align)
+{
+    return align > 1 ? (v + align - 1) / align * align : v;
+}
+
+void __free_space_insert_gap(free_space *space, size_t at, extent e)
+{
+    extent_vec_push(&space->gaps, e);
+    memmove(&space->gaps.arr[at + 1], &space->gaps.arr[at], (space->gaps.len - 1 - at) * sizeof(extent));
+    space->gaps.arr[at] = e;
+}
+
+// First fit, falls back to the tail. With align > 1 the returned offset is a
+// multiple of it and the padding in front of it stays free.
+size_t free_space_alloc(free_space *space, size_t size, size_t align)
+{
+    for (size_t i = 0; i < space->gaps.len; ++i)
+    {
+        extent *gap = &space->gaps.arr[i];
+        size_t offset = __round_up(gap->offset, align);
+        if (offset + size > gap->offset + gap->size)
+        {
+            continue;
+        }
+        extent rest = {.offset = offset + size, .size = gap->offset + gap->size - offset - size};
+        gap->size = offset - gap->offset;
+        if (gap->size == 0)
+        {
+            *gap = rest;
+        }
+        else if (rest.size > 0)
+        {
+            __free_space_insert_gap(space, i + 1, rest);
+        }
+        return offset;
+    }
+    size_t offset = __round_up(space->tail, align);
+    if (offset > space->tail)
+    {
+        extent_vec_push(&space->gaps, (extent){.offset = space->tail, .size = offset - space->tail});
+    }
+    space->tail = offset + size;
+    return offset;
+}
+
+void free_space_close(free_space *space)
+{
+    extent_vec_close(&space->gaps);
+    *space = (free_space){0};
+}
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef FS_WALK_H
+#define FS_WALK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "helper.h"
+
+#define FS_WALK_THREADS 4
+// a found file with its path and name, roughly
+#define FS_ENTRY_MEMORY (sizeof(fs_entry) + 256)
+
+typedef struct
+{
+    char *path; // where to read the file from
+    char *name; // member name, relative to the root argument
+    struct stat st;
+} fs_entry;
+
+void fs_entry_close(fs_entry *e)
+{
+    free(e->path);
+    free(e->name);
+    *e = (fs_entry){0};
+}
+
+typedef struct
+{
+    fs_entry *arr;
+    size_t len;
+    size_t cap;
+} fs_entry_vec;
+
+void fs_entry_vec_push(fs_entry_vec *v, fs_entry e)
+{
+    if (v->len == v->cap)
+    {
+        v->cap = v->cap ? v->cap * 2 : 64;
+        v->arr = realloc(v->arr, v->cap * sizeof(fs_entry));
+    }
+    v->arr[v->len++] = e;
+}
+
+// Directories are read by a small pool of threads while the caller consumes
+// the discovered regular files through fs_walk_next. With max_queued set the
+// threads wait while that many files are found and not yet taken.
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    fs_entry_vec dirs;  // directories left to read
+    fs_entry_vec files; // discovered files, consumed from files_head
+    size_t files_head;
+    size_t max_queued; // 0 for no limit
+
+    size_t busy; // threads currently reading a directory
+    bool done;
+    size_t failed; // roots, directories and entries that could not be read
+
+    pthread_t *threads;
+    size_t n_threads;
+} fs_walker;
+
+char *fs_walk_child_name(const char *prefix, const char *name)
+{
+    if (prefix[0] == '\0')
+    {
+        return strdup(name);
+    }
+    return path_join_alloc(prefix, name);
+}
+
+void __fs_walk_read_dir(fs_walker *w, fs_entry dir)
+{
+    fs_entry_vec dirs = {0}, files = {0};
+    size_t failed = 0;
+
+    DIR *d = opendir(dir.path);
+    if (!d)
+    {
+        fprintf(stderr, "could not open directory %s\n", dir.path);
+        failed += 1;
+    }
+    else
+    {
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL)
+        {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            {
+                continue;
+            }
+            fs_entry e = {0};
+            if (fstatat(dirfd(d), de->d_name, &e.st, AT_SYMLINK_NOFOLLOW))
+            {
+                fprintf(stderr, "could not stat %s/%s\n", dir.path, de->d_name);
+                failed += 1;
+                continue;
+            }
+            if (!S_ISDIR(e.st.st_mode) && !S_ISREG(e.st.st_mode))
+            {
+                continue;
+            }
+            e.path = path_join_alloc(dir.path, de->d_name);
+            e.name = fs_walk_child_name(dir.name, de->d_name);
+            fs_entry_vec_push(S_ISDIR(e.st.st_mode) ? &dirs : &files, e);
+        }
+        closedir(d);
+    }
+    fs_entry_close(&dir);
+
+    pthread_mutex_lock(&w->lock);
+    w->failed += failed;
+    for (size_t i = 0; i < dirs.len; ++i)
+    {
+        fs_entry_vec_push(&w->dirs, dirs.arr[i]);
+    }
+    for (size_t i = 0; i < files.len; ++i)
+    {
+        while (w->max_queued && w->files.len - w->files_head >= w->max_queued)
+        {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        fs_entry_vec_push(&w->files, files.arr[i]);
+    }
+    w->busy -= 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    free(dirs.arr);
+    free(files.arr);
+}
+
+void *__fs_walk_thread(void *arg)
+{
+    fs_walker *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (true)
+    {
+        while (w->dirs.len == 0 && w->busy > 0)
+        {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->dirs.len == 0)
+        {
+            w->done = true;
+            pthread_cond_broadcast(&w->cond);
+            break;
+        }
+        fs_entry dir = w->dirs.arr[--w->dirs.len];
+        w->busy += 1;
+        pthread_mutex_unlock(&w->lock);
+
+        __fs_walk_read_dir(w, dir);
+
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Regular files among roots are stored under their clean name, directories
+// keep the path relative to their own clean name
+fs_walker *fs_walk_start(char *const *roots, size_t n_roots, size_t n_threads, size_t max_queued)
+{
+    fs_walker *w = calloc(1, sizeof(fs_walker));
+    w->max_queued = max_queued;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    for (size_t i = 0; i < n_roots; ++i)
+    {
+        fs_entry e = {0};
+        if (stat(roots[i], &e.st))
+        {
+            fprintf(stderr, "could not obtain file %s\n", roots[i]);
+            w->failed += 1;
+            continue;
+        }
+        e.path = strdup(roots[i]);
+        if (S_ISDIR(e.st.st_mode))
+        {
+            e.name = get_clean_dirname(roots[i]);
+            fs_entry_vec_push(&w->dirs, e);
+        }
+        else
+        {
+            e.name = strdup(get_clean_filename(roots[i]));
+            fs_entry_vec_push(&w->files, e);
+        }
+    }
+
+    w->n_threads = n_threads;
+    w->threads = calloc(n_threads, sizeof(pthread_t));
+    for (size_t i = 0; i < n_threads; ++i)
+    {
+        pthread_create(&w->threads[i], NULL, __fs_walk_thread, w);
+    }
+    return w;
+}
+
+// Blocks until the next file is discovered; false once the walk is over
+bool fs_walk_next(fs_walker *w, fs_entry *out)
+{
+    pthread_mutex_lock(&w->lock);
+    while (w->files_head == w->files.len && !w->done)
+    {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    bool ok = w->files_head < w->files.len;
+    if (ok)
+    {
+        *out = w->files.arr[w->files_head++];
+    }
+    // taken entries are dropped from the front once they are half the queue
+    if (w->files_head > 64 && w->files_head * 2 >= w->files.len)
+    {
+        memmove(w->files.arr, w->files.arr + w->files_head, (w->files.len - w->files_head) * sizeof(fs_entry));
+        w->files.len -= w->files_head;
+        w->files_head = 0;
+    }
+    if (w->max_queued)
+    {
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+// false if something found could not be read, the walk went on without it
+bool fs_walk_finish(fs_walker *w)
+{
+    for (size_t i = 0; i < w->n_threads; ++i)
+    {
+        pthread_join(w->threads[i], NULL);
+    }
+    for (size_t i = w->files_head; i < w->files.len; ++i)
+    {
+        fs_entry_close(&w->files.arr[i]);
+    }
+    free(w->files.arr);
+    free(w->dirs.arr);
+    free(w->threads);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    const bool ok = w->failed == 0;
+    free(w);
+    return ok;
+}
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef GF256_H
+#define GF256_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+// Arithmetic in GF(2^8) modulo x^8 + x^4 + x^3 + x^2 + 1, the field the
+// parity blocks are computed in. Products over a region are table lookups:
+// one 256-byte row of the multiplication table per factor, or with SSSE3 the
+// two 16-entry tables of nibble products that PSHUFB looks 16 bytes up in.
+#define GF256_POLY 0x11d
+
+typedef struct
+{
+    uint8_t exp[512];
+    uint8_t log[256];
+    uint8_t mul[256][256];
+    uint8_t nib[256][2][16]; // c * x for the low nibble x, then c * (x << 4)
+    bool ssse3;
+} gf256_tables;
+
+static gf256_tables __gf256;
+static pthread_once_t __gf256_once = PTHREAD_ONCE_INIT;
+
+void __gf256_init(void)
+{
+    unsigned x = 1;
+    for (int i = 0; i < 255; ++i)
+    {
+        __gf256.exp[i] = x;
+        __gf256.log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+        {
+            x ^= GF256_POLY;
+        }
+    }
+    for (int i = 255; i < 512; ++i)
+    {
+        __gf256.exp[i] = __gf256.exp[i - 255];
+    }
+    for (int a = 1; a < 256; ++a)
+    {
+        for (int b = 1; b < 256; ++b)
+        {
+            __gf256.mul[a][b] = __gf256.exp[__gf256.log[a] + __gf256.log[b]];
+        }
+    }
+    for (int c = 0; c < 256; ++c)
+    {
+        for (int i = 0; i < 16; ++i)
+        {
+            __gf256.nib[c][0][i] = __gf256.mul[c][i];
+            __gf256.nib[c][1][i] = __gf256.mul[c][i << 4];
+        }
+    }
+#if defined(__x86_64__) && defined(__GNUC__)
+    __gf256.ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+const gf256_tables *gf256(void)
+{
+    pthread_once(&__gf256_once, __gf256_init);
+    return &__gf256;
+}
+
+uint8_t gf256_mul(uint8_t a, uint8_t b)
+{
+    return gf256()->mul[a][b];
+}
+
+uint8_t gf256_inv(uint8_t a)
+{
+    assert(a != 0);
+    const gf256_tables *t = gf256();
+    return t->exp[255 - t->log[a]];
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// the whole 16-byte blocks of the region, returns how many bytes it did
+__attribute__((target("ssse3"))) size_t __gf256_mul_add_ssse3(uint8_t *dst, const uint8_t *src, const uint8_t nib[2][16], size_t len)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *)nib[0]);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)nib[1]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        const __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        const __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+                                        _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), p));
+    }
+    return i;
+}
+#endif
+
+// dst ^= c * src over len bytes
+void gf256_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    if (c == 0)
+    {
+        return;
+    }
+    const gf256_tables *t = gf256();
+    size_t i = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (t->ssse3)
+    {
+        i = __gf256_mul_add_ssse3(dst, src, t->nib[c], len);
+    }
+#endif
+    const uint8_t *row = t->mul[c];
+    for (; i < len; ++i)
+    {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+// Entry (i, k) of the m x n Cauchy matrix 1 / (x_i + y_k), x_i = i and
+// y_k = m + k. Every square submatrix of it is invertible, so any m of the
+// n data blocks can be rebuilt from the m parity blocks. m + n <= 256.
+uint8_t gf256_cauchy(size_t i, size_t k, size_t m)
+{
+    assert(i < m && m + k < 256);
+    return gf256_inv((uint8_t)(i ^ (m + k)));
+}
+
+// Inverts the n x n row-major matrix a into inv, a is destroyed. False if it is singular.
+bool gf256_invert(uint8_t *a, uint8_t *inv, size_t n)
+{
+    memset(inv, 0, n * n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        inv[i * n + i] = 1;
+    }
+    for (size_t col = 0; col < n; ++col)
+    {
+        size_t pivot = col;
+        while (pivot < n && a[pivot * n + col] == 0)
+        {
+            ++pivot;
+        }
+        if (pivot == n)
+        {
+            return false;
+        }
+        for (size_t k = 0; k < n; ++k)
+        {
+            uint8_t tmp = a[col * n + k];
+            a[col * n + k] = a[pivot * n + k];
+            a[pivot * n + k] = tmp;
+            tmp = inv[col * n + k];
+            inv[col * n + k] = inv[pivot * n + k];
+            inv[pivot * n + k] = tmp;
+        }
+        const uint8_t scale = gf256_inv(a[col * n + col]);
+        for (size_t k = 0; k < n; ++k)
+        {
+            a[col * n + k] = gf256_mul(a[col * n + k], scale);
+            inv[col * n + k] = gf256_mul(inv[col * n + k], scale);
+        }
+        for (size_t row = 0; row < n; ++row)
+        {
+            const uint8_t f = a[row * n + col];
+            if (row == col || f == 0)
+            {
+                continue;
+            }
+            for (size_t k = 0; k < n; ++k)
+            {
+                a[row * n + k] ^= gf256_mul(f, a[col * n + k]);
+                inv[row * n + k] ^= gf256_mul(f, inv[col * n + k]);
+            }
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef HAMARC_H
+#define HAMARC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Public interface of libhamarc. Only this header is installed with the
+// library, the arch_*.h headers are its implementation.
+//
+// A handle keeps the archive open and its member table in memory between
+// calls. Every call that changes the archive commits before it returns,
+// so a handle may be closed (or the process killed) after any of them.
+// Diagnostics go to stderr as with the command line tool.
+
+#ifdef HAMARC_BUILD
+#define HAMARC_API __attribute__((visibility("default")))
+#else
+#define HAMARC_API
+#endif
+
+typedef struct hamarc hamarc;
+
+typedef struct
+{
+    size_t bytes_per_chunk; // 0 for the default
+    size_t sync_group;      // chunks between resync markers, 0 for none
+    size_t parity_data;     // chunks of a parity stripe, 0 for the default
+    size_t parity_count;    // parity blocks of a stripe, 0 for none
+    bool hash_tree;         // store a BLAKE3 hash tree with every member
+    size_t align;           // member data alignment, HAMARC_ALIGN_BLOCK for the block size
+    bool no_cache;          // keep bulk reads and writes out of the page cache
+    size_t max_memory;      // bytes an operation may hold at once, 0 for no limit
+} hamarc_options;
+
+#define HAMARC_ALIGN_BLOCK SIZE_MAX
+
+typedef struct
+{
+    const char *name; // owned by the handle, valid until it changes the archive
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t hash; // FNV-1a of the content, 0 if unknown
+    uint8_t root[32]; // BLAKE3 of the content with hash_tree, all zero if unknown
+    uint32_t mode;    // st_mode of the file added, 0 if unknown
+    uint32_t uid;
+    uint32_t gid;
+} hamarc_member;
+
+// Creates (or truncates) the archive at path, opts may be NULL
+HAMARC_API hamarc *hamarc_create(const char *path, const hamarc_options *opts);
+// Opens an existing archive, the layout is the stored one: only align,
+// no_cache and max_memory of opts are used. NULL if it can not be opened.
+HAMARC_API hamarc *hamarc_open(const char *path, const hamarc_options *opts);
+HAMARC_API void hamarc_close(hamarc *h);
+
+HAMARC_API size_t hamarc_count(hamarc *h);
+HAMARC_API bool hamarc_stat(hamarc *h, size_t i, hamarc_member *out);
+// index of the member called name or -1
+HAMARC_API int64_t hamarc_find(hamarc *h, const char *name);
+// whether a member is called name, answered from the lookup block of the
+// archive when it has one, without loading the member table
+HAMARC_API bool hamarc_contains(hamarc *h, const char *name);
+
+// Decodes member i into out, corrected and damaged chunks are reported
+HAMARC_API bool hamarc_read_to(hamarc *h, size_t i, FILE *out);
+// Pull-based reader of member i: decodes on demand, the next batch ahead on
+// a thread of its own. The archive must not be changed while it is open.
+typedef struct hamarc_reader hamarc_reader;
+HAMARC_API hamarc_reader *hamarc_reader_open(hamarc *h, size_t i);
+// up to n bytes into dst, 0 at the end of the member, -1 on a read error
+HAMARC_API int64_t hamarc_reader_read(hamarc_reader *r, void *dst, size_t n);
+// whence as for lseek, returns the new position or -1
+HAMARC_API int64_t hamarc_reader_seek(hamarc_reader *r, int64_t offset, int whence);
+// With a hash tree, bytes are handed out only from leaves that match it and
+// a read of one that does not fails. false if some chunk read could not be
+// corrected or read at all, or some leaf did not match.
+HAMARC_API bool hamarc_reader_close(hamarc_reader *r);
+// Extracts member i under dir with its mode and mtime (and owner when run as
+// root), the path written to is returned (to free) or NULL. When some chunk
+// was uncorrectable it is NULL too, what was decoded is left in the file.
+HAMARC_API char *hamarc_extract(hamarc *h, size_t i, const char *dir);
+
+// Appends files and directories (recursively), named as with -f. What could
+// be read is committed, false if some file was left out.
+HAMARC_API bool hamarc_add_paths(hamarc *h, const char *const *paths, size_t n);
+// Appends len bytes of data as the member name, mtime_ns is the time to store
+// and the mode is left unknown. false if name is empty, absolute, climbs out with
+// "..", is already in the archive, or the member could not be written.
+// The data is encoded from where it is, nothing is copied or spilled to a file.
+HAMARC_API bool hamarc_add_buffer(hamarc *h, const char *name, const void *data, size_t len, int64_t mtime_ns);
+// Same for a member scattered over iovcnt buffers, stored as their concatenation
+HAMARC_API bool hamarc_add_iovec(hamarc *h, const char *name, const struct iovec *iov, size_t iovcnt, int64_t mtime_ns);
+// Re-encodes changed files, appends new ones, like --update; false as above
+HAMARC_API bool hamarc_update_paths(hamarc *h, const char *const *paths, size_t n, bool use_checksum);
+// Drops the named members, names not in the archive are reported and skipped
+HAMARC_API bool hamarc_remove(hamarc *h, const char *const *names, size_t n);
+// Corrects single-bit errors in place, false if some chunk is uncorrectable
+HAMARC_API bool hamarc_repair(hamarc *h);
+// Checks every member against its hash tree, false if some member does not
+// match or the archive was created without hash_tree
+HAMARC_API bool hamarc_verify(hamarc *h);
+
+#endif
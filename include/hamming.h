@@ -7,6 +7,10 @@
 #include <assert.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 #define BITS_IN_BYTE 8
 
@@ -34,15 +38,91 @@ void bit_vec_delete(bit_vec *ptr)
 
 char bit_vec_get_bit_at(const bit_vec *vec, size_t i)
 {
-    assert((i / BITS_IN_BYTE) < vec->r_size);
-    return (vec->ptr[i / BITS_IN_BYTE] >> (i % BITS_IN_BYTE)) & 1;
+    assert((i >> 3) < vec->r_size);
+    return (vec->ptr[i >> 3] >> (i & 7)) & 1;
 }
 
 void bit_vec_set_bit_at(bit_vec *vec, size_t i, char val)
 {
-    assert((i / BITS_IN_BYTE) < vec->r_size);
-    size_t j = i % BITS_IN_BYTE;
-    vec->ptr[i / BITS_IN_BYTE] = ((~(val << j)) & vec->ptr[i / BITS_IN_BYTE]) | (val << j);
+    assert((i >> 3) < vec->r_size);
+    const char mask = (char)(1 << (i & 7));
+    vec->ptr[i >> 3] ^= (-(val & 1) ^ vec->ptr[i >> 3]) & mask;
+}
+
+// n <= 8 bytes at p as a little endian word
+static inline uint64_t __bits_load_bytes(const uint8_t *p, size_t n)
+{
+    uint64_t w = 0;
+    if (n == 8)
+    {
+        memcpy(&w, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        return w;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        w |= (uint64_t)p[i] << (8 * i);
+    }
+    return w;
+}
+
+static inline void __bits_store_bytes(uint8_t *p, uint64_t w, size_t n)
+{
+    if (n == 8)
+    {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        memcpy(p, &w, 8);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        p[i] = (uint8_t)(w >> (8 * i));
+    }
+}
+
+// n bits from bit at of p, at % 8 + n <= 64. Only the bytes holding them are read.
+static inline uint64_t bits_load(const uint8_t *p, size_t at, size_t n)
+{
+    const size_t shift = at & 7;
+    assert(shift + n <= 64);
+    const uint64_t w = __bits_load_bytes(p + (at >> 3), (shift + n + 7) >> 3) >> shift;
+    return n == 64 ? w : w & ((1ull << n) - 1);
+}
+
+// the low n bits of v to bit at of p, the bits around them are kept
+static inline void bits_store(uint8_t *p, size_t at, uint64_t v, size_t n)
+{
+    const size_t shift = at & 7;
+    assert(shift + n <= 64);
+    const size_t n_bytes = (shift + n + 7) >> 3;
+    const uint64_t mask = (n == 64 ? ~0ull : (1ull << n) - 1) << shift;
+    const uint64_t w = __bits_load_bytes(p + (at >> 3), n_bytes);
+    __bits_store_bytes(p + (at >> 3), (w & ~mask) | ((v << shift) & mask), n_bytes);
+}
+
+// Copies len bits between any two bit offsets, a word at a time. The pieces
+// are cut so that neither side spans more than 8 bytes.
+static inline void bits_copy(uint8_t *dst, size_t dst_at, const uint8_t *src, size_t src_at, size_t len)
+{
+    while (len > 0)
+    {
+        const size_t skew = (dst_at & 7) > (src_at & 7) ? (dst_at & 7) : (src_at & 7);
+        const size_t n = len < 64 - skew ? len : 64 - skew;
+        bits_store(dst, dst_at, bits_load(src, src_at, n), n);
+        dst_at += n;
+        src_at += n;
+        len -= n;
+    }
+}
+
+void bit_vec_copy_bits(bit_vec *dst, size_t dst_at, const bit_vec *src, size_t src_at, size_t len)
+{
+    assert(dst_at + len <= dst->bit_count && src_at + len <= src->bit_count);
+    bits_copy((uint8_t *)dst->ptr, dst_at, (const uint8_t *)src->ptr, src_at, len);
 }
 
 typedef struct bit_mat
@@ -116,42 +196,103 @@ size_t *build_product_result(const bit_vec vec, size_t K)
     return res;
 }
 
-size_t hamming_calc_encoded_size(size_t bit_count)
+// parity bits of a code for N data bits: the least K with 2^K >= N + K + 1
+size_t hamming_calc_parity_for_data(size_t N)
 {
     size_t K = 1;
-    const size_t N = bit_count;
-
-    while (K != (size_t)ceil(log2(N + K + 1)))
+    while (((size_t)1 << K) < N + K + 1)
     {
         ++K;
     }
-    return bit_count + K;
+    return K;
 }
 
-bit_vec hamming_algo(const bit_vec vec)
+size_t hamming_calc_encoded_size(size_t bit_count)
 {
-    size_t K = 1;
-    const size_t N = vec.bit_count;
+    return bit_count + hamming_calc_parity_for_data(bit_count);
+}
 
-    while (K != (size_t)ceil(log2(N + K + 1)))
+// code bits 0..63 hold the parity bits 1, 2, 4, .., 64 and 57 data bits
+#define HAMMING_FIRST_WORD_DATA (~(uint64_t)((1ull << 0) | (1ull << 1) | (1ull << 3) | (1ull << 7) | (1ull << 15) | (1ull << 31) | (1ull << 63)))
+#define HAMMING_FIRST_WORD_DATA_BITS 57
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("bmi2"))) static inline uint64_t __hamming_pdep(uint64_t v, uint64_t mask)
+{
+    return _pdep_u64(v, mask);
+}
+
+__attribute__((target("bmi2"))) static inline uint64_t __hamming_pext(uint64_t v, uint64_t mask)
+{
+    return _pext_u64(v, mask);
+}
+
+static inline bool __hamming_has_bmi2(void)
+{
+    return __builtin_cpu_supports("bmi2");
+}
+#else
+static inline uint64_t __hamming_pdep(uint64_t v, uint64_t mask)
+{
+    (void)v;
+    (void)mask;
+    return 0;
+}
+
+static inline uint64_t __hamming_pext(uint64_t v, uint64_t mask)
+{
+    (void)v;
+    (void)mask;
+    return 0;
+}
+
+static inline bool __hamming_has_bmi2(void)
+{
+    return false;
+}
+#endif
+
+// Data bits [2^r - 1 - r, ...) go to the code bits between parity 2^r and
+// 2^(r+1), 2^r - 1 of them, the last run takes what is left. With BMI2 the
+// five short runs of the first code word are one PDEP.
+static inline __attribute__((always_inline)) void hamming_scatter_data(const uint8_t *data, uint8_t *code, const size_t N, const size_t K)
+{
+    size_t r = 1;
+    if (K > 6 && __hamming_has_bmi2())
     {
-        ++K;
+        bits_store(code, 0, __hamming_pdep(bits_load(data, 0, HAMMING_FIRST_WORD_DATA_BITS), HAMMING_FIRST_WORD_DATA), 64);
+        r = 6;
     }
+    for (; r < K; ++r)
+    {
+        const size_t from = ((size_t)1 << r) - 1 - r;
+        bits_copy(code, (size_t)1 << r, data, from, r + 1 < K ? ((size_t)1 << r) - 1 : N - from);
+    }
+}
 
-    bit_vec encode_vec = bit_vec_new(N + K);
-
-    for (size_t i = 0, j = 1, k = 0; i < encode_vec.bit_count; ++i)
+// the inverse of hamming_scatter_data, with PEXT for the first code word
+static inline __attribute__((always_inline)) void hamming_gather_data(const uint8_t *code, uint8_t *data, const size_t N, const size_t K)
+{
+    size_t r = 1;
+    if (K > 6 && __hamming_has_bmi2())
     {
-        if (i + 1 != j)
-        {
-            bit_vec_set_bit_at(&encode_vec, i, bit_vec_get_bit_at(&vec, k));
-            k += 1;
-        }
-        else
-        {
-            j *= 2;
-        }
+        bits_store(data, 0, __hamming_pext(bits_load(code, 0, 64), HAMMING_FIRST_WORD_DATA), HAMMING_FIRST_WORD_DATA_BITS);
+        r = 6;
     }
+    for (; r < K; ++r)
+    {
+        const size_t from = ((size_t)1 << r) - 1 - r;
+        bits_copy(data, from, code, (size_t)1 << r, r + 1 < K ? ((size_t)1 << r) - 1 : N - from);
+    }
+}
+
+bit_vec hamming_algo(const bit_vec vec)
+{
+    const size_t N = vec.bit_count;
+    const size_t K = hamming_calc_parity_for_data(N);
+
+    bit_vec encode_vec = bit_vec_new(N + K);
+    hamming_scatter_data((const uint8_t *)vec.ptr, (uint8_t *)encode_vec.ptr, N, K);
 
     size_t *control_bits = build_product_result(encode_vec, K);
     for (size_t m = 1, i = 0; i < K; m *= 2, ++i)
@@ -162,45 +303,81 @@ bit_vec hamming_algo(const bit_vec vec)
     return encode_vec;
 }
 
+// the least K with 2^K >= enc_bit_count + 1
+size_t hamming_calc_parity_count(size_t enc_bit_count)
+{
+    size_t K = 0;
+    while (((size_t)1 << K) < enc_bit_count + 1)
+    {
+        ++K;
+    }
+    return K;
+}
+
+// 0 for a clean code word, otherwise the 1-based position of the flipped bit
+// (or a value past the end when more than one bit is broken)
+size_t hamming_syndrome(const bit_vec vec)
+{
+    const size_t K = hamming_calc_parity_count(vec.bit_count);
+    size_t *control_bits = build_product_result(vec, K);
+    size_t syndrome = 0;
+    for (size_t i = 0; i < K; ++i)
+    {
+        syndrome |= control_bits[i] << i;
+    }
+    free(control_bits);
+    return syndrome;
+}
+
+bool is_power_of_two(size_t x)
+{
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+// index among the data bits of the 1-based code word position pos (not a parity position)
+size_t hamming_data_index(size_t pos)
+{
+    size_t parity_before = 0;
+    for (size_t m = 1; m <= pos; m *= 2)
+    {
+        ++parity_before;
+    }
+    return pos - 1 - parity_before;
+}
+
 typedef struct
 {
-    bool ok;
-    bit_vec vec;
+    bool ok;        // vec holds the original data
+    bool corrected; // one flipped bit was fixed on the way
+    size_t syndrome;
+    bit_vec vec; // data bits, as read when !ok
 } hamming_decode_res;
 
 hamming_decode_res hamming_decode(const bit_vec vec)
 {
-    const size_t K = (size_t)ceil(log2(vec.bit_count + 1));
+    const size_t K = hamming_calc_parity_count(vec.bit_count);
 
     const size_t N = vec.bit_count - K;
 
-    size_t *control_bits = build_product_result(vec, K);
+    const size_t syndrome = hamming_syndrome(vec);
 
-    for (size_t i = 0; i < K; ++i)
+    bit_vec decoded = bit_vec_new(N);
+    hamming_gather_data((const uint8_t *)vec.ptr, (uint8_t *)decoded.ptr, N, K);
+
+    if (syndrome == 0)
     {
-        if (control_bits[i] != 0)
-        {
-            free(control_bits);
-            return (hamming_decode_res){.ok = false, .vec = {0}};
-        }
+        return (hamming_decode_res){.ok = true, .vec = decoded};
     }
-
-    bit_vec decoded = bit_vec_new(N);
-    for (size_t m = 1, i = 0, j = 0; i < vec.bit_count; ++i)
+    if (syndrome > vec.bit_count)
     {
-        if (i + 1 != m)
-        {
-            bit_vec_set_bit_at(&decoded, j, bit_vec_get_bit_at(&vec, i));
-            j += 1;
-        }
-        else
-        {
-            m *= 2;
-        }
+        return (hamming_decode_res){.ok = false, .syndrome = syndrome, .vec = decoded};
     }
-    free(control_bits);
-
-    return (hamming_decode_res){.ok = true, .vec = decoded};
+    if (!is_power_of_two(syndrome))
+    {
+        size_t j = hamming_data_index(syndrome);
+        bit_vec_set_bit_at(&decoded, j, !bit_vec_get_bit_at(&decoded, j));
+    }
+    return (hamming_decode_res){.ok = true, .corrected = true, .syndrome = syndrome, .vec = decoded};
 }
 
 char *bit_vec_to_str(const bit_vec *vec)
@@ -217,15 +394,8 @@ char *bit_vec_to_str(const bit_vec *vec)
 bit_vec bit_vec_concat(const bit_vec lhs, const bit_vec rhs)
 {
     bit_vec new = bit_vec_new(lhs.bit_count + rhs.bit_count);
-    size_t new_i = 0;
-    for (size_t i = 0; i < lhs.bit_count; ++i, new_i += 1)
-    {
-        bit_vec_set_bit_at(&new, new_i, bit_vec_get_bit_at(&lhs, i));
-    }
-    for (size_t i = 0; i < rhs.bit_count; ++i, new_i += 1)
-    {
-        bit_vec_set_bit_at(&new, new_i, bit_vec_get_bit_at(&rhs, i));
-    }
+    bit_vec_copy_bits(&new, 0, &lhs, 0, lhs.bit_count);
+    bit_vec_copy_bits(&new, lhs.bit_count, &rhs, 0, rhs.bit_count);
     return new;
 }
 
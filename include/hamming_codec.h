@@ -0,0 +1,151 @@
+#ifndef HAMMING_CODEC_H
+#define HAMMING_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "hamming.h"
+
+// Whole-chunk codecs for the chunk sizes in common use. Within one of them the
+// code length, the parity count and the runs of data bits between the parity
+// positions are constants, so the compiler lays the loops out flat. The code
+// words are bit for bit those of hamming_algo: code position p (1-based) is
+// bit p - 1, LSB first, and the parity bits sit at the powers of two.
+// Other sizes, and the shorter last chunk of a member, use hamming_algo and
+// hamming_decode.
+
+typedef struct
+{
+    size_t bytes;    // data bytes of a chunk
+    size_t enc_bits; // code word length
+    void (*encode)(const uint8_t *src, uint8_t *dst);
+    size_t (*syndrome)(const uint8_t *enc);
+    void (*extract)(const uint8_t *enc, uint8_t *dst); // the data bits as stored
+} hamming_codec;
+
+// mask k has bit t set when bit k of the 1-based position t + 1 is, for t < 63
+static const uint64_t __hamming_pos_masks[6] = {
+    0x5555555555555555ull,
+    0x6666666666666666ull,
+    0x7878787878787878ull,
+    0x7f807f807f807f80ull,
+    0x7fff80007fff8000ull,
+    0x7fffffff80000000ull,
+};
+
+// XOR of the 1-based positions of the set bits of w, the word at bit base
+static inline size_t __hamming_word_syndrome(uint64_t w, size_t base)
+{
+    size_t s = 0;
+    for (int k = 0; k < 6; ++k)
+    {
+        s |= (size_t)(__builtin_popcountll(w & __hamming_pos_masks[k]) & 1) << k;
+    }
+    // below bit 63, base + t + 1 is base | (t + 1)
+    if (__builtin_popcountll(w & ~(1ull << 63)) & 1)
+    {
+        s ^= base;
+    }
+    if (w >> 63)
+    {
+        s ^= base + 64;
+    }
+    return s;
+}
+
+static inline __attribute__((always_inline)) size_t __hamming_syndrome_fixed(const uint8_t *enc, const size_t n_bits)
+{
+    size_t s = 0;
+    const size_t n_words = n_bits / 64;
+    for (size_t i = 0; i < n_words; ++i)
+    {
+        s ^= __hamming_word_syndrome(__bits_load_bytes(enc + 8 * i, 8), 64 * i);
+    }
+    if (n_bits % 64)
+    {
+        // padding bits of the last byte are not part of the code word
+        uint64_t w = __bits_load_bytes(enc + 8 * n_words, (n_bits % 64 + 7) / 8) & ((1ull << (n_bits % 64)) - 1);
+        s ^= __hamming_word_syndrome(w, 64 * n_words);
+    }
+    return s;
+}
+
+static inline __attribute__((always_inline)) void __hamming_encode_fixed(const uint8_t *src, uint8_t *dst, const size_t N, const size_t K)
+{
+    memset(dst, 0, (N + K + 7) / 8);
+    hamming_scatter_data(src, dst, N, K);
+    // with the parity bits still 0, bit i of the syndrome is what parity 2^i has to be
+    const size_t s = __hamming_syndrome_fixed(dst, N + K);
+    for (size_t i = 0; i < K; ++i)
+    {
+        const size_t at = ((size_t)1 << i) - 1;
+        dst[at / 8] |= ((s >> i) & 1) << (at % 8);
+    }
+}
+
+static inline __attribute__((always_inline)) void __hamming_extract_fixed(const uint8_t *enc, uint8_t *dst, const size_t N, const size_t K)
+{
+    hamming_gather_data(enc, dst, N, K);
+}
+
+// K is checked to be the parity count hamming_algo takes for BYTES-byte chunks
+#define HAMMING_CODEC_DEFINE(BYTES, K)                                                                                    \
+    static_assert(((size_t)1 << (K)) >= (BYTES) * 8 + (K) + 1 && ((size_t)1 << ((K) - 1)) < (BYTES) * 8 + (K),         \
+                  "wrong parity count for " #BYTES "-byte chunks");                                                     \
+    void hamming_encode_##BYTES(const uint8_t *src, uint8_t *dst) { __hamming_encode_fixed(src, dst, (BYTES) * 8, K); } \
+    size_t hamming_syndrome_##BYTES(const uint8_t *enc) { return __hamming_syndrome_fixed(enc, (BYTES) * 8 + (K)); }  \
+    void hamming_extract_##BYTES(const uint8_t *enc, uint8_t *dst) { __hamming_extract_fixed(enc, dst, (BYTES) * 8, K); }
+
+#define HAMMING_CODEC_ENTRY(BYTES, K) {(BYTES), (BYTES) * 8 + (K), hamming_encode_##BYTES, hamming_syndrome_##BYTES, hamming_extract_##BYTES}
+
+HAMMING_CODEC_DEFINE(64, 10)
+HAMMING_CODEC_DEFINE(100, 10)
+HAMMING_CODEC_DEFINE(256, 12)
+HAMMING_CODEC_DEFINE(512, 13)
+HAMMING_CODEC_DEFINE(4096, 16)
+
+static const hamming_codec hamming_codecs[] = {
+    HAMMING_CODEC_ENTRY(64, 10),
+    HAMMING_CODEC_ENTRY(100, 10),
+    HAMMING_CODEC_ENTRY(256, 12),
+    HAMMING_CODEC_ENTRY(512, 13),
+    HAMMING_CODEC_ENTRY(4096, 16),
+};
+
+// the codec for whole chunks of bytes, NULL if the size has none
+const hamming_codec *hamming_codec_find(size_t bytes)
+{
+    for (size_t i = 0; i < sizeof(hamming_codecs) / sizeof(hamming_codecs[0]); ++i)
+    {
+        if (hamming_codecs[i].bytes == bytes)
+        {
+            return &hamming_codecs[i];
+        }
+    }
+    return NULL;
+}
+
+// hamming_decode of one whole chunk, the data bits go to dst and vec stays empty
+hamming_decode_res hamming_codec_decode(const hamming_codec *codec, const uint8_t *enc, uint8_t *dst)
+{
+    const size_t syndrome = codec->syndrome(enc);
+    codec->extract(enc, dst);
+    if (syndrome == 0)
+    {
+        return (hamming_decode_res){.ok = true};
+    }
+    if (syndrome > codec->enc_bits)
+    {
+        return (hamming_decode_res){.ok = false, .syndrome = syndrome};
+    }
+    if (!is_power_of_two(syndrome))
+    {
+        const size_t j = hamming_data_index(syndrome);
+        dst[j / 8] ^= 1 << (j % 8);
+    }
+    return (hamming_decode_res){.ok = true, .corrected = true, .syndrome = syndrome};
+}
+
+#endif
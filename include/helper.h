@@ -7,11 +7,11 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
 
 #include <unistd.h>
 
-#define _XOPEN_SOURCE 500
-#undef __USE_FILE_OFFSET64
 #include <ftw.h>
 
 #define COUNT_OF(x) ((sizeof(x) / sizeof(0 [x])) / ((size_t)(!(sizeof(x) % sizeof(0 [x])))))
@@ -38,110 +38,381 @@ char *get_clean_filename(const char *str)
     return buf == NULL ? (char *)str : buf + 1;
 }
 
-size_t file_size(FILE *f)
+// last component of a directory path without trailing slashes, "" for ".", ".." and "/"
+char *get_clean_dirname(const char *path)
 {
-    size_t init = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    size_t l = ftell(f);
-    fseek(f, 0, SEEK_END);
-    size_t r = ftell(f);
-    fseek(f, init, SEEK_SET);
-    return r - l;
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+    {
+        --len;
+    }
+    size_t begin = len;
+    while (begin > 0 && path[begin - 1] != '/')
+    {
+        --begin;
+    }
+    char *name = strndup(path + begin, len - begin);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, "/") == 0)
+    {
+        name[0] = '\0';
+    }
+    return name;
 }
 
-void file_write_pos(int64_t pos, const void *restrict data, size_t data_size, FILE *restrict f)
+char *path_join_alloc(const char *dir, const char *filename)
 {
-    if (fseek(f, pos, SEEK_SET))
+    size_t dir_len = strlen(dir);
+    size_t len = dir_len + strlen(filename) + 2;
+    char *dst = malloc(len);
+    snprintf(dst, len, (dir_len > 0 && dir[dir_len - 1] == '/') ? "%s%s" : "%s/%s", dir, filename);
+    return dst;
+}
+
+// rejects absolute member names and ones escaping the destination with ".."
+bool is_safe_relative_path(const char *path)
+{
+    if (path[0] == '\0' || path[0] == '/')
     {
-        assert("fseek(f, pos, SEEK_SET)" && false);
+        return false;
     }
-    if (fwrite(data, data_size, 1, f) != 1)
+    for (const char *p = path; p; p = strchr(p, '/'), p = p ? p + 1 : NULL)
     {
-        assert(false && "fwrite(shift_buf, n_shift, 1, f) != 1");
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+        {
+            return false;
+        }
     }
+    return true;
 }
 
-void file_read_pos(int64_t pos, void *dst, size_t data_size, FILE *f)
+// creates every missing directory on the way to the file at path
+void mkdir_parents(const char *path)
 {
-    if (fseek(f, pos, SEEK_SET))
+    char *buf = strdup(path);
+    for (char *p = strchr(buf + 1, '/'); p; p = strchr(p + 1, '/'))
     {
-        assert("fseek(f, pos, SEEK_SET)" && false);
+        *p = '\0';
+        mkdir_if_no(buf);
+        *p = '/';
     }
-    if (fread(dst, data_size, 1, f) != 1)
+    free(buf);
+}
+
+// modification time in nanoseconds since the epoch
+int64_t stat_mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000ll + st->st_mtim.tv_nsec;
+}
+
+#define CONTENT_HASH_INIT 0xcbf29ce484222325ull
+
+// FNV-1a over a byte range, continued from h
+uint64_t content_hash_update(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i)
     {
-        assert(false && "fwrite(shift_buf, n_shift, 1, f) != 1");
+        h ^= p[i];
+        h *= 0x100000001b3ull;
     }
+    return h;
 }
 
-#define SHIFT_CHUNK_SIZE 100ll
-void right_shift_file(int64_t end_off, int64_t start_off, int64_t n_shift, FILE *restrict f)
+// splitmix64 finalizer, every input bit reaches every output bit
+uint64_t hash_mix64(uint64_t x)
 {
-#define DEBUG
-#undef DEBUG
-#ifdef DEBUG
-    void *p = malloc(end_off - start_off);
-    file_read_pos(start_off, p, end_off - start_off, f);
-#endif
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
 
-    assert(end_off > start_off);
+// false if fewer than len bytes could be read, the file may have shrunk since it was stat'ed
+bool content_hash_stream(FILE *f, size_t len, uint64_t *hash)
+{
+    char buf[4096];
+    uint64_t h = CONTENT_HASH_INIT;
+    while (len > 0)
+    {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (fread(buf, 1, n, f) != n)
+        {
+            return false;
+        }
+        h = content_hash_update(h, buf, n);
+        len -= n;
+    }
+    *hash = h;
+    return true;
+}
 
-    char buf[SHIFT_CHUNK_SIZE] = {0};
+typedef struct
+{
+    uint8_t *ptr;
+    size_t len;
+    size_t cap;
+} byte_buf;
 
-    for (int64_t i = 0; i <= n_shift / SHIFT_CHUNK_SIZE; ++i)
+void byte_buf_reserve(byte_buf *buf, size_t extra)
+{
+    if (buf->len + extra > buf->cap)
     {
-        file_write_pos(end_off + i * SHIFT_CHUNK_SIZE, buf, SHIFT_CHUNK_SIZE, f);
+        buf->cap = buf->cap * 2 > buf->len + extra ? buf->cap * 2 : buf->len + extra + 256;
+        buf->ptr = realloc(buf->ptr, buf->cap);
     }
+}
+
+void byte_buf_push(byte_buf *buf, const void *data, size_t len)
+{
+    byte_buf_reserve(buf, len);
+    memcpy(buf->ptr + buf->len, data, len);
+    buf->len += len;
+}
 
-    for (int64_t chunk_counter = 1; chunk_counter <= (end_off - start_off) / SHIFT_CHUNK_SIZE; ++chunk_counter)
+void byte_buf_close(byte_buf *buf)
+{
+    free(buf->ptr);
+    *buf = (byte_buf){0};
+}
+
+// LEB128: 7 bits per byte, high bit set on all but the last byte
+void varint_push(byte_buf *buf, uint64_t v)
+{
+    byte_buf_reserve(buf, 10);
+    while (v >= 0x80)
     {
-        int64_t pos = end_off - chunk_counter * SHIFT_CHUNK_SIZE;
-        file_read_pos(pos, buf, SHIFT_CHUNK_SIZE, f);
-        file_write_pos(n_shift + pos, buf, SHIFT_CHUNK_SIZE, f);
+        buf->ptr[buf->len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
     }
-    int64_t rest_size = (end_off - start_off) % SHIFT_CHUNK_SIZE;
-    if (rest_size == 0)
+    buf->ptr[buf->len++] = (uint8_t)v;
+}
+
+bool varint_read(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    *v = 0;
+    for (unsigned shift = 0; *p < end && shift < 64; shift += 7)
     {
-        return;
+        uint8_t b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            return true;
+        }
     }
+    return false;
+}
 
-    int64_t pos = start_off;
-    file_read_pos(pos, buf, rest_size, f);
-    file_write_pos(n_shift + pos, buf, rest_size, f);
+uint64_t zigzag_encode(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
 
-#ifdef DEBUG
-    void *s = malloc(end_off - start_off);
-    file_read_pos(start_off + n_shift, s, end_off - start_off, f);
+int64_t zigzag_decode(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
 
-    assert(memcmp(p, s, end_off - start_off) == 0);
+void le64_push(byte_buf *buf, uint64_t v)
+{
+    uint8_t b[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        b[i] = (uint8_t)(v >> (8 * i));
+    }
+    byte_buf_push(buf, b, 8);
+}
 
-    free(p);
-    free(s);
-#endif
+bool le64_read(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    if (end - *p < 8)
+    {
+        return false;
+    }
+    *v = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        *v |= (uint64_t)(*p)[i] << (8 * i);
+    }
+    *p += 8;
+    return true;
 }
 
-void left_shift_file(int64_t end_off, int64_t start_off, int64_t n_shift, FILE *restrict f)
+void le32_push(byte_buf *buf, uint32_t v)
 {
+    uint8_t b[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        b[i] = (uint8_t)(v >> (8 * i));
+    }
+    byte_buf_push(buf, b, 4);
+}
 
-    char buf[SHIFT_CHUNK_SIZE] = {0};
+bool le32_read(const uint8_t **p, const uint8_t *end, uint32_t *v)
+{
+    if (end - *p < 4)
+    {
+        return false;
+    }
+    *v = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        *v |= (uint32_t)(*p)[i] << (8 * i);
+    }
+    *p += 4;
+    return true;
+}
 
-    assert(end_off > start_off);
-    assert(start_off >= n_shift);
+// --max-memory: a budget in bytes for what an operation holds at once, 0 for
+// no limit. Buffers and worker counts are sized to fit what is left of it.
 
-    for (int64_t chunk_counter = 0; chunk_counter < (end_off - start_off) / SHIFT_CHUNK_SIZE; ++chunk_counter)
+// how many workers of per_worker bytes each fit the budget, from 1 to max
+size_t budget_workers(size_t budget, size_t per_worker, size_t max)
+{
+    if (budget == 0 || per_worker == 0)
     {
-        int64_t pos = start_off + chunk_counter * SHIFT_CHUNK_SIZE;
-        file_read_pos(pos, buf, SHIFT_CHUNK_SIZE, f);
-        file_write_pos(-n_shift + pos, buf, SHIFT_CHUNK_SIZE, f);
+        return max;
     }
-    int64_t rest_size = (end_off - start_off) % SHIFT_CHUNK_SIZE;
-    if (rest_size == 0)
+    const size_t n = budget / per_worker;
+    return n < 1 ? 1 : (n > max ? max : n);
+}
+
+// want bytes, or the budget when it is smaller, but never below min
+size_t budget_buffer(size_t budget, size_t want, size_t min)
+{
+    if (budget == 0 || want <= budget)
     {
-        return;
+        return want;
     }
+    return budget > min ? budget : min;
+}
 
-    int64_t pos = end_off - (end_off - start_off) % SHIFT_CHUNK_SIZE;
-    file_read_pos(pos, buf, rest_size, f);
-    file_write_pos(-n_shift + pos, buf, rest_size, f);
+// Parses a byte count with an optional K, M or G suffix (powers of 1024), false on anything else
+bool parse_size(const char *str, size_t *dst)
+{
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(str, &end, 10);
+    if (end == str || errno || str[0] == '-')
+    {
+        return false;
+    }
+    int shift = 0;
+    switch (*end)
+    {
+    case 'K':
+    case 'k':
+        shift = 10;
+        break;
+    case 'M':
+    case 'm':
+        shift = 20;
+        break;
+    case 'G':
+    case 'g':
+        shift = 30;
+        break;
+    case '\0':
+        break;
+    default:
+        return false;
+    }
+    if (shift && end[1] != '\0')
+    {
+        return false;
+    }
+    if (v > (SIZE_MAX >> shift))
+    {
+        return false;
+    }
+    *dst = (size_t)v << shift;
+    return true;
+}
+
+// Forward-only buffered reader over [pos, end) of a descriptor, never touches the file position
+typedef struct
+{
+    int fd;
+    int64_t pos;
+    int64_t end;
+    uint8_t *buf;
+    size_t cap;
+    size_t head;
+    size_t len;
+} file_cursor;
+
+file_cursor file_cursor_open(int fd, int64_t pos, int64_t end, size_t cap)
+{
+    return (file_cursor){.fd = fd, .pos = pos, .end = end, .buf = malloc(cap), .cap = cap};
+}
+
+// makes at least n bytes (or everything left before end) available at buf + head
+size_t file_cursor_fill(file_cursor *c, size_t n)
+{
+    if (c->len - c->head >= n)
+    {
+        return c->len - c->head;
+    }
+    memmove(c->buf, c->buf + c->head, c->len - c->head);
+    c->len -= c->head;
+    c->head = 0;
+    while (c->len < c->cap && c->pos < c->end)
+    {
+        size_t want = c->cap - c->len;
+        if ((int64_t)want > c->end - c->pos)
+        {
+            want = c->end - c->pos;
+        }
+        ssize_t got = pread(c->fd, c->buf + c->len, want, c->pos);
+        if (got <= 0)
+        {
+            break;
+        }
+        c->len += got;
+        c->pos += got;
+    }
+    return c->len - c->head;
+}
+
+void file_cursor_close(file_cursor *c)
+{
+    free(c->buf);
+    *c = (file_cursor){0};
+}
+
+size_t file_size(FILE *f)
+{
+    size_t init = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    size_t l = ftell(f);
+    fseek(f, 0, SEEK_END);
+    size_t r = ftell(f);
+    fseek(f, init, SEEK_SET);
+    return r - l;
+}
+
+void file_write_pos(int64_t pos, const void *restrict data, size_t data_size, FILE *restrict f)
+{
+    if (fseek(f, pos, SEEK_SET))
+    {
+        assert("fseek(f, pos, SEEK_SET)" && false);
+    }
+    if (fwrite(data, data_size, 1, f) != 1)
+    {
+        assert(false && "fwrite(shift_buf, n_shift, 1, f) != 1");
+    }
+}
+
+void file_read_pos(int64_t pos, void *dst, size_t data_size, FILE *f)
+{
+    if (fseek(f, pos, SEEK_SET))
+    {
+        assert("fseek(f, pos, SEEK_SET)" && false);
+    }
+    if (fread(dst, data_size, 1, f) != 1)
+    {
+        assert(false && "fwrite(shift_buf, n_shift, 1, f) != 1");
+    }
 }
 
 void make_unique_filename(char *name)
@@ -158,6 +429,9 @@ void make_unique_filename(char *name)
 
 int unlink_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
 {
+    (void)sb;
+    (void)typeflag;
+    (void)ftwbuf;
     int rv = remove(fpath);
 
     if (rv)
@@ -168,7 +442,7 @@ int unlink_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW
 
 int rmrf(const char *path)
 {
-    return ftw(path, unlink_cb, FTW_F);
+    return nftw(path, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
 }
 
 #endif
\ No newline at end of file
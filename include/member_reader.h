@@ -0,0 +1,463 @@
+#ifndef MEMBER_READER_H
+#define MEMBER_READER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "encoding_decoding.h"
+
+// Pull-based reader of one encoded member: chunks are decoded in batches of
+// about MEMBER_READER_BATCH_SIZE bytes when read() gets to them, and the
+// batch after the current one is decoded on a background thread meanwhile.
+// Memory stays at two batches whatever the member size. With parity a batch
+// is one parity group, so lost chunks are rebuilt as they are read.
+#define MEMBER_READER_BATCH_SIZE (1024 * 1024)
+
+// The hash tree stored after an encoded member (see merkle.h). Nodes are
+// decoded on demand, each checked against its parent on the way down from
+// the root, so a leaf costs O(log n) of them. The nodes on the way to the
+// last leaf asked for are kept, neighbouring leaves mostly need none read.
+typedef struct
+{
+    int fd;
+    int64_t offset; // of the encoded nodes
+    size_t init_size;
+    size_t n_leaves;
+    config cnf;
+    uint8_t root[BLAKE3_OUT_LEN];
+
+    size_t path_len;
+    size_t path_at[MERKLE_MAX_DEPTH]; // pre-order index of the node kept at each depth
+    uint8_t path[MERKLE_MAX_DEPTH][MERKLE_NODE_SIZE];
+    bool broken; // a node could not be decoded or did not match
+} member_tree;
+
+member_tree member_tree_open(int fd, int64_t member_offset, size_t init_size, size_t name_len, config cnf, const uint8_t root[BLAKE3_OUT_LEN])
+{
+    member_tree t = {
+        .fd = fd,
+        .offset = member_offset + calc_member_tree_offset(init_size, name_len, cnf),
+        .init_size = init_size,
+        .n_leaves = merkle_leaf_count(init_size),
+        .cnf = cnf,
+    };
+    memcpy(t.root, root, BLAKE3_OUT_LEN);
+    return t;
+}
+
+bool __member_tree_read_node(const member_tree *t, size_t i, uint8_t node[MERKLE_NODE_SIZE])
+{
+    const config cnf = t->cnf;
+    chunk_cursor c = chunk_cursor_open(t->fd, t->offset, -1, merkle_tree_size(t->init_size), i * MERKLE_NODE_SIZE, cnf,
+                                       (MERKLE_NODE_SIZE / cnf.BYTES_per_chunk + 2) * cnf.enc_BYTES_per_chunk);
+    const bool ok = chunk_cursor_fill(&c, MERKLE_NODE_SIZE) >= MERKLE_NODE_SIZE && !c.failed;
+    if (ok)
+    {
+        memcpy(node, c.buf + c.head, MERKLE_NODE_SIZE);
+    }
+    chunk_cursor_close(&c);
+    return ok;
+}
+
+// What leaf has to hash to, as merkle_leaf_hash gives it. False when the
+// nodes on the way to it can not be read or do not check out.
+bool member_tree_expect(member_tree *t, size_t leaf, uint8_t out[BLAKE3_OUT_LEN])
+{
+    uint8_t expect[BLAKE3_OUT_LEN];
+    memcpy(expect, t->root, BLAKE3_OUT_LEN);
+    size_t i = 0, lo = 0, n = t->n_leaves;
+    for (size_t d = 0; n > 1; ++d)
+    {
+        // a pre-order index tells the node and the way to it, so a kept one is checked already
+        if (d >= t->path_len || t->path_at[d] != i)
+        {
+            uint8_t node[MERKLE_NODE_SIZE], got[BLAKE3_OUT_LEN];
+            t->path_len = d;
+            if (!__member_tree_read_node(t, i, node))
+            {
+                t->broken = true;
+                return false;
+            }
+            const blake3_output o = blake3_parent(node, node + BLAKE3_OUT_LEN);
+            if (d == 0)
+            {
+                blake3_output_root(&o, got);
+            }
+            else
+            {
+                blake3_output_cv(&o, got);
+            }
+            if (memcmp(got, expect, BLAKE3_OUT_LEN) != 0)
+            {
+                t->broken = true;
+                return false;
+            }
+            memcpy(t->path[d], node, MERKLE_NODE_SIZE);
+            t->path_at[d] = i;
+            t->path_len = d + 1;
+        }
+        // the left subtree follows its parent, the right one follows the left subtree
+        const size_t p = merkle_left_leaves(n);
+        if (leaf - lo < p)
+        {
+            memcpy(expect, t->path[d], BLAKE3_OUT_LEN);
+            i += 1;
+            n = p;
+        }
+        else
+        {
+            memcpy(expect, t->path[d] + BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+            i += p;
+            lo += p;
+            n -= p;
+        }
+    }
+    memcpy(out, expect, BLAKE3_OUT_LEN);
+    return true;
+}
+
+// Checks the decoded bytes of leaf, merkle_leaf_bytes of them at src
+bool member_tree_check_leaf(member_tree *t, size_t leaf, const uint8_t *src)
+{
+    uint8_t expect[BLAKE3_OUT_LEN], got[BLAKE3_OUT_LEN];
+    if (!member_tree_expect(t, leaf, expect))
+    {
+        return false;
+    }
+    merkle_leaf_hash(src, merkle_leaf_bytes(t->init_size, leaf), leaf, t->n_leaves, got);
+    return memcmp(expect, got, BLAKE3_OUT_LEN) == 0;
+}
+
+typedef struct
+{
+    size_t index; // which batch data holds
+    uint8_t *data;
+    size_t len;
+    uint8_t *raw;
+    size_t raw_cap;
+    decode_stats stats;
+    bool io_failed;
+} member_batch;
+
+typedef enum
+{
+    PREFETCH_IDLE,
+    PREFETCH_QUEUED, // the thread owns next until it is DONE
+    PREFETCH_DONE,
+} prefetch_state;
+
+typedef struct
+{
+    int fd;
+    int64_t offset; // of the encoded member
+    size_t init_size;
+    size_t name_len;
+    config cnf;
+    bool no_cache;
+
+    size_t chunks_per_batch;
+    size_t n_batches;
+    size_t pos;
+
+    member_batch cur;
+    bool cur_valid;
+    member_batch next;
+
+    bool threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    prefetch_state state;
+    bool stop;
+
+    decode_stats stats; // of the batches handed out so far, each counted once
+    uint8_t *counted;   // bit per batch, set once its stats are in stats
+    bool io_failed;
+
+    // with member_reader_check_tree, bytes are handed out a checked leaf at a time
+    member_tree *tree;
+    uint8_t *leaf;
+    size_t leaf_index; // which leaf holds, SIZE_MAX for none
+    size_t mismatched; // leaves that did not match the tree
+} member_reader;
+
+// Reads and decodes batch dst->index into dst, uncorrectable chunks are kept as read like do_file_decoding does
+void __member_batch_decode(const member_reader *r, member_batch *dst)
+{
+    const size_t b = dst->index;
+    const config cnf = r->cnf;
+    const size_t n_chunks = calc_chunk_count(r->init_size, cnf);
+    const size_t first = b * r->chunks_per_batch;
+    const size_t last = first + r->chunks_per_batch < n_chunks ? first + r->chunks_per_batch : n_chunks;
+
+    // markers inside the batch are read along and stepped over, with parity a batch is a group and its record
+    size_t raw_start = calc_chunk_enc_offset(first, r->name_len, cnf);
+    size_t raw_end = calc_chunk_enc_offset(last - 1, r->name_len, cnf) + (calc_chunk_enc_bits(r->init_size, last - 1, cnf) + BITS_IN_BYTE - 1) / BITS_IN_BYTE;
+    size_t record_at;
+    if (cnf.parity_count)
+    {
+        calc_parity_span(r->init_size, b, r->name_len, cnf, &raw_start, &record_at, &raw_end);
+    }
+    if (raw_end - raw_start > dst->raw_cap)
+    {
+        dst->raw_cap = raw_end - raw_start;
+        dst->raw = realloc(dst->raw, dst->raw_cap);
+    }
+
+    dst->stats = (decode_stats){0};
+    dst->len = (last - first) * cnf.BYTES_per_chunk;
+    if (last == n_chunks)
+    {
+        dst->len = r->init_size - first * cnf.BYTES_per_chunk;
+    }
+    dst->io_failed = pread(r->fd, dst->raw, raw_end - raw_start, r->offset + raw_start) != (ssize_t)(raw_end - raw_start);
+    if (dst->io_failed)
+    {
+        memset(dst->data, 0, dst->len);
+        return;
+    }
+    if (r->no_cache)
+    {
+        posix_fadvise(r->fd, r->offset + raw_start, raw_end - raw_start, POSIX_FADV_DONTNEED);
+    }
+
+    if (cnf.parity_count)
+    {
+        dst->stats = decode_parity_group(dst->raw, r->init_size, r->name_len, b, dst->data, NULL, cnf);
+        return;
+    }
+    for (size_t j = first; j < last; ++j)
+    {
+        const uint8_t *enc = dst->raw + calc_chunk_enc_offset(j, r->name_len, cnf) - raw_start;
+        hamming_decode_res res = decode_chunk_to(enc, r->init_size, j, dst->data + (j - first) * cnf.BYTES_per_chunk, cnf);
+        dst->stats.chunks += 1;
+        dst->stats.corrected += res.ok && res.corrected;
+        dst->stats.failed += !res.ok;
+    }
+}
+
+void *__member_reader_thread(void *arg)
+{
+    member_reader *r = arg;
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop)
+    {
+        if (r->state != PREFETCH_QUEUED)
+        {
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&r->lock);
+        __member_batch_decode(r, &r->next);
+        pthread_mutex_lock(&r->lock);
+        r->state = PREFETCH_DONE;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// with the lock held: waits until the thread is done with next
+void __member_reader_wait_idle(member_reader *r)
+{
+    while (r->state == PREFETCH_QUEUED)
+    {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+}
+
+// Makes batch b the current one, taking it from the prefetch when it is there
+void __member_reader_load(member_reader *r, size_t b)
+{
+    if (r->cur_valid && r->cur.index == b)
+    {
+        return;
+    }
+    bool prefetched = false;
+    if (r->threaded)
+    {
+        pthread_mutex_lock(&r->lock);
+        if (r->state != PREFETCH_IDLE && r->next.index == b)
+        {
+            __member_reader_wait_idle(r);
+            member_batch tmp = r->cur;
+            r->cur = r->next;
+            r->next = tmp;
+            prefetched = true;
+        }
+        __member_reader_wait_idle(r);
+        r->state = PREFETCH_IDLE;
+        pthread_mutex_unlock(&r->lock);
+    }
+    if (!prefetched)
+    {
+        r->cur.index = b;
+        __member_batch_decode(r, &r->cur);
+    }
+    r->cur_valid = true;
+    // a seek back decodes a batch again, its chunks are the same ones
+    if (!(r->counted[b / BITS_IN_BYTE] >> (b % BITS_IN_BYTE) & 1))
+    {
+        r->counted[b / BITS_IN_BYTE] |= 1 << (b % BITS_IN_BYTE);
+        r->stats.chunks += r->cur.stats.chunks;
+        r->stats.corrected += r->cur.stats.corrected;
+        r->stats.failed += r->cur.stats.failed;
+    }
+    r->io_failed |= r->cur.io_failed;
+
+    if (r->threaded && b + 1 < r->n_batches)
+    {
+        pthread_mutex_lock(&r->lock);
+        r->next.index = b + 1;
+        r->state = PREFETCH_QUEUED;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+// The member is init_size source bytes encoded at offset of fd. fd must not
+// be written to while the reader is open. Without prefetch no thread is started.
+member_reader *member_reader_open(int fd, int64_t offset, size_t init_size, size_t name_len, config cnf, bool prefetch)
+{
+    member_reader *r = calloc(1, sizeof(member_reader));
+    r->fd = fd;
+    r->offset = offset;
+    r->init_size = init_size;
+    r->name_len = name_len;
+    r->cnf = cnf;
+    r->chunks_per_batch = cnf.parity_count ? calc_parity_group_chunks(cnf) : MEMBER_READER_BATCH_SIZE / cnf.BYTES_per_chunk;
+    if (r->chunks_per_batch == 0)
+    {
+        r->chunks_per_batch = 1;
+    }
+    r->n_batches = (calc_chunk_count(init_size, cnf) + r->chunks_per_batch - 1) / r->chunks_per_batch;
+    r->counted = calloc(r->n_batches / BITS_IN_BYTE + 1, 1);
+
+    const size_t batch_bytes = r->chunks_per_batch * cnf.BYTES_per_chunk;
+    r->cur.data = malloc(batch_bytes);
+    r->threaded = prefetch && r->n_batches > 1;
+    if (r->threaded)
+    {
+        r->next.data = malloc(batch_bytes);
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_cond_init(&r->cond, NULL);
+        if (pthread_create(&r->thread, NULL, __member_reader_thread, r))
+        {
+            pthread_mutex_destroy(&r->lock);
+            pthread_cond_destroy(&r->cond);
+            r->threaded = false;
+        }
+    }
+    return r;
+}
+
+// Copies up to n decoded bytes from pos to dst, the count copied or -1 if the archive could not be read
+ssize_t __member_reader_copy(member_reader *r, size_t pos, uint8_t *dst, size_t n)
+{
+    const size_t batch_bytes = r->chunks_per_batch * r->cnf.BYTES_per_chunk;
+    size_t done = 0;
+    while (done < n && pos < r->init_size)
+    {
+        __member_reader_load(r, pos / batch_bytes);
+        if (r->cur.io_failed)
+        {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        const size_t at = pos - r->cur.index * batch_bytes;
+        const size_t len = r->cur.len - at < n - done ? r->cur.len - at : n - done;
+        memcpy(dst + done, r->cur.data + at, len);
+        done += len;
+        pos += len;
+    }
+    return done;
+}
+
+// From now on every leaf is checked against the tree before any byte of it
+// is handed out, one that does not match fails the read. The reader owns tree.
+void member_reader_check_tree(member_reader *r, member_tree *tree)
+{
+    r->tree = tree;
+    r->leaf = malloc(MERKLE_LEAF_SIZE);
+    r->leaf_index = SIZE_MAX;
+}
+
+// Copies up to n decoded bytes from the current position to dst, 0 at the end, -1 if the archive could not be read
+ssize_t member_reader_read(member_reader *r, void *dst, size_t n)
+{
+    if (!r->tree)
+    {
+        const ssize_t done = __member_reader_copy(r, r->pos, dst, n);
+        r->pos += done > 0 ? (size_t)done : 0;
+        return done;
+    }
+    size_t done = 0;
+    while (done < n && r->pos < r->init_size)
+    {
+        const size_t leaf = r->pos / MERKLE_LEAF_SIZE, bytes = merkle_leaf_bytes(r->init_size, leaf);
+        if (r->leaf_index != leaf)
+        {
+            if (__member_reader_copy(r, leaf * MERKLE_LEAF_SIZE, r->leaf, bytes) != (ssize_t)bytes)
+            {
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            if (!member_tree_check_leaf(r->tree, leaf, r->leaf))
+            {
+                r->mismatched += 1;
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            r->leaf_index = leaf;
+        }
+        const size_t at = r->pos - leaf * MERKLE_LEAF_SIZE;
+        const size_t len = bytes - at < n - done ? bytes - at : n - done;
+        memcpy((uint8_t *)dst + done, r->leaf + at, len);
+        done += len;
+        r->pos += len;
+    }
+    return done;
+}
+
+// whence as for lseek, the position may be past the end; -1 if it would be negative
+int64_t member_reader_seek(member_reader *r, int64_t offset, int whence)
+{
+    const int64_t base = whence == SEEK_SET ? 0 : (whence == SEEK_CUR ? (int64_t)r->pos : (int64_t)r->init_size);
+    if (base + offset < 0)
+    {
+        return -1;
+    }
+    r->pos = base + offset;
+    return r->pos;
+}
+
+void member_reader_close(member_reader *r)
+{
+    if (!r)
+    {
+        return;
+    }
+    if (r->threaded)
+    {
+        pthread_mutex_lock(&r->lock);
+        r->stop = true;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->thread, NULL);
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+    }
+    free(r->cur.data);
+    free(r->cur.raw);
+    free(r->next.data);
+    free(r->next.raw);
+    free(r->counted);
+    free(r->tree);
+    free(r->leaf);
+    free(r);
+}
+
+#endif
@@ -0,0 +1,368 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#include "helper.h"
+
+// BLAKE3, portable, unkeyed, 32-byte output. It hashes its input as a
+// binary tree of 1 KiB chunks whose left subtree is always the largest power
+// of two of chunks, so every aligned run of MERKLE_LEAF_SIZE bytes is a
+// subtree of its own. A member tree keeps the chaining values above those
+// leaves, and its root is the BLAKE3 hash of the whole member: b3sum gives
+// the same one.
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+
+#define BLAKE3_CHUNK_START (1u << 0)
+#define BLAKE3_CHUNK_END (1u << 1)
+#define BLAKE3_PARENT (1u << 2)
+#define BLAKE3_ROOT (1u << 3)
+
+static const uint32_t BLAKE3_IV[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+static const uint8_t BLAKE3_MSG_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+uint32_t __blake3_rotr(uint32_t x, int n)
+{
+    return x >> n | x << (32 - n);
+}
+
+void __blake3_g(uint32_t *s, size_t a, size_t b, size_t c, size_t d, uint32_t x, uint32_t y)
+{
+    s[a] += s[b] + x;
+    s[d] = __blake3_rotr(s[d] ^ s[a], 16);
+    s[c] += s[d];
+    s[b] = __blake3_rotr(s[b] ^ s[c], 12);
+    s[a] += s[b] + y;
+    s[d] = __blake3_rotr(s[d] ^ s[a], 8);
+    s[c] += s[d];
+    s[b] = __blake3_rotr(s[b] ^ s[c], 7);
+}
+
+// The compression function: cv and a block of block_len bytes into 16 words
+void blake3_compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint32_t block_len, uint64_t counter, uint32_t flags, uint32_t out[16])
+{
+    uint32_t m[16];
+    for (size_t i = 0; i < 16; ++i)
+    {
+        m[i] = (uint32_t)block[4 * i] | (uint32_t)block[4 * i + 1] << 8 | (uint32_t)block[4 * i + 2] << 16 | (uint32_t)block[4 * i + 3] << 24;
+    }
+    uint32_t s[16] = {cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+                      BLAKE3_IV[0], BLAKE3_IV[1], BLAKE3_IV[2], BLAKE3_IV[3], (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags};
+    for (size_t r = 0; r < 7; ++r)
+    {
+        const uint8_t *p = BLAKE3_MSG_SCHEDULE[r];
+        __blake3_g(s, 0, 4, 8, 12, m[p[0]], m[p[1]]);
+        __blake3_g(s, 1, 5, 9, 13, m[p[2]], m[p[3]]);
+        __blake3_g(s, 2, 6, 10, 14, m[p[4]], m[p[5]]);
+        __blake3_g(s, 3, 7, 11, 15, m[p[6]], m[p[7]]);
+        __blake3_g(s, 0, 5, 10, 15, m[p[8]], m[p[9]]);
+        __blake3_g(s, 1, 6, 11, 12, m[p[10]], m[p[11]]);
+        __blake3_g(s, 2, 7, 8, 13, m[p[12]], m[p[13]]);
+        __blake3_g(s, 3, 4, 9, 14, m[p[14]], m[p[15]]);
+    }
+    for (size_t i = 0; i < 8; ++i)
+    {
+        out[i] = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+void __blake3_store_cv(const uint32_t words[8], uint8_t out[BLAKE3_OUT_LEN])
+{
+    for (size_t i = 0; i < 8; ++i)
+    {
+        for (size_t k = 0; k < 4; ++k)
+        {
+            out[4 * i + k] = words[i] >> (8 * k);
+        }
+    }
+}
+
+// A node whose last compression is not done yet: it gives a chaining value,
+// or with the ROOT flag the hash
+typedef struct
+{
+    uint32_t cv[8];
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint32_t block_len;
+    uint64_t counter;
+    uint32_t flags;
+} blake3_output;
+
+void blake3_output_cv(const blake3_output *o, uint8_t out[BLAKE3_OUT_LEN])
+{
+    uint32_t words[16];
+    blake3_compress(o->cv, o->block, o->block_len, o->counter, o->flags, words);
+    __blake3_store_cv(words, out);
+}
+
+void blake3_output_root(const blake3_output *o, uint8_t out[BLAKE3_OUT_LEN])
+{
+    uint32_t words[16];
+    blake3_compress(o->cv, o->block, o->block_len, 0, o->flags | BLAKE3_ROOT, words);
+    __blake3_store_cv(words, out);
+}
+
+// the node above two chaining values
+blake3_output blake3_parent(const uint8_t left[BLAKE3_OUT_LEN], const uint8_t right[BLAKE3_OUT_LEN])
+{
+    blake3_output o = {.block_len = BLAKE3_BLOCK_LEN, .flags = BLAKE3_PARENT};
+    memcpy(o.cv, BLAKE3_IV, sizeof(o.cv));
+    memcpy(o.block, left, BLAKE3_OUT_LEN);
+    memcpy(o.block + BLAKE3_OUT_LEN, right, BLAKE3_OUT_LEN);
+    return o;
+}
+
+// Hashes one subtree of chunks as it streams by, the first chunk being number counter
+#define BLAKE3_MAX_DEPTH 54
+typedef struct
+{
+    uint64_t counter; // of the chunk being hashed
+    uint64_t first;
+    uint32_t cv[8];
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint32_t block_len;
+    uint32_t blocks_done;
+    uint8_t stack[BLAKE3_MAX_DEPTH][BLAKE3_OUT_LEN];
+    size_t stack_len;
+} blake3_hasher;
+
+blake3_hasher blake3_hasher_new(uint64_t counter)
+{
+    blake3_hasher h = {.counter = counter, .first = counter};
+    memcpy(h.cv, BLAKE3_IV, sizeof(h.cv));
+    return h;
+}
+
+blake3_output __blake3_chunk_output(const blake3_hasher *h)
+{
+    blake3_output o = {.block_len = h->block_len, .counter = h->counter, .flags = BLAKE3_CHUNK_END | (h->blocks_done == 0 ? BLAKE3_CHUNK_START : 0)};
+    memcpy(o.cv, h->cv, sizeof(o.cv));
+    memcpy(o.block, h->block, BLAKE3_BLOCK_LEN);
+    return o;
+}
+
+void blake3_hasher_update(blake3_hasher *h, const uint8_t *src, size_t len)
+{
+    while (len > 0)
+    {
+        // a full chunk is only closed once more input shows it is not the last one
+        if ((size_t)h->blocks_done * BLAKE3_BLOCK_LEN + h->block_len == BLAKE3_CHUNK_LEN)
+        {
+            const blake3_output o = __blake3_chunk_output(h);
+            uint8_t cv[BLAKE3_OUT_LEN];
+            blake3_output_cv(&o, cv);
+            // merge while the chunks done so far close a subtree
+            for (uint64_t done = h->counter - h->first + 1; (done & 1) == 0; done >>= 1)
+            {
+                const blake3_output p = blake3_parent(h->stack[--h->stack_len], cv);
+                blake3_output_cv(&p, cv);
+            }
+            memcpy(h->stack[h->stack_len++], cv, BLAKE3_OUT_LEN);
+            h->counter += 1;
+            memcpy(h->cv, BLAKE3_IV, sizeof(h->cv));
+            memset(h->block, 0, BLAKE3_BLOCK_LEN);
+            h->block_len = h->blocks_done = 0;
+        }
+        if (h->block_len == BLAKE3_BLOCK_LEN)
+        {
+            uint32_t words[16];
+            blake3_compress(h->cv, h->block, BLAKE3_BLOCK_LEN, h->counter, h->blocks_done == 0 ? BLAKE3_CHUNK_START : 0, words);
+            memcpy(h->cv, words, sizeof(h->cv));
+            h->blocks_done += 1;
+            h->block_len = 0;
+            // a short last block is hashed zero-padded
+            memset(h->block, 0, BLAKE3_BLOCK_LEN);
+        }
+        const size_t take = BLAKE3_BLOCK_LEN - h->block_len < len ? BLAKE3_BLOCK_LEN - h->block_len : len;
+        memcpy(h->block + h->block_len, src, take);
+        h->block_len += take;
+        src += take;
+        len -= take;
+    }
+}
+
+// The top node of everything hashed, the stack is folded in from the right
+blake3_output blake3_hasher_output(const blake3_hasher *h)
+{
+    blake3_output o = __blake3_chunk_output(h);
+    for (size_t i = h->stack_len; i > 0; --i)
+    {
+        uint8_t cv[BLAKE3_OUT_LEN];
+        blake3_output_cv(&o, cv);
+        o = blake3_parent(h->stack[i - 1], cv);
+    }
+    return o;
+}
+
+void blake3_hash(const void *src, size_t len, uint8_t out[BLAKE3_OUT_LEN])
+{
+    blake3_hasher h = blake3_hasher_new(0);
+    blake3_hasher_update(&h, src, len);
+    const blake3_output o = blake3_hasher_output(&h);
+    blake3_output_root(&o, out);
+}
+
+// Member trees. The leaves are MERKLE_LEAF_SIZE bytes of the member, the
+// last one may be shorter. The tree is stored as its parent nodes, each the
+// chaining values of its two children, in pre-order: the root node first,
+// then the nodes of its left subtree, then those of its right one. A node
+// with n leaves under it splits them as BLAKE3 does, the left side gets the
+// largest power of two below n. A member of one leaf has no stored nodes,
+// its root is checked against the leaf itself.
+#define MERKLE_LEAF_SIZE (64 * 1024)
+#define MERKLE_NODE_SIZE (2 * BLAKE3_OUT_LEN)
+#define MERKLE_MAX_DEPTH 64
+
+size_t merkle_leaf_count(size_t init_size)
+{
+    return init_size ? (init_size + MERKLE_LEAF_SIZE - 1) / MERKLE_LEAF_SIZE : 1;
+}
+
+// decoded size of the stored nodes of a member
+size_t merkle_tree_size(size_t init_size)
+{
+    return (merkle_leaf_count(init_size) - 1) * MERKLE_NODE_SIZE;
+}
+
+size_t merkle_leaf_bytes(size_t init_size, size_t leaf)
+{
+    const size_t left = init_size - leaf * MERKLE_LEAF_SIZE;
+    return left < MERKLE_LEAF_SIZE ? left : MERKLE_LEAF_SIZE;
+}
+
+// leaves of the left subtree of a node over n > 1 leaves
+size_t merkle_left_leaves(size_t n)
+{
+    size_t p = 1;
+    while (2 * p < n)
+    {
+        p *= 2;
+    }
+    return p;
+}
+
+// What leaf of a member of n_leaves hashes to: its chaining value, or the
+// root when it is the only one
+void merkle_leaf_hash(const uint8_t *src, size_t len, size_t leaf, size_t n_leaves, uint8_t out[BLAKE3_OUT_LEN])
+{
+    blake3_hasher h = blake3_hasher_new((uint64_t)leaf * (MERKLE_LEAF_SIZE / BLAKE3_CHUNK_LEN));
+    blake3_hasher_update(&h, src, len);
+    const blake3_output o = blake3_hasher_output(&h);
+    if (n_leaves == 1)
+    {
+        blake3_output_root(&o, out);
+        return;
+    }
+    blake3_output_cv(&o, out);
+}
+
+// Builds the tree of a member from its bytes as they stream by
+typedef struct
+{
+    size_t init_size;
+    size_t pos;
+    blake3_hasher leaf;
+    byte_buf leaves; // chaining values of the leaves done
+} merkle_builder;
+
+merkle_builder merkle_builder_new(size_t init_size)
+{
+    return (merkle_builder){.init_size = init_size, .leaf = blake3_hasher_new(0)};
+}
+
+void merkle_builder_update(merkle_builder *b, const uint8_t *src, size_t len)
+{
+    while (len > 0)
+    {
+        const size_t leaf_end = (b->leaves.len / BLAKE3_OUT_LEN + 1) * MERKLE_LEAF_SIZE;
+        if (b->pos == leaf_end)
+        {
+            // more input, so the full leaf is not the root
+            uint8_t cv[BLAKE3_OUT_LEN];
+            const blake3_output o = blake3_hasher_output(&b->leaf);
+            blake3_output_cv(&o, cv);
+            byte_buf_push(&b->leaves, cv, BLAKE3_OUT_LEN);
+            b->leaf = blake3_hasher_new(b->pos / BLAKE3_CHUNK_LEN);
+            continue;
+        }
+        const size_t take = leaf_end - b->pos < len ? leaf_end - b->pos : len;
+        blake3_hasher_update(&b->leaf, src, take);
+        b->pos += take;
+        src += take;
+        len -= take;
+    }
+}
+
+// Lays out the nodes over n chaining values at leaves in pre-order onto dst, cv gets the one on top
+void __merkle_push_nodes(const uint8_t *leaves, size_t n, byte_buf *dst, uint8_t cv[BLAKE3_OUT_LEN], bool root)
+{
+    if (n == 1)
+    {
+        memcpy(cv, leaves, BLAKE3_OUT_LEN);
+        return;
+    }
+    const size_t at = dst->len, p = merkle_left_leaves(n);
+    byte_buf_reserve(dst, MERKLE_NODE_SIZE);
+    dst->len += MERKLE_NODE_SIZE;
+    uint8_t left[BLAKE3_OUT_LEN], right[BLAKE3_OUT_LEN];
+    __merkle_push_nodes(leaves, p, dst, left, false);
+    __merkle_push_nodes(leaves + p * BLAKE3_OUT_LEN, n - p, dst, right, false);
+    memcpy(dst->ptr + at, left, BLAKE3_OUT_LEN);
+    memcpy(dst->ptr + at + BLAKE3_OUT_LEN, right, BLAKE3_OUT_LEN);
+    const blake3_output o = blake3_parent(left, right);
+    if (root)
+    {
+        blake3_output_root(&o, cv);
+        return;
+    }
+    blake3_output_cv(&o, cv);
+}
+
+// Appends the stored nodes to nodes and gives the root, init_size bytes have to be in
+void merkle_builder_finish(merkle_builder *b, byte_buf *nodes, uint8_t root[BLAKE3_OUT_LEN])
+{
+    assert(b->pos == b->init_size);
+    const blake3_output o = blake3_hasher_output(&b->leaf);
+    if (b->leaves.len == 0)
+    {
+        blake3_output_root(&o, root);
+    }
+    else
+    {
+        uint8_t cv[BLAKE3_OUT_LEN];
+        blake3_output_cv(&o, cv);
+        byte_buf_push(&b->leaves, cv, BLAKE3_OUT_LEN);
+        __merkle_push_nodes(b->leaves.ptr, b->leaves.len / BLAKE3_OUT_LEN, nodes, root, true);
+    }
+    byte_buf_close(&b->leaves);
+}
+
+// a root of zeros is not known, as members salvaged without their table
+bool merkle_root_known(const uint8_t root[BLAKE3_OUT_LEN])
+{
+    for (size_t i = 0; i < BLAKE3_OUT_LEN; ++i)
+    {
+        if (root[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef SYNC_MARKER_H
+#define SYNC_MARKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "helper.h"
+
+// Resync marker, put before every group of chunks of a member when the
+// archive is created with --sync. All fields are little-endian:
+//   le64 magic
+//   le64 member id, unique within the archive and growing with every commit
+//   le64 index of the chunk that follows
+//   le64 init_size
+//   le64 mtime
+//   le32 bytes per chunk
+//   le32 chunks per group
+//   le32 name_len
+//   le32 checksum of the marker and the name
+// The marker of chunk 0 is followed by the member name, without the NUL.
+#define SYNC_MARKER_MAGIC 0x434e5953434d4148ull // "HAMCSYNC"
+#define SYNC_MARKER_SIZE 56
+#define SYNC_DEFAULT_GROUP 1024
+
+typedef struct
+{
+    uint64_t member_id;
+    uint64_t chunk;
+    uint64_t init_size;
+    int64_t mtime;
+    uint32_t bytes_per_chunk;
+    uint32_t group;
+    uint32_t name_len;
+} sync_marker;
+
+uint32_t __sync_marker_checksum(const uint8_t *fields, const char *name, size_t name_len)
+{
+    uint64_t h = content_hash_update(CONTENT_HASH_INIT, fields, SYNC_MARKER_SIZE - 4);
+    h = content_hash_update(h, name, name_len);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+// name is only written for chunk 0
+void sync_marker_push(byte_buf *buf, const sync_marker *m, const char *name)
+{
+    const size_t start = buf->len;
+    le64_push(buf, SYNC_MARKER_MAGIC);
+    le64_push(buf, m->member_id);
+    le64_push(buf, m->chunk);
+    le64_push(buf, m->init_size);
+    le64_push(buf, (uint64_t)m->mtime);
+    le32_push(buf, m->bytes_per_chunk);
+    le32_push(buf, m->group);
+    le32_push(buf, m->name_len);
+    const size_t name_len = m->chunk == 0 ? m->name_len : 0;
+    le32_push(buf, __sync_marker_checksum(buf->ptr + start, name, name_len));
+    byte_buf_push(buf, name, name_len);
+}
+
+// On success *name points into p (name_len bytes) for the marker of chunk 0
+bool sync_marker_read(const uint8_t *p, const uint8_t *end, sync_marker *m, const char **name)
+{
+    const uint8_t *start = p;
+    uint64_t magic, mtime;
+    uint32_t checksum;
+    if (!le64_read(&p, end, &magic) || magic != SYNC_MARKER_MAGIC ||
+        !le64_read(&p, end, &m->member_id) ||
+        !le64_read(&p, end, &m->chunk) ||
+        !le64_read(&p, end, &m->init_size) ||
+        !le64_read(&p, end, &mtime) ||
+        !le32_read(&p, end, &m->bytes_per_chunk) ||
+        !le32_read(&p, end, &m->group) ||
+        !le32_read(&p, end, &m->name_len) ||
+        !le32_read(&p, end, &checksum))
+    {
+        return false;
+    }
+    m->mtime = (int64_t)mtime;
+    const size_t name_len = m->chunk == 0 ? m->name_len : 0;
+    if ((size_t)(end - p) < name_len || m->bytes_per_chunk == 0 || m->group == 0)
+    {
+        return false;
+    }
+    *name = (const char *)p;
+    return checksum == __sync_marker_checksum(start, *name, name_len);
+}
+
+#endif
@@ -0,0 +1,277 @@
+#include "hamarc.h"
+
+#include "hamming.h"
+#include "encoding_decoding.h"
+#include "arch_instance.h"
+#include "arch_repair.h"
+#include "arch_verify.h"
+#include "member_reader.h"
+
+struct hamarc
+{
+    arch_instance inst;
+    char *path; // inst.name points into it
+};
+
+struct hamarc_reader
+{
+    member_reader *r;
+    char *name;
+};
+
+hamarc *__hamarc_wrap(arch_instance inst, char *path, const hamarc_options *opts)
+{
+    if (!inst.f)
+    {
+        free(path);
+        return NULL;
+    }
+    hamarc *h = calloc(1, sizeof(hamarc));
+    h->inst = inst;
+    h->path = path;
+    if (opts)
+    {
+        arch_instance_set_align(&h->inst, opts->align);
+        h->inst.no_cache = opts->no_cache;
+        h->inst.max_memory = opts->max_memory;
+    }
+    return h;
+}
+
+HAMARC_API hamarc *hamarc_create(const char *path, const hamarc_options *opts)
+{
+    config cnf = {0};
+    if (opts && (opts->bytes_per_chunk || opts->sync_group || opts->parity_count || opts->hash_tree))
+    {
+        cnf = config_new(opts->bytes_per_chunk ? opts->bytes_per_chunk : DEFAULT_BYTES_PER_CHUNK);
+        cnf.sync_group = opts->sync_group;
+        cnf.parity_count = opts->parity_count;
+        cnf.parity_data = opts->parity_count ? (opts->parity_data ? opts->parity_data : PARITY_DEFAULT_DATA) : 0;
+        cnf.hash_tree = opts->hash_tree;
+        if (cnf.parity_count > PARITY_MAX_COUNT || cnf.parity_data + cnf.parity_count > 256)
+        {
+            fprintf(stderr, "hamarc_create: at most %d parity blocks and 256 blocks per stripe\n", PARITY_MAX_COUNT);
+            return NULL;
+        }
+    }
+    char *own_path = strdup(path);
+    return __hamarc_wrap(arch_instance_create_empty(own_path, cnf), own_path, opts);
+}
+
+HAMARC_API hamarc *hamarc_open(const char *path, const hamarc_options *opts)
+{
+    char *own_path = strdup(path);
+    return __hamarc_wrap(arch_instance_create(own_path, true), own_path, opts);
+}
+
+HAMARC_API void hamarc_close(hamarc *h)
+{
+    if (!h)
+    {
+        return;
+    }
+    arch_instance_close(&h->inst);
+    free(h->path);
+    free(h);
+}
+
+HAMARC_API size_t hamarc_count(hamarc *h)
+{
+    return arch_instance_load_files(&h->inst) ? h->inst.hdr.file_count : 0;
+}
+
+HAMARC_API bool hamarc_stat(hamarc *h, size_t i, hamarc_member *out)
+{
+    if (!arch_instance_load_files(&h->inst) || i >= h->inst.hdr.file_count)
+    {
+        return false;
+    }
+    const arch_file_header *hdr = &h->inst.file_hdrs[i];
+    *out = (hamarc_member){
+        .name = arch_file_name(&h->inst, hdr),
+        .size = hdr->init_size,
+        .mtime_ns = hdr->mtime,
+        .hash = hdr->hash,
+        .mode = hdr->mode,
+        .uid = hdr->uid,
+        .gid = hdr->gid,
+    };
+    memcpy(out->root, hdr->root, BLAKE3_OUT_LEN);
+    return true;
+}
+
+HAMARC_API int64_t hamarc_find(hamarc *h, const char *name)
+{
+    if (!arch_instance_load_files(&h->inst))
+    {
+        return -1;
+    }
+    const arch_file_header *hdr = arch_find_file(&h->inst, name);
+    return hdr ? hdr - h->inst.file_hdrs : -1;
+}
+
+HAMARC_API bool hamarc_contains(hamarc *h, const char *name)
+{
+    return arch_contains(&h->inst, name);
+}
+
+HAMARC_API bool hamarc_read_to(hamarc *h, size_t i, FILE *out)
+{
+    if (!arch_instance_load_files(&h->inst) || i >= h->inst.hdr.file_count)
+    {
+        return false;
+    }
+    const arch_file_header *hdr = &h->inst.file_hdrs[i];
+    const bool matches = __arch_decode_member(&h->inst, hdr, arch_file_name(&h->inst, hdr), out);
+    return fflush(out) == 0 && !ferror(out) && matches;
+}
+
+HAMARC_API hamarc_reader *hamarc_reader_open(hamarc *h, size_t i)
+{
+    if (!arch_instance_load_files(&h->inst) || i >= h->inst.hdr.file_count)
+    {
+        return NULL;
+    }
+    const arch_file_header *hdr = &h->inst.file_hdrs[i];
+    fflush(h->inst.f);
+    hamarc_reader *reader = calloc(1, sizeof(hamarc_reader));
+    reader->r = member_reader_open(fileno(h->inst.f), hdr->offset, hdr->init_size, hdr->name_len, h->inst.cnf, true);
+    reader->r->no_cache = h->inst.no_cache;
+    if (h->inst.cnf.hash_tree && merkle_root_known(hdr->root))
+    {
+        member_tree *tree = malloc(sizeof(member_tree));
+        *tree = member_tree_open(fileno(h->inst.f), hdr->offset, hdr->init_size, hdr->name_len, h->inst.cnf, hdr->root);
+        member_reader_check_tree(reader->r, tree);
+    }
+    reader->name = strdup(arch_file_name(&h->inst, hdr));
+    return reader;
+}
+
+HAMARC_API int64_t hamarc_reader_read(hamarc_reader *reader, void *dst, size_t n)
+{
+    return member_reader_read(reader->r, dst, n);
+}
+
+HAMARC_API int64_t hamarc_reader_seek(hamarc_reader *reader, int64_t offset, int whence)
+{
+    return member_reader_seek(reader->r, offset, whence);
+}
+
+HAMARC_API bool hamarc_reader_close(hamarc_reader *reader)
+{
+    if (!reader)
+    {
+        return false;
+    }
+    const decode_stats stats = reader->r->stats;
+    const bool ok = stats.failed == 0 && !reader->r->io_failed && reader->r->mismatched == 0;
+    if (stats.corrected || stats.failed)
+    {
+        fprintf(stderr, "[%s]: %lu chunks corrected, %lu damaged; run --repair to fix the archive\n", reader->name, stats.corrected, stats.failed);
+    }
+    if (reader->r->mismatched)
+    {
+        fprintf(stderr, "[%s]: %lu reads stopped at a leaf that does not match its hash\n", reader->name, reader->r->mismatched);
+    }
+    member_reader_close(reader->r);
+    free(reader->name);
+    free(reader);
+    return ok;
+}
+
+HAMARC_API char *hamarc_extract(hamarc *h, size_t i, const char *dir)
+{
+    if (!arch_instance_load_files(&h->inst) || i >= h->inst.hdr.file_count)
+    {
+        return NULL;
+    }
+    const arch_file_header *hdr = &h->inst.file_hdrs[i];
+    return __arch_extract_single(&h->inst, hdr, arch_file_name(&h->inst, hdr), dir);
+}
+
+HAMARC_API bool hamarc_add_paths(hamarc *h, const char *const *paths, size_t n)
+{
+    if (n == 0 || !arch_instance_load_files(&h->inst))
+    {
+        return n == 0;
+    }
+    return arch_insert_files(&h->inst, (string_array){.arr = (char **)paths, .len = n});
+}
+
+HAMARC_API bool hamarc_add_iovec(hamarc *h, const char *name, const struct iovec *iov, size_t iovcnt, int64_t mtime_ns)
+{
+    if (!arch_instance_load_files(&h->inst))
+    {
+        return false;
+    }
+    // held to what -x would extract, and one member per name so that hamarc_find finds it
+    if (!is_safe_relative_path(name))
+    {
+        fprintf(stderr, "Refusing to add a member with unsafe name: %s\n", name);
+        return false;
+    }
+    if (arch_find_file(&h->inst, name))
+    {
+        fprintf(stderr, "arch %s already has a member [%s]\n", h->inst.name, name);
+        return false;
+    }
+    file_to_append file = {.filename = name, .iov = iov, .iovcnt = iovcnt, .mtime = mtime_ns};
+    for (size_t i = 0; i < iovcnt; ++i)
+    {
+        file.file_size += iov[i].iov_len;
+    }
+    const bool ok = __arch_append_file(&h->inst, &file);
+    arch_instance_sync_header(&h->inst);
+    return ok;
+}
+
+HAMARC_API bool hamarc_add_buffer(hamarc *h, const char *name, const void *data, size_t len, int64_t mtime_ns)
+{
+    const struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+    return hamarc_add_iovec(h, name, &iov, 1, mtime_ns);
+}
+
+HAMARC_API bool hamarc_update_paths(hamarc *h, const char *const *paths, size_t n, bool use_checksum)
+{
+    if (n == 0 || !arch_instance_load_files(&h->inst))
+    {
+        return n == 0;
+    }
+    return arch_update_files(&h->inst, (string_array){.arr = (char **)paths, .len = n}, use_checksum);
+}
+
+HAMARC_API bool hamarc_remove(hamarc *h, const char *const *names, size_t n)
+{
+    if (!arch_instance_load_files(&h->inst))
+    {
+        return false;
+    }
+    const arena_mark mark = arena_save(&h->inst.scratch);
+    bool *removed = arena_calloc(&h->inst.scratch, h->inst.hdr.file_count + 1, sizeof(bool));
+    bool all_found = true;
+    for (size_t i = 0; i < n; ++i)
+    {
+        const arch_file_header *hdr = arch_find_file(&h->inst, names[i]);
+        if (!hdr)
+        {
+            fprintf(stderr, "Could not locate file [%s] to delete\n", names[i]);
+            all_found = false;
+            continue;
+        }
+        removed[hdr - h->inst.file_hdrs] = true;
+    }
+    __arch_remove_marked(&h->inst, removed, h->inst.hdr.file_count);
+    arena_restore(&h->inst.scratch, mark);
+    arch_instance_sync_header(&h->inst);
+    return all_found;
+}
+
+HAMARC_API bool hamarc_repair(hamarc *h)
+{
+    return arch_repair(&h->inst);
+}
+
+HAMARC_API bool hamarc_verify(hamarc *h)
+{
+    return arch_verify(&h->inst, (string_array){0}, NULL);
+}
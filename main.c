@@ -9,6 +9,9 @@
 #include "hamming.h"
 #include "encoding_decoding.h"
 #include "arch_instance.h"
+#include "arch_repair.h"
+#include "arch_salvage.h"
+#include "arch_verify.h"
 
 void test_hamming()
 {
@@ -67,7 +70,7 @@ void test_insert()
 void test_extract()
 {
     arch_instance inst = arch_instance_create("test.ham", true);
-    arch_extract_files(&inst, "./testdir", (string_array){0});
+    arch_extract_files(&inst, "./testdir", (string_array){0}, NULL);
     arch_instance_close(&inst);
 }
 
@@ -80,6 +83,18 @@ typedef enum
     OPT_APPEND,
     OPT_DELETE,
     OPT_CONCAT,
+    OPT_UPDATE,
+    OPT_CHECKSUM,
+    OPT_REPAIR,
+    OPT_SYNC,
+    OPT_PARITY,
+    OPT_SALVAGE,
+    OPT_CONTAINS,
+    OPT_ALIGN,
+    OPT_DIRECT,
+    OPT_MAX_MEMORY,
+    OPT_TREE,
+    OPT_VERIFY,
 
     OPT_DST_DIR,
 
@@ -144,6 +159,27 @@ bool is_no_args(const cmd_opt *restrict all, size_t all_len)
     return true;
 }
 
+// --align [N], without N member data is aligned to filesystem blocks
+bool get_align(const cmd_opt *opt, size_t *align)
+{
+    if (!opt->appears)
+    {
+        return true;
+    }
+    if (opt->arg_count > 1)
+    {
+        fprintf(stderr, "Expected --align option to have at most one arg = [bytes]\n");
+        return false;
+    }
+    *align = opt->arg_count ? strtoul(opt->args[0], NULL, 10) : ARCH_ALIGN_BLOCK;
+    if (*align == 0)
+    {
+        fprintf(stderr, "Expected --align arg to be a positive number\n");
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     argc -= 1;
@@ -157,7 +193,19 @@ int main(int argc, char **argv)
                             "-a, --append           - добавить файл в архив\n\r"
                             "-d, --delete           - удалить файл из архива\n\r"
                             "-A, --concatenate      - смерджить два архива\n\r"
-                            "Имена файлов передаются свободными аргументами\n\r"
+                            "-u, --update           - обновить в архиве только изменившиеся файлы (размер, mtime)\n\r"
+                            "-k, --checksum         - вместе с --update сравнивать также хеш содержимого\n\r"
+                            "-r, --repair           - исправить одиночные ошибки в архиве на месте\n\r"
+                            "-s, --sync [N]         - вместе с --create ставить маркеры синхронизации через каждые N блоков (по умолчанию 1024)\n\r"
+                            "-p, --parity [N [M]]   - вместе с --create добавлять M блоков чётности Рида-Соломона на каждые N блоков (по умолчанию 16 и 2)\n\r"
+                            "-S, --salvage          - восстановить таблицу файлов по маркерам синхронизации\n\r"
+                            "-C, --contains NAME    - вывести те из архивов -f A1 A2 ..., в которых есть файл NAME\n\r"
+                            "-B, --align [N]        - выравнивать начало файлов в архиве на N байт (по умолчанию размер блока ФС)\n\r"
+                            "-D, --direct           - читать и писать в обход страничного кэша (O_DIRECT)\n\r"
+                            "-M, --max-memory SIZE  - не держать в памяти больше SIZE байт (суффиксы K, M, G)\n\r"
+                            "-t, --tree             - вместе с --create хранить для каждого файла дерево хешей BLAKE3\n\r"
+                            "-V, --verify [NAMES]   - сверить файлы архива (если не указано, то все) с их деревьями хешей\n\r"
+                            "Имена файлов передаются свободными аргументами, директории архивируются рекурсивно с относительными путями\n\r"
                             "Аргументы для кодирования и декодирования так же передаются через командую строку (Названия и типы аргументов часть задания)\n\r"
                             "### Примеры запуска\n\r"
                             "hamarc --create --file=ARCHIVE FILE1 FILE2 FILE3\n\r"
@@ -222,6 +270,102 @@ int main(int argc, char **argv)
                 .arg_count = 0,
                 .code = OPT_CONCAT,
             },
+            {
+                .s_alias = "-u",
+                .l_alias = "--update",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_UPDATE,
+            },
+            {
+                .s_alias = "-k",
+                .l_alias = "--checksum",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_CHECKSUM,
+            },
+            {
+                .s_alias = "-r",
+                .l_alias = "--repair",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_REPAIR,
+            },
+            {
+                .s_alias = "-s",
+                .l_alias = "--sync",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_SYNC,
+            },
+            {
+                .s_alias = "-p",
+                .l_alias = "--parity",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_PARITY,
+            },
+            {
+                .s_alias = "-S",
+                .l_alias = "--salvage",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_SALVAGE,
+            },
+            {
+                .s_alias = "-C",
+                .l_alias = "--contains",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_CONTAINS,
+            },
+            {
+                .s_alias = "-B",
+                .l_alias = "--align",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_ALIGN,
+            },
+            {
+                .s_alias = "-D",
+                .l_alias = "--direct",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_DIRECT,
+            },
+            {
+                .s_alias = "-M",
+                .l_alias = "--max-memory",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_MAX_MEMORY,
+            },
+            {
+                .s_alias = "-t",
+                .l_alias = "--tree",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_TREE,
+            },
+            {
+                .s_alias = "-V",
+                .l_alias = "--verify",
+                .appears = false,
+                .args = NULL,
+                .arg_count = 0,
+                .code = OPT_VERIFY,
+            },
             {
                 .s_alias = "-dst",
                 .l_alias = "--destination",
@@ -241,6 +385,8 @@ int main(int argc, char **argv)
         };
 
     int ret_code = 0;
+    // option argument lists, dropped together at the end
+    arena cli = {0};
 
     for (int arg_i = 0; arg_i < argc; ++arg_i)
     {
@@ -266,7 +412,7 @@ int main(int argc, char **argv)
                 else if (starts_with(arg, "--file="))
                 {
                     right_opt = &opts[OPT_FILE];
-                    right_opt->args = realloc(right_opt->args, (right_opt->arg_count + 1) * sizeof(char *));
+                    right_opt->args = arena_realloc(&cli, right_opt->args, right_opt->arg_count * sizeof(char *), (right_opt->arg_count + 1) * sizeof(char *));
                     right_opt->args[right_opt->arg_count] = arg + sizeof("--file=") - 1;
                     right_opt->arg_count += 1;
                     break;
@@ -290,7 +436,7 @@ int main(int argc, char **argv)
             arg_i += 1;
             for (; arg_i < argc && !starts_with(argv[arg_i], "-"); ++arg_i)
             {
-                right_opt->args = realloc(right_opt->args, (right_opt->arg_count + 1) * sizeof(char *));
+                right_opt->args = arena_realloc(&cli, right_opt->args, right_opt->arg_count * sizeof(char *), (right_opt->arg_count + 1) * sizeof(char *));
                 right_opt->args[right_opt->arg_count] = argv[arg_i];
                 right_opt->arg_count += 1;
             }
@@ -306,7 +452,7 @@ int main(int argc, char **argv)
     {
         if (opts[OPT_HELP].appears)
         {
-            OPT_E allowed[] = {OPT_HELP};
+            OPT_E allowed[] = {OPT_HELP, OPT_MAX_MEMORY};
             if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
             {
                 fprintf(stdout, "If --help option specified other ones will be discarded\n");
@@ -328,10 +474,23 @@ int main(int argc, char **argv)
         EXIT_EARLY;
     }
     const char *archname = opts[OPT_FILE].args[0];
+    if (opts[OPT_DIRECT].arg_count != 0)
+    {
+        fprintf(stderr, "Expected --direct option to have ZERO args\n");
+        EXIT_EARLY;
+    }
+    const bool no_cache = opts[OPT_DIRECT].appears;
+    size_t max_memory = 0;
+    if (opts[OPT_MAX_MEMORY].appears &&
+        (opts[OPT_MAX_MEMORY].arg_count != 1 || !parse_size(opts[OPT_MAX_MEMORY].args[0], &max_memory) || max_memory < ARCH_MIN_MEMORY))
+    {
+        fprintf(stderr, "Expected --max-memory option to have one arg = [bytes, with K, M or G suffix], at least %d\n", ARCH_MIN_MEMORY);
+        EXIT_EARLY;
+    }
 
     if (opts[OPT_CREATE].appears)
     {
-        OPT_E allowed[] = {OPT_CREATE, OPT_FILE};
+        OPT_E allowed[] = {OPT_CREATE, OPT_FILE, OPT_SYNC, OPT_PARITY, OPT_TREE, OPT_ALIGN, OPT_DIRECT, OPT_MAX_MEMORY};
         if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
         {
             EXIT_EARLY;
@@ -343,23 +502,84 @@ int main(int argc, char **argv)
             EXIT_EARLY;
         }
 
-        arch_instance inst = arch_instance_create_empty(archname, (config){0});
+        config cnf = {0};
+        if (opts[OPT_SYNC].appears)
+        {
+            if (opts[OPT_SYNC].arg_count > 1)
+            {
+                fprintf(stderr, "Expected --sync option to have at most one arg = [chunks per marker]\n");
+                EXIT_EARLY;
+            }
+            cnf = config_new(DEFAULT_BYTES_PER_CHUNK);
+            cnf.sync_group = opts[OPT_SYNC].arg_count ? strtoul(opts[OPT_SYNC].args[0], NULL, 10) : SYNC_DEFAULT_GROUP;
+            if (cnf.sync_group == 0)
+            {
+                fprintf(stderr, "Expected --sync arg to be a positive number\n");
+                EXIT_EARLY;
+            }
+        }
+        if (opts[OPT_PARITY].appears)
+        {
+            if (opts[OPT_PARITY].arg_count > 2)
+            {
+                fprintf(stderr, "Expected --parity option to have at most two args = [chunks per stripe] [parity blocks per stripe]\n");
+                EXIT_EARLY;
+            }
+            if (cnf.BYTES_per_chunk == 0)
+            {
+                cnf = config_new(DEFAULT_BYTES_PER_CHUNK);
+            }
+            cnf.parity_data = opts[OPT_PARITY].arg_count > 0 ? strtoul(opts[OPT_PARITY].args[0], NULL, 10) : PARITY_DEFAULT_DATA;
+            cnf.parity_count = opts[OPT_PARITY].arg_count > 1 ? strtoul(opts[OPT_PARITY].args[1], NULL, 10) : PARITY_DEFAULT_COUNT;
+            if (cnf.parity_data == 0 || cnf.parity_count == 0 || cnf.parity_count > PARITY_MAX_COUNT || cnf.parity_data + cnf.parity_count > 256)
+            {
+                fprintf(stderr, "Expected --parity args to be positive, at most %d parity blocks and at most 256 blocks per stripe in all\n", PARITY_MAX_COUNT);
+                EXIT_EARLY;
+            }
+        }
+        if (opts[OPT_TREE].appears)
+        {
+            if (opts[OPT_TREE].arg_count != 0)
+            {
+                fprintf(stderr, "Expected --tree option to have ZERO args\n");
+                EXIT_EARLY;
+            }
+            if (cnf.BYTES_per_chunk == 0)
+            {
+                cnf = config_new(DEFAULT_BYTES_PER_CHUNK);
+            }
+            cnf.hash_tree = true;
+        }
+
+        size_t align = 0;
+        if (!get_align(&opts[OPT_ALIGN], &align))
+        {
+            EXIT_EARLY;
+        }
+        arch_instance inst = arch_instance_create_empty(archname, cnf);
         if (!inst.f)
         {
             EXIT_EARLY;
         }
+        arch_instance_set_align(&inst, align);
+        inst.no_cache = no_cache;
+        inst.max_memory = max_memory;
         if (opts[OPT_FILE].arg_count < 2)
         {
             fprintf(stdout, "No files passed to insert to archive [%s]\n", archname);
             goto early_exit;
         }
 
-        arch_insert_files(&inst, (string_array){.arr = opts[OPT_FILE].args + 1, .len = opts[OPT_FILE].arg_count - 1});
+        bool inserted = arch_insert_files(&inst, (string_array){.arr = opts[OPT_FILE].args + 1, .len = opts[OPT_FILE].arg_count - 1});
         arch_instance_close(&inst);
+        if (!inserted)
+        {
+            EXIT_EARLY;
+        }
     }
     else if (opts[OPT_EXTRACT].appears)
     {
-        OPT_E allowed[] = {OPT_EXTRACT, OPT_FILE, OPT_DST_DIR};
+        OPT_E allowed[] = {OPT_EXTRACT, OPT_FILE, OPT_DST_DIR, OPT_DIRECT, OPT_MAX_MEMORY};
         if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
         {
             EXIT_EARLY;
@@ -370,6 +590,8 @@ int main(int argc, char **argv)
         {
             EXIT_EARLY;
         }
+        inst.no_cache = no_cache;
+        inst.max_memory = max_memory;
 
         char dir[100] = "./extract_dir_";
         strncat(dir, get_clean_filename(archname), 100 - 1);
@@ -387,13 +609,18 @@ int main(int argc, char **argv)
 
         mkdir_if_no(dir);
 
-        string_array_to_free files = arch_extract_files(&inst, dir, (string_array){.arr = opts[OPT_EXTRACT].args, .len = opts[OPT_EXTRACT].arg_count});
+        bool extracted = false;
+        string_array_to_free files = arch_extract_files(&inst, dir, (string_array){.arr = opts[OPT_EXTRACT].args, .len = opts[OPT_EXTRACT].arg_count}, &extracted);
         string_array_to_free_close(&files);
         arch_instance_close(&inst);
+        if (!extracted)
+        {
+            EXIT_EARLY;
+        }
     }
     else if (opts[OPT_DELETE].appears)
     {
-        OPT_E allowed[] = {OPT_DELETE, OPT_FILE, OPT_DST_DIR};
+        OPT_E allowed[] = {OPT_DELETE, OPT_FILE, OPT_DST_DIR, OPT_DIRECT, OPT_MAX_MEMORY};
         if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
         {
             EXIT_EARLY;
@@ -404,6 +631,8 @@ int main(int argc, char **argv)
         {
             EXIT_EARLY;
         }
+        inst.no_cache = no_cache;
+        inst.max_memory = max_memory;
 
         char dir[100] = "./delete_dir_";
         strncat(dir, get_clean_filename(archname), 100 - 1);
@@ -424,7 +653,7 @@ int main(int argc, char **argv)
     }
     else if (opts[OPT_LIST].appears)
     {
-        OPT_E allowed[] = {OPT_LIST, OPT_FILE};
+        OPT_E allowed[] = {OPT_LIST, OPT_FILE, OPT_MAX_MEMORY};
         if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
         {
             EXIT_EARLY;
@@ -436,16 +665,22 @@ int main(int argc, char **argv)
             EXIT_EARLY;
         }
 
+        inst.max_memory = max_memory;
         arch_list_files(&inst);
         arch_instance_close(&inst);
     }
     else if (opts[OPT_CONCAT].appears)
     {
-        OPT_E allowed[] = {OPT_CONCAT, OPT_FILE};
+        OPT_E allowed[] = {OPT_CONCAT, OPT_FILE, OPT_ALIGN, OPT_DIRECT, OPT_MAX_MEMORY};
         if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
         {
             EXIT_EARLY;
         }
+        size_t align = 0;
+        if (!get_align(&opts[OPT_ALIGN], &align))
+        {
+            EXIT_EARLY;
+        }
 
         arch_array archs = {.arr = calloc(opts[OPT_CONCAT].arg_count, sizeof(arch_instance)), .len = opts[OPT_CONCAT].arg_count};
 
@@ -458,14 +693,51 @@ int main(int argc, char **argv)
                 arch_array_close(&archs);
                 EXIT_EARLY;
             }
+            archs.arr[i].no_cache = no_cache;
         }
 
-        arch_concat_archs(archname, archs);
+        bool merged = arch_concat_archs(archname, archs, align, no_cache, max_memory);
         arch_array_close(&archs);
+        if (!merged)
+        {
+            EXIT_EARLY;
+        }
     }
     else if (opts[OPT_APPEND].appears)
     {
-        OPT_E allowed[] = {OPT_APPEND, OPT_FILE};
+        OPT_E allowed[] = {OPT_APPEND, OPT_FILE, OPT_ALIGN, OPT_DIRECT, OPT_MAX_MEMORY};
+        if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
+        {
+            EXIT_EARLY;
+        }
+        if (opts[OPT_FILE].arg_count != 1)
+        {
+            fprintf(stderr, "Expected archive name\n");
+            EXIT_EARLY;
+        }
+        size_t align = 0;
+        if (!get_align(&opts[OPT_ALIGN], &align))
+        {
+            EXIT_EARLY;
+        }
+        arch_instance inst = arch_instance_create(opts[OPT_FILE].args[0], false);
+        if (!inst.f)
+        {
+            EXIT_EARLY;
+        }
+        arch_instance_set_align(&inst, align);
+        inst.no_cache = no_cache;
+        inst.max_memory = max_memory;
+        bool appended = arch_insert_files(&inst, (string_array){.arr = opts[OPT_APPEND].args, .len = opts[OPT_APPEND].arg_count});
+        arch_instance_close(&inst);
+        if (!appended)
+        {
+            EXIT_EARLY;
+        }
+    }
+    else if (opts[OPT_UPDATE].appears)
+    {
+        OPT_E allowed[] = {OPT_UPDATE, OPT_FILE, OPT_CHECKSUM, OPT_ALIGN, OPT_DIRECT, OPT_MAX_MEMORY};
         if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
         {
             EXIT_EARLY;
@@ -475,9 +747,143 @@ int main(int argc, char **argv)
             fprintf(stderr, "Expected archive name\n");
             EXIT_EARLY;
         }
+        if (opts[OPT_UPDATE].arg_count == 0)
+        {
+            fprintf(stderr, "Expected --update option to have at least one file\n");
+            EXIT_EARLY;
+        }
+        if (opts[OPT_CHECKSUM].arg_count != 0)
+        {
+            fprintf(stderr, "Expected --checksum option to have ZERO args\n");
+            EXIT_EARLY;
+        }
+        size_t align = 0;
+        if (!get_align(&opts[OPT_ALIGN], &align))
+        {
+            EXIT_EARLY;
+        }
         arch_instance inst = arch_instance_create(opts[OPT_FILE].args[0], false);
-        arch_insert_files(&inst, (string_array){.arr = opts[OPT_APPEND].args, .len = opts[OPT_APPEND].arg_count});
+        if (!inst.f)
+        {
+            EXIT_EARLY;
+        }
+        arch_instance_set_align(&inst, align);
+        inst.no_cache = no_cache;
+        inst.max_memory = max_memory;
+        bool updated = arch_update_files(&inst, (string_array){.arr = opts[OPT_UPDATE].args, .len = opts[OPT_UPDATE].arg_count}, opts[OPT_CHECKSUM].appears);
+        arch_instance_close(&inst);
+        if (!updated)
+        {
+            EXIT_EARLY;
+        }
+    }
+    else if (opts[OPT_REPAIR].appears)
+    {
+        OPT_E allowed[] = {OPT_REPAIR, OPT_FILE, OPT_DIRECT, OPT_MAX_MEMORY};
+        if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
+        {
+            EXIT_EARLY;
+        }
+        if (opts[OPT_REPAIR].arg_count != 0)
+        {
+            fprintf(stderr, "Expected --repair option to have ZERO args\n");
+            EXIT_EARLY;
+        }
+
+        arch_instance inst = arch_instance_create(archname, true);
+        if (!inst.f)
+        {
+            EXIT_EARLY;
+        }
+        inst.no_cache = no_cache;
+        inst.max_memory = max_memory;
+        bool repaired = arch_repair(&inst);
+        arch_instance_close(&inst);
+        if (!repaired)
+        {
+            EXIT_EARLY;
+        }
+    }
+    else if (opts[OPT_VERIFY].appears)
+    {
+        OPT_E allowed[] = {OPT_VERIFY, OPT_FILE, OPT_DIRECT, OPT_MAX_MEMORY};
+        if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
+        {
+            EXIT_EARLY;
+        }
+
+        arch_instance inst = arch_instance_create(archname, true);
+        if (!inst.f)
+        {
+            EXIT_EARLY;
+        }
+        inst.no_cache = no_cache;
+        inst.max_memory = max_memory;
+        bool verified = arch_verify(&inst, (string_array){.arr = opts[OPT_VERIFY].args, .len = opts[OPT_VERIFY].arg_count}, stdout);
         arch_instance_close(&inst);
+        if (!verified)
+        {
+            EXIT_EARLY;
+        }
+    }
+    else if (opts[OPT_SALVAGE].appears)
+    {
+        OPT_E allowed[] = {OPT_SALVAGE, OPT_FILE, OPT_MAX_MEMORY};
+        if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
+        {
+            EXIT_EARLY;
+        }
+        if (opts[OPT_SALVAGE].arg_count != 0)
+        {
+            fprintf(stderr, "Expected --salvage option to have ZERO args\n");
+            EXIT_EARLY;
+        }
+        if (!arch_salvage(archname, max_memory))
+        {
+            EXIT_EARLY;
+        }
+    }
+    else if (opts[OPT_CONTAINS].appears)
+    {
+        OPT_E allowed[] = {OPT_CONTAINS, OPT_FILE, OPT_MAX_MEMORY};
+        if (!check_no_args_except(opts, COUNT_OF(opts), allowed, COUNT_OF(allowed)))
+        {
+            EXIT_EARLY;
+        }
+        if (opts[OPT_CONTAINS].arg_count < 1)
+        {
+            fprintf(stderr, "Expected --contains option to have at least one arg = [filename]\n");
+            EXIT_EARLY;
+        }
+
+        // every archive of --file is asked, like grep -l: 1 when no archive has a name
+        ret_code = 1;
+        for (size_t i = 0; i < opts[OPT_FILE].arg_count; ++i)
+        {
+            arch_instance inst = arch_instance_create(opts[OPT_FILE].args[i], true);
+            if (!inst.f)
+            {
+                continue;
+            }
+            inst.max_memory = max_memory;
+            for (size_t name_i = 0; name_i < opts[OPT_CONTAINS].arg_count; ++name_i)
+            {
+                if (!arch_contains(&inst, opts[OPT_CONTAINS].args[name_i]))
+                {
+                    continue;
+                }
+                ret_code = 0;
+                if (opts[OPT_CONTAINS].arg_count == 1)
+                {
+                    fprintf(stdout, "%s\n", opts[OPT_FILE].args[i]);
+                }
+                else
+                {
+                    fprintf(stdout, "%s: %s\n", opts[OPT_FILE].args[i], opts[OPT_CONTAINS].args[name_i]);
+                }
+            }
+            arch_instance_close(&inst);
+        }
     }
     else
     {
@@ -487,9 +893,9 @@ int main(int argc, char **argv)
 early_exit:
     for (size_t i = 0; i < COUNT_OF(opts); ++i)
     {
-        free(opts[i].args);
         opts[i] = (cmd_opt){0};
     }
+    arena_free(&cli);
 
     return ret_code;
 }
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "encoding_decoding.h"
+
+// A burst of zeros over the end of the data of a parity group and the start
+// of its record, where the first copy of the chunk checks lies. Zeros decode
+// as a valid codeword, so only the checks or the parity blocks can tell.
+// No chunk may come back wrong without being counted as damaged; with the
+// second copy of the checks every chunk has to come back right.
+
+#define TEST_NAME "burst"
+#define TEST_SIZE (3 * 1024 * 1024)
+#define TEST_BYTES_PER_CHUNK 100 // the chunk size of archives by default
+
+typedef struct
+{
+    size_t failed;
+    size_t silent;
+} burst_result;
+
+// Zeros from..to of the encoded member around the record of group 0, relative to where the record starts
+burst_result burst_run(const uint8_t *src, config cnf, int64_t from, int64_t to)
+{
+    const size_t name_len = strlen(TEST_NAME);
+    const member_tag tag = {.member_id = 1, .name = TEST_NAME};
+    byte_buf enc = {0};
+    encode_member_buffer(src, TEST_SIZE, &enc, cnf, &tag, NULL, NULL);
+
+    size_t start, record_at, end;
+    calc_parity_span(TEST_SIZE, 0, name_len, cnf, &start, &record_at, &end);
+    const size_t zero_from = record_at + from, zero_to = (int64_t)record_at + to < (int64_t)end ? record_at + to : end;
+    memset(enc.ptr + zero_from, 0, zero_to - zero_from);
+
+    const size_t size = calc_parity_group_size(TEST_SIZE, 0, cnf);
+    uint8_t *dst = malloc(calc_parity_group_chunks(cnf) * cnf.BYTES_per_chunk);
+    bool *lost = calloc(size, sizeof(bool));
+    const decode_stats stats = decode_parity_group(enc.ptr + start, TEST_SIZE, name_len, 0, dst, lost, cnf);
+
+    burst_result r = {.failed = stats.failed};
+    for (size_t t = 0; t < size; ++t)
+    {
+        const size_t n = calc_chunk_bytes(TEST_SIZE, t, cnf);
+        r.silent += !lost[t] && memcmp(dst + t * cnf.BYTES_per_chunk, src + t * cnf.BYTES_per_chunk, n) != 0;
+    }
+    free(lost);
+    free(dst);
+    byte_buf_close(&enc);
+    return r;
+}
+
+bool burst_expect(const char *what, burst_result r, bool all_back)
+{
+    const bool ok = r.silent == 0 && (!all_back || r.failed == 0);
+    fprintf(stdout, "%-48s %5zu damaged %5zu silent  %s\n", what, r.failed, r.silent, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(void)
+{
+    uint8_t *src = malloc(TEST_SIZE);
+    uint64_t state = 0x5eed;
+    for (size_t i = 0; i < TEST_SIZE; ++i)
+    {
+        state += 0x9e3779b97f4a7c15ull;
+        src[i] = hash_mix64(state);
+    }
+
+    config cnf = config_new(TEST_BYTES_PER_CHUNK);
+    cnf.parity_data = PARITY_DEFAULT_DATA;
+    cnf.parity_count = PARITY_DEFAULT_COUNT;
+    bool ok = true;
+
+    // the layout archives get since the checks are kept twice
+    cnf.parity_checks_copy = true;
+    ok &= burst_expect("data tail and first checks, second copy", burst_run(src, cnf, -4000, 1000), true);
+    ok &= burst_expect("data tail and the whole record, second copy", burst_run(src, cnf, -4000, SIZE_MAX / 4), false);
+
+    // archives written before it: damage is found by the parity blocks alone
+    cnf.parity_checks_copy = false;
+    ok &= burst_expect("data tail and first checks, single copy", burst_run(src, cnf, -4000, 1000), false);
+    ok &= burst_expect("data tail and the whole record, single copy", burst_run(src, cnf, -4000, SIZE_MAX / 4), false);
+
+    free(src);
+    return ok ? 0 : 1;
+}